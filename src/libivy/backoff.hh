@@ -0,0 +1,57 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   backoff.hh
+ * @date   Oct 16, 2026
+ * @brief  Waits between retries of a failed request
+ */
+
+#ifndef IVY_HEADER_LIBIVY_BACKOFF_H__
+#define IVY_HEADER_LIBIVY_BACKOFF_H__
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+namespace libivy {
+  /**
+   * @brief Paces the retries of a request that failed for a transient
+   * reason, like a peer that isn't up yet. The wait doubles from
+   * MIN_DELAY to MAX_DELAY, and once the deadline passed the caller is
+   * told to give up.
+   */
+  class Backoff {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    static constexpr auto MIN_DELAY = std::chrono::milliseconds(1);
+    static constexpr auto MAX_DELAY = std::chrono::milliseconds(500);
+
+    /** @brief A zero \p timeout retries forever */
+    Backoff(std::chrono::milliseconds timeout)
+      : forever(timeout.count() == 0), deadline(clock::now() + timeout) {}
+
+    /** @brief Sleep before the next attempt, false past the deadline */
+    bool wait() {
+      auto now = clock::now();
+      if (!this->forever && now >= this->deadline)
+	return false;
+
+      auto delay = clock::duration(this->delay);
+      if (!this->forever)
+	delay = std::min(delay, this->deadline - now);
+
+      std::this_thread::sleep_for(delay);
+      this->delay = std::min(this->delay * 2, clock::duration(MAX_DELAY));
+
+      return true;
+    }
+
+  private:
+    bool forever;
+    clock::time_point deadline;
+    clock::duration delay = MIN_DELAY;
+  };
+} // namespace libivy
+
+#endif // IVY_HEADER_LIBIVY_BACKOFF_H__
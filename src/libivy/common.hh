@@ -29,11 +29,9 @@
   std::lock_guard<std::mutex>			\
   IVY_LINE_NAME(ivy_macro_lock_guard)((mtx))
 
-#define wait_lock(mtx)					\
-  while (!(mtx).try_lock()) {				\
-    DBGH << "Lock failed, sleeping" << std::endl;	\
-    std::this_thread::sleep_for(1s);			\
-  }
+/* Page locks queue their waiters, blocking is cheap */
+#define wait_lock(mtx)				\
+  (mtx).lock()
 
 template <typename T>
 static inline constexpr T pg_align(T addr) {
@@ -64,36 +62,7 @@ namespace libivy {
   };
 } // namespace libivy
 
-static inline std::string to_hex(const char *arr, size_t len) {
-  std::ostringstream ret;
-
-  for (size_t i = 0; i < len; ++i) {
-    std::ostringstream temp;
-    uint32_t elem = static_cast<uint8_t>(arr[i]);
-    
-    temp << std::hex << std::setfill('0') << std::setw(2)
-	 << std::uppercase << elem;
-    
-    ret << temp.str();
-  }
-  
-  return ret.str();
-}
-
-static inline char *from_hex(const std::string& s) {
-  auto ret = new char[s.size()];
-
-  for (size_t i = 0; i < s.size(); i+=2) {
-    char cur_slice_raw[3] = {s[i], s[i+1], 0};
-    std::string cur_slice = std::string(cur_slice_raw);
-
-    ret[i/2] = std::stoul(cur_slice, nullptr, 16);
-  }
-  
-  return ret;
-}
-
-static inline void dump_from_hex(const std::string &s) {
+static inline void dump_page(const std::string &s) {
   return;
   
   std::cerr << std::endl;
@@ -103,22 +72,23 @@ static inline void dump_from_hex(const std::string &s) {
   std::memset(&hr_form, '.', 16);
   hr_form[16] = 0;
   
-  for (size_t i = 0; i < s.length()/2; i+=2) {
-    if (i % 32 == 0 && i != 0) {
+  for (size_t i = 0; i < s.length(); i++) {
+    if (i % 16 == 0 && i != 0) {
       std::cerr << "  " << std::string(hr_form) << std::endl;
       std::memset(&hr_form, '.', 16);
       hr_form[16] = 0;
     }
     
-    if (i % 16 == 0 && i % 32 != 0 && i != 0) std::cerr << "    ";
+    if (i % 8 == 0 && i % 16 != 0) std::cerr << "    ";
 
-    char raw_seq[3] = {s[i], s[i+1], 0};
-    char raw_char = std::stoul(std::string(raw_seq), nullptr, 16);
+    char raw_char = s[i];
 
     if (raw_char >= ' ' && raw_char <= '~')
-      hr_form[(i/2)%16] = raw_char;
+      hr_form[i%16] = raw_char;
 
-    std::cerr << s[i] << s[i+1] << " ";
+    std::cerr << std::hex << std::setfill('0') << std::setw(2)
+	      << std::uppercase << (uint32_t)(uint8_t)raw_char
+	      << std::dec << " ";
   }
 
   std::cerr << std::endl;
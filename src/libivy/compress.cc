@@ -0,0 +1,260 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   compress.cc
+ * @date   Oct 16, 2026
+ * @brief  LZ compression for page payloads
+ */
+
+#include "error.hh"
+#include "../common.hh"
+#include "compress.hh"
+
+#include <algorithm>
+#include <vector>
+
+#include <time.h>
+
+using namespace libivy;
+
+static constexpr size_t MIN_MATCH = 4;
+static constexpr size_t MAX_OFFSET = UINT16_MAX;
+static constexpr size_t HASH_BITS = 12;
+
+static inline uint64_t thread_cpu_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint32_t load32(const char *p) {
+  uint32_t val;
+  std::memcpy(&val, p, sizeof(val));
+  return val;
+}
+
+static inline size_t hash32(uint32_t seq) {
+  return (seq * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/** @brief Lengths past 15 continue in bytes of 255 */
+static inline void put_len(string &out, size_t len) {
+  while (len >= 255) {
+    out.push_back(static_cast<char>(255));
+    len -= 255;
+  }
+  out.push_back(static_cast<char>(len));
+}
+
+static void put_seq(string &out, const char *lit, size_t lit_len,
+		    size_t offset, size_t match_len) {
+  size_t ml = match_len - MIN_MATCH;
+  uint8_t token = (std::min<size_t>(lit_len, 15) << 4)
+    | std::min<size_t>(ml, 15);
+
+  out.push_back(static_cast<char>(token));
+  if (lit_len >= 15) put_len(out, lit_len - 15);
+
+  out.append(lit, lit_len);
+
+  out.push_back(static_cast<char>(offset & 0xff));
+  out.push_back(static_cast<char>(offset >> 8));
+  if (ml >= 15) put_len(out, ml - 15);
+}
+
+string libivy::lz_compress(const char *src, size_t len) {
+  string out;
+  out.reserve(len);
+
+  /* Position + 1 of the last place each hash was seen, 0 is empty */
+  std::vector<uint32_t> table(1 << HASH_BITS, 0);
+
+  size_t anchor = 0, ip = 0;
+
+  while (ip + MIN_MATCH <= len) {
+    auto seq = load32(src + ip);
+    auto &slot = table[hash32(seq)];
+    size_t ref = slot;
+    slot = ip + 1;
+
+    if (ref == 0 || ip - (ref - 1) > MAX_OFFSET
+	|| load32(src + ref - 1) != seq) {
+      ip++;
+      continue;
+    }
+    ref--;
+
+    size_t match_len = MIN_MATCH;
+    while (ip + match_len < len && src[ref + match_len] == src[ip + match_len])
+      match_len++;
+
+    put_seq(out, src + anchor, ip - anchor, ip - ref, match_len);
+
+    ip += match_len;
+    anchor = ip;
+
+    if (out.size() >= len)
+      return "";
+  }
+
+  /* The last sequence only has literals */
+  size_t lit_len = len - anchor;
+  out.push_back(static_cast<char>(std::min<size_t>(lit_len, 15) << 4));
+  if (lit_len >= 15) put_len(out, lit_len - 15);
+  out.append(src + anchor, lit_len);
+
+  if (out.size() >= len)
+    return "";
+
+  return out;
+}
+
+res_t<string> libivy::lz_decompress(const string &src, size_t out_len) {
+  string out;
+  out.reserve(out_len);
+
+  size_t ip = 0;
+  const size_t end = src.size();
+
+  auto get_len = [&](size_t &len) -> bool {
+    uint8_t byte;
+    do {
+      if (ip >= end) return false;
+      byte = static_cast<uint8_t>(src[ip++]);
+      len += byte;
+    } while (byte == 255);
+    return true;
+  };
+
+  while (ip < end) {
+    uint8_t token = static_cast<uint8_t>(src[ip++]);
+
+    size_t lit_len = token >> 4;
+    if (lit_len == 15 && !get_len(lit_len))
+      return {"", "Truncated literal length"};
+
+    if (ip + lit_len > end || out.size() + lit_len > out_len)
+      return {"", "Literals run past the end"};
+
+    out.append(src, ip, lit_len);
+    ip += lit_len;
+
+    if (ip == end)
+      break;
+
+    if (ip + 2 > end)
+      return {"", "Truncated match offset"};
+
+    size_t offset = static_cast<uint8_t>(src[ip])
+      | (static_cast<uint8_t>(src[ip + 1]) << 8);
+    ip += 2;
+
+    size_t match_len = token & 0xf;
+    if (match_len == 15 && !get_len(match_len))
+      return {"", "Truncated match length"};
+    match_len += MIN_MATCH;
+
+    if (offset == 0 || offset > out.size()
+	|| out.size() + match_len > out_len)
+      return {"", "Match out of bounds"};
+
+    /* Matches may overlap what they produce, copy a byte at a time */
+    size_t from = out.size() - offset;
+    for (size_t i = 0; i < match_len; i++)
+      out.push_back(out[from + i]);
+  }
+
+  if (out.size() != out_len)
+    return {"", "Decompressed " + std::to_string(out.size())
+	    + " bytes, expected " + std::to_string(out_len)};
+
+  return {out, {}};
+}
+
+bool LzPolicy::should_try() {
+  switch (this->mode) {
+  case LZ_OFF:
+    return false;
+  case LZ_ON:
+    return true;
+  case LZ_ADAPTIVE:
+    break;
+  }
+
+  auto left = this->skip_left.load();
+  while (left > 0) {
+    if (this->skip_left.compare_exchange_weak(left, left - 1))
+      return false;
+  }
+
+  return true;
+}
+
+void LzPolicy::record(size_t in_len, size_t out_len) {
+  if (this->mode != LZ_ADAPTIVE)
+    return;
+
+  /* Less than 1/8th saved isn't worth the CPU, skip the next few
+     payloads and back off further every time that repeats */
+  if (out_len == 0 || out_len * 8 > in_len * 7) {
+    auto cur = this->backoff.load();
+    this->skip_left = cur;
+    this->backoff = std::min(cur * 2, MAX_BACKOFF);
+  } else {
+    this->backoff = 1;
+  }
+}
+
+void libivy::lz_pack(msg_t &msg, LzPolicy &policy, IvyStats &stats) {
+  if (msg.payload.empty() || !policy.should_try())
+    return;
+
+  auto start = thread_cpu_ns();
+  auto packed = lz_compress(msg.payload.data(), msg.payload.size());
+  stats.lz_cpu_ns += thread_cpu_ns() - start;
+
+  policy.record(msg.payload.size(), packed.size());
+
+  if (packed.empty()) {
+    stats.lz_skipped++;
+    return;
+  }
+
+  stats.lz_sent++;
+  stats.lz_in_bytes += msg.payload.size();
+  stats.lz_out_bytes += packed.size() + sizeof(uint32_t);
+
+  uint32_t raw_len = msg.payload.size();
+  msg.payload.assign(reinterpret_cast<char*>(&raw_len), sizeof(raw_len));
+  msg.payload += packed;
+  msg.hdr.flags |= MSG_F_LZ;
+}
+
+mres_t libivy::lz_unpack(msg_t &msg, IvyStats &stats, size_t max_len) {
+  if (!(msg.hdr.flags & MSG_F_LZ))
+    return {};
+
+  uint32_t raw_len;
+  if (msg.payload.size() < sizeof(raw_len))
+    return {"Compressed payload too short"};
+
+  std::memcpy(&raw_len, msg.payload.data(), sizeof(raw_len));
+
+  /* The size is reserved up front, don't trust it past a frame */
+  if (raw_len > max_len)
+    return {"Compressed payload claims " + std::to_string(raw_len)
+	    + " bytes"};
+
+  auto start = thread_cpu_ns();
+  auto [raw, err] = lz_decompress(msg.payload.substr(sizeof(raw_len)),
+				  raw_len);
+  stats.lz_cpu_ns += thread_cpu_ns() - start;
+
+  if (err.has_value())
+    return err;
+
+  msg.payload = std::move(raw);
+  msg.hdr.flags &= ~MSG_F_LZ;
+
+  return {};
+}
@@ -0,0 +1,78 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   compress.hh
+ * @date   Oct 16, 2026
+ * @brief  LZ compression for page payloads
+ */
+
+#ifndef IVY_HEADER_LIBIVY_COMPRESS_H__
+#define IVY_HEADER_LIBIVY_COMPRESS_H__
+
+#include "common.hh"
+#include "stats.hh"
+#include "wire.hh"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace libivy {
+  using std::string;
+
+  /**
+   * @brief Compress \p len bytes with a byte oriented LZ77 codec.
+   *
+   * The format follows LZ4 blocks: a token with the literal count in
+   * the high nibble and the match length (minus 4) in the low one,
+   * the literals, then a 16 bit offset back into the output. Returns
+   * an empty string if the result wouldn't be smaller than the input.
+   */
+  string lz_compress(const char *src, size_t len);
+
+  /** @brief Undo \ref lz_compress , \p out_len is the original size */
+  res_t<string> lz_decompress(const string &src, size_t out_len);
+
+  enum IvyCompression {
+    LZ_OFF,       /* Send payloads as they are */
+    LZ_ON,        /* Compress every payload */
+    LZ_ADAPTIVE,  /* Back off while payloads don't compress */
+  };
+
+  /** @brief Decides which payloads are worth compressing */
+  class LzPolicy {
+  public:
+    IvyCompression get_mode() const { return this->mode; }
+    void set_mode(IvyCompression mode) { this->mode = mode; }
+
+    /** @brief Should the next payload be compressed */
+    bool should_try();
+
+    /** @brief Feed back the sizes of a compression attempt */
+    void record(size_t in_len, size_t out_len);
+
+  private:
+    /* Skip at most this many payloads after a miss */
+    static constexpr uint32_t MAX_BACKOFF = 256;
+
+    IvyCompression mode = LZ_OFF;
+    std::atomic<uint32_t> skip_left = 0;
+    std::atomic<uint32_t> backoff = 1;
+  };
+
+  /**
+   * @brief Compress the payload of \p msg in place if \p policy says
+   * so and it gets smaller. A compressed payload is flagged MSG_F_LZ
+   * and starts with its original size as 32 bits.
+   */
+  void lz_pack(msg_t &msg, LzPolicy &policy, IvyStats &stats);
+
+  /**
+   * @brief Restore a payload packed by \ref lz_pack , refusing one
+   * that claims to be longer than \p max_len
+   */
+  mres_t lz_unpack(msg_t &msg, IvyStats &stats,
+		   size_t max_len = MAX_PAYLOAD);
+} // namespace libivy
+
+#endif // IVY_HEADER_LIBIVY_COMPRESS_H__
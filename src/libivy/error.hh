@@ -9,6 +9,7 @@
 #ifndef IVY_HEADER_LIBIVY_ERROR_H__
 #define IVY_HEADER_LIBIVY_ERROR_H__
 
+#include <cassert>
 #include <cstring>
 
 #define IVY_ERROR(msg)				\
@@ -0,0 +1,83 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   falseshare.cc
+ * @date   Oct 16, 2026
+ * @brief  Sub-block write tracking to find falsely shared blocks
+ */
+
+#include "error.hh"
+#include "../common.hh"
+#include "falseshare.hh"
+
+#include <sstream>
+
+using namespace libivy;
+
+void SubBlockTracker::twin(uint64_t addr, const char *blk) {
+  ivyguard(this->lock);
+
+  this->twins[addr].assign(blk, this->blk_sz);
+}
+
+uint64_t SubBlockTracker::take_mask(uint64_t addr, const char *blk) {
+  ivyguard(this->lock);
+
+  auto it = this->twins.find(addr);
+  if (it == this->twins.end())
+    return 0;
+
+  uint64_t mask = 0;
+  const char *twin = it->second.data();
+
+  for (size_t i = 0; i * this->sub_sz < this->blk_sz; i++) {
+    auto off = i * this->sub_sz;
+
+    if (std::memcmp(twin + off, blk + off, this->sub_sz) != 0)
+      mask |= 1ull << i;
+  }
+
+  this->twins.erase(it);
+
+  return mask;
+}
+
+bool SubBlockTracker::record(uint64_t addr, uint64_t node, uint64_t mask) {
+  ivyguard(this->lock);
+
+  /* Read only hand-offs say nothing about who writes what */
+  if (mask == 0)
+    return false;
+
+  auto &w = this->writes[addr];
+  bool disjoint = false;
+
+  if (w.mask != 0 && w.node != node) {
+    w.handoffs++;
+
+    disjoint = (w.mask & mask) == 0;
+    if (disjoint)
+      w.disjoint++;
+  }
+
+  w.node = node;
+  w.mask = mask;
+
+  return disjoint;
+}
+
+string SubBlockTracker::report() {
+  ivyguard(this->lock);
+
+  std::ostringstream out;
+
+  for (auto &[addr, w] : this->writes) {
+    if (w.disjoint == 0)
+      continue;
+
+    out << "fs_block 0x" << std::hex << addr << std::dec << " " << w.disjoint
+	<< " " << w.handoffs << "\n";
+  }
+
+  return out.str();
+}
@@ -0,0 +1,79 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   falseshare.hh
+ * @date   Oct 16, 2026
+ * @brief  Sub-block write tracking to find falsely shared blocks
+ */
+
+#ifndef IVY_HEADER_LIBIVY_FALSESHARE_H__
+#define IVY_HEADER_LIBIVY_FALSESHARE_H__
+
+#include "common.hh"
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace libivy {
+  using std::string;
+
+  /**
+   * @brief Finds out which sub-blocks each writer of a block touched.
+   *
+   * The writer twins a block when it is granted write access and,
+   * once the block is taken away, compares it with the twin one
+   * sub-block at a time. The resulting mask goes to the node serving
+   * the request, which compares it with the mask of the writer before.
+   * Two writers from different nodes with disjoint masks are a case of
+   * false sharing: the block moved although they never touched the
+   * same bytes.
+   */
+  class SubBlockTracker {
+  public:
+    /* Bits in a mask, a block has at most this many sub-blocks */
+    static constexpr size_t MAX_SUBBLKS = 64;
+
+    SubBlockTracker(size_t blk_sz, size_t sub_sz)
+      : blk_sz(blk_sz), sub_sz(sub_sz) {}
+
+    /** @brief Keep \p blk as it was when write access was granted */
+    void twin(uint64_t addr, const char *blk);
+
+    /**
+     * @brief Sub-blocks that differ between \p blk and its twin, one
+     * bit each, and drop the twin. 0 if there was none.
+     */
+    uint64_t take_mask(uint64_t addr, const char *blk);
+
+    /**
+     * @brief Record that \p node wrote \p mask of \p addr before it
+     * was taken away, true if the writer before it on another node
+     * wrote none of these sub-blocks
+     */
+    bool record(uint64_t addr, uint64_t node, uint64_t mask);
+
+    /**
+     * @brief One "fs_block address disjoint handoffs" line per block
+     * that changed hands between writers of disjoint sub-blocks
+     */
+    string report();
+
+  private:
+    struct writes_t {
+      uint64_t node = 0;
+      uint64_t mask = 0;
+      uint64_t handoffs = 0;
+      uint64_t disjoint = 0;
+    };
+
+    size_t blk_sz;
+    size_t sub_sz;
+    std::mutex lock;
+    std::map<uint64_t, string> twins;
+    std::map<uint64_t, writes_t> writes;
+  };
+} // namespace libivy
+
+#endif // IVY_HEADER_LIBIVY_FALSESHARE_H__
@@ -0,0 +1,35 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   ivypagetbl.cc
+ * @date   Oct 16, 2026
+ * @brief  Directory of the blocks in the shared region
+ */
+
+#include "error.hh"
+#include "../common.hh"
+#include "ivypagetbl.hh"
+
+using namespace libivy;
+
+IvyPageTable::IvyPageTable(addr_t base, size_t region_sz, size_t blk_sz)
+  : base(base), blk_sz(blk_sz),
+    blk_cnt((region_sz + blk_sz - 1) / blk_sz),
+    entries(std::make_unique<entry_t[]>(this->blk_cnt)),
+    colds(std::make_unique<cold_t[]>(this->blk_cnt)) {}
+
+size_t IvyPageTable::index(addr_t addr) {
+  auto idx = (addr - this->base) / this->blk_sz;
+  IVY_ASSERT(addr >= this->base && idx < this->blk_cnt,
+	     "Address " + std::to_string(addr) + " outside the region");
+
+  return idx;
+}
+
+IvyPageTable::entry_t &IvyPageTable::entry(addr_t addr) {
+  return this->entries[this->index(addr)];
+}
+
+IvyPageTable::cold_t &IvyPageTable::cold(addr_t addr) {
+  return this->colds[this->index(addr)];
+}
@@ -3,41 +3,154 @@
 /**
  * @file   ivypagetbl.hh
  * @date   May 16, 2021
- * @brief  Brief description here
+ * @brief  Directory of the blocks in the shared region
  */
 
 #ifndef IVY_HEADER_LIBIVY_IVYPAGETBL_H__
 #define IVY_HEADER_LIBIVY_IVYPAGETBL_H__
 
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <set>
-#include <map>
 
 #include "common.hh"
+#include "pagelock.hh"
 
 namespace libivy {
-  using std::map;
   using std::mutex;
   using std::string;
   using std::set;
   
+  /**
+   * @brief Directory of the blocks in the shared region, one entry per
+   * block in a flat array indexed by block number. Entries are made
+   * up front, so looking one up from the fault handler or an RPC
+   * thread never allocates and never races with another lookup.
+   */
   class IvyPageTable {
   public:
+    using addr_t = uint64_t;
+
+    /* Where the manager is in serving a request for the block */
+    enum dir_state_t : uint8_t {
+      DIR_IDLE,         /* Nothing in flight */
+      DIR_FETCHING,     /* Read, waiting for the owner's copy */
+      DIR_INVALIDATING, /* Write, waiting for the owner's copy and the
+			   invalidation acks */
+      DIR_UPDATING,     /* Write update, waiting for every copy */
+      DIR_CONFIRMING,   /* Answered, waiting for the requester to
+			   install what it got */
+    };
+
+    /* A request that came in while another one was in flight */
+    struct dir_wait_t {
+      dir_state_t state;           /* What it takes the block to */
+      std::function<void()> start;
+    };
+
+    /* Read or written on every fault and request */
     struct info_t {
-      // /* Struct with mutex can't have copy constructor */
-      // info_t (const info_t&) = delete;
-      // info_t& operator=(const info_t&) = delete;
-      
-      set<size_t> copyset; // Set of node ids
-      IvyAccessType access;
       idx_t owner;
+      uint64_t version; // Bumped on every write grant
+
+      // Dynamic manager: best guess of the owner, requests are sent
+      // here and passed along until they reach the owner
+      std::atomic<idx_t> prob_owner;
+
+      IvyAccessType access;
+
+      // FAULT_* bits, lets an invalidation skip a fault in progress
+      std::atomic<uint8_t> fault_state;
+
+      // Manager: the protocol step of the block, under the info lock.
+      // Nothing is held while it waits on other nodes, requests that
+      // come in meanwhile queue up in cold_t::dir_queue.
+      dir_state_t dir_state = DIR_IDLE;
     };
-  
-    using addr_t = uint64_t;
-  
-    map<addr_t, mutex> page_locks;
-    map<addr_t, mutex> info_locks;
-    map<addr_t, info_t> info;
+
+    /* Containers and the fields only some steps of the protocol touch,
+       under the info lock like info_t */
+    struct cold_t {
+      set<size_t> copyset; // Set of node ids
+
+      // When the current writer got the page, 0 once it lost write
+      // access, and how long it keeps it before a request is served
+      uint64_t granted_ns;
+      uint64_t pin_ns;
+
+      // Manager: who has to confirm in DIR_CONFIRMING, and the requests
+      // waiting for the one in flight
+      idx_t dir_requester = 0;
+      std::deque<dir_wait_t> dir_queue;
+
+      // Manager: a write update reached the copies, the block isn't
+      // zero even if version is
+      bool updated = false;
+
+      // Requester: manager to confirm the grant to once the fault is
+      // done with the page
+      std::optional<idx_t> confirm_to;
+    };
+
+    /* A fault on this node holds the page lock */
+    static constexpr uint8_t FAULT_ACTIVE = 1 << 0;
+
+    /* Invalidated while the fault was waiting, drop the copy after */
+    static constexpr uint8_t FAULT_INVAL  = 1 << 1;
+
+    /**
+     * @brief A block's locks and hot state, one cache line per block so
+     * faults on neighbouring blocks don't share lines. The containers
+     * would take lines of their own and only matter to some steps,
+     * they live in a side table of \ref cold_t indexed the same way.
+     */
+    struct alignas(64) entry_t {
+      /* Recursive, the owner takes it again to fetch its own copy in
+	 the dynamic manager mode */
+      PageLock page_lock;
+      PageLock info_lock;
+      info_t info;
+    };
+
+    static_assert(sizeof(entry_t) == 64, "entry_t outgrew a cache line");
+
+    /** @brief One member of every entry, indexed by address */
+    template <typename T, T entry_t::*member>
+    class column_t {
+    public:
+      column_t(IvyPageTable &tbl) : tbl(tbl) {}
+
+      T &operator[](addr_t addr) { return this->tbl.entry(addr).*member; }
+
+    private:
+      IvyPageTable &tbl;
+    };
+
+    IvyPageTable(addr_t base, size_t region_sz, size_t blk_sz);
+
+    /** @brief Entry of the block \p addr is in */
+    entry_t &entry(addr_t addr);
+
+    column_t<PageLock, &entry_t::page_lock> page_locks{*this};
+    column_t<PageLock, &entry_t::info_lock> info_locks{*this};
+    column_t<info_t, &entry_t::info> info{*this};
+
+    /** @brief Cold half of the entry of the block \p addr is in */
+    cold_t &cold(addr_t addr);
+
+  private:
+    /** @brief Block number of \p addr, asserts it is in the region */
+    size_t index(addr_t addr);
+
+    addr_t base;
+    size_t blk_sz;
+    size_t blk_cnt;
+    std::unique_ptr<entry_t[]> entries;
+    std::unique_ptr<cold_t[]> colds;
   };
 
 }
@@ -10,6 +10,7 @@
 #include "error.hh"
 #include "libivy.hh"
 
+#include <algorithm>
 #include <csignal>
 #include <filesystem>
 #include <fstream>
@@ -40,6 +41,25 @@ using std::vector;
 
 static Ivy *ivy_static_obj = nullptr;
 
+/* Trap flag in EFLAGS, raises SIGTRAP after the next instruction */
+static constexpr greg_t EFL_TF = 0x100;
+
+/* Store to a write-update page being single stepped by this thread */
+struct wu_step_t {
+  uint64_t addr = 0;
+  string twin;
+};
+
+static thread_local wu_step_t wu_step;
+
+/* Read faults of this thread, to spot a scan */
+struct pf_stream_t {
+  uint64_t last = 0;
+  int64_t stride = 0;
+};
+
+static thread_local pf_stream_t pf_stream;
+
 Ivy::Ivy(std::string cfg_f, idx_t id) {
   DBGH << "Created Ivy " << (void_ptr)this << std::endl;
   
@@ -57,19 +77,219 @@ Ivy::Ivy(std::string cfg_f, idx_t id) {
   /* Read the configuration file */
   cfg_obj >> this->cfg;
 
+  rpc_cfg_t rpc_cfg;
+
   try {
     this->nodes = this->cfg[NODES_KEY].get<vector<string>>();
     this->manager_id = this->cfg[MANAGER_ID_KEY].get<uint64_t>();
     this->region_sz = this->cfg[REGION_SZ_KEY].get<uint64_t>();
     
+    /* Optional: coherence unit in bytes, a multiple of the page size.
+       Faults, directory entries and transfers all work on blocks. */
+    if (this->cfg.contains(BLOCK_SZ_KEY)) {
+      this->blk_sz = this->cfg[BLOCK_SZ_KEY].get<uint64_t>();
+
+      if (this->blk_sz == 0 || this->blk_sz % PAGE_SZ != 0)
+	IVY_ERROR("block_sz must be a multiple of "
+		  + std::to_string(PAGE_SZ));
+    }
+
+    /* Optional: sub-block size to track writes at, reports blocks
+       that move between writers of disjoint sub-blocks */
+    if (this->cfg.contains(SUBBLOCK_SZ_KEY)) {
+      this->subblk_sz = this->cfg[SUBBLOCK_SZ_KEY].get<uint64_t>();
+
+      if (this->subblk_sz == 0 || this->blk_sz % this->subblk_sz != 0
+	  || this->blk_sz / this->subblk_sz > SubBlockTracker::MAX_SUBBLKS)
+	IVY_ERROR("subblock_sz must divide block_sz in at most "
+		  + std::to_string(SubBlockTracker::MAX_SUBBLKS) + " parts");
+    }
+
     DBGH << "Original region sz = " << this->region_sz << std::endl;    
-    this->region_sz = pg_align(this->region_sz);
+    this->region_sz = this->blk_align(this->region_sz);
 
     DBGH << "New region sz = " << this->region_sz << std::endl;
-    
+
     auto base_addr_str = this->cfg[BASE_ADDR].get<string>();
     auto base_addr_ul = std::stoul(base_addr_str, nullptr, 16);
     this->base_addr = reinterpret_cast<void_ptr>(base_addr_ul);
+
+    if (this->blk_align(base_addr_ul) != base_addr_ul)
+      IVY_ERROR("base_addr must be aligned to block_sz");
+
+    /* Optional: how to reach nodes running on this host, "uds"
+       (default) or "tcp" to force loopback */
+    if (this->cfg.contains(LOCAL_TRANSPORT_KEY)) {
+      auto transport = this->cfg[LOCAL_TRANSPORT_KEY].get<string>();
+
+      if (transport == "uds") {
+	rpc_cfg.same_host_uds = true;
+      } else if (transport == "tcp") {
+	rpc_cfg.same_host_uds = false;
+      } else {
+	IVY_ERROR("Unknown local_transport " + transport);
+      }
+    }
+
+    /* Optional: "threads" (default) runs a reader thread per
+       connection, "io_uring" serves all of them from one ring */
+    if (this->cfg.contains(IO_BACKEND_KEY)) {
+      auto backend = this->cfg[IO_BACKEND_KEY].get<string>();
+
+      if (backend == "threads") {
+	rpc_cfg.io_uring = false;
+      } else if (backend == "io_uring") {
+	rpc_cfg.io_uring = true;
+      } else {
+	IVY_ERROR("Unknown io_backend " + backend);
+      }
+    }
+
+    /* Optional: keep copies of invalidated pages and re-fetch them as
+       diffs, off by default */
+    if (this->cfg.contains(PAGE_DIFF_KEY)) {
+      this->page_diff = this->cfg[PAGE_DIFF_KEY].get<bool>();
+    }
+
+    /* Optional: "central" (default) keeps the whole directory on
+       manager_id, "fixed" spreads it over all nodes by page number,
+       "dynamic" has no directory, requests chase the owner */
+    if (this->cfg.contains(MANAGER_MODE_KEY)) {
+      auto mode = this->cfg[MANAGER_MODE_KEY].get<string>();
+
+      if (mode == "central") {
+	this->mngr_mode = MNGR_CENTRAL;
+      } else if (mode == "fixed") {
+	this->mngr_mode = MNGR_FIXED;
+      } else if (mode == "dynamic") {
+	this->mngr_mode = MNGR_DYNAMIC;
+      } else {
+	IVY_ERROR("Unknown manager_mode " + mode);
+      }
+    }
+
+    /* Optional: serve the page requests this node manages on this
+       many pinned threads, each owning a share of the blocks. 0
+       (default) serves them on the shared worker pool. */
+    if (this->cfg.contains(MNGR_SHARDS_KEY)) {
+      rpc_cfg.mngr_shards = this->cfg[MNGR_SHARDS_KEY].get<size_t>();
+
+      /* Forwarded requests can come back around to a busy shard */
+      if (rpc_cfg.mngr_shards != 0 && this->mngr_mode == MNGR_DYNAMIC)
+	IVY_ERROR("manager_shards needs a central or fixed manager");
+    }
+    rpc_cfg.shard_unit = this->blk_sz;
+
+    /* Optional: "relay" (default) passes pages through the manager,
+       "direct" has the owner send them to the faulting node */
+    if (this->cfg.contains(PAGE_TRANSFER_KEY)) {
+      auto mode = this->cfg[PAGE_TRANSFER_KEY].get<string>();
+
+      if (mode == "relay") {
+	this->direct_xfer = false;
+      } else if (mode == "direct") {
+	this->direct_xfer = true;
+      } else {
+	IVY_ERROR("Unknown page_transfer " + mode);
+      }
+    }
+
+    /* Optional: "sequential" (default), "release", which lets
+       several nodes write a page between acquire() and release(), or
+       "lazy_release" where acquiring a lock only drops the pages
+       written under it */
+    if (this->cfg.contains(CONSISTENCY_KEY)) {
+      auto model = this->cfg[CONSISTENCY_KEY].get<string>();
+
+      if (model == "sequential") {
+	this->consistency = CONS_SEQUENTIAL;
+      } else if (model == "release") {
+	this->consistency = CONS_RELEASE;
+      } else if (model == "lazy_release") {
+	this->consistency = CONS_LAZY;
+      } else {
+	IVY_ERROR("Unknown consistency " + model);
+      }
+    }
+
+    /* Optional: how long a fault keeps retrying a request that
+       failed before it gives up */
+    if (this->cfg.contains(RETRY_TIMEOUT_KEY)) {
+      this->retry_timeout = std::chrono::milliseconds(
+	this->cfg[RETRY_TIMEOUT_KEY].get<uint64_t>());
+    }
+
+    /* Optional: once a thread reads blocks at a constant stride,
+       fetch this many blocks ahead of it, off by default */
+    if (this->cfg.contains(PREFETCH_KEY)) {
+      this->pf_depth = this->cfg[PREFETCH_KEY].get<uint64_t>();
+    }
+
+    /* Optional: keep ownership with a writer for at least this long,
+       doubling up to pin_window_max_us for pages that thrash */
+    if (this->cfg.contains(PIN_WINDOW_KEY)) {
+      auto min_us = this->cfg[PIN_WINDOW_KEY].get<uint64_t>();
+      auto max_us = min_us;
+
+      if (this->cfg.contains(PIN_WINDOW_MAX_KEY))
+	max_us = this->cfg[PIN_WINDOW_MAX_KEY].get<uint64_t>();
+
+      this->pin_policy.configure(min_us * 1000, max_us * 1000);
+    }
+
+    /* Optional: ranges kept coherent by pushing every store to the
+       readers instead of invalidating them, a list of
+       {"start": "0x...", "size": bytes} */
+    if (this->cfg.contains(WRITE_UPDATE_KEY)) {
+      for (auto &range : this->cfg[WRITE_UPDATE_KEY]) {
+	auto start = std::stoul(range["start"].get<string>(), nullptr, 16);
+	auto size = range["size"].get<uint64_t>();
+
+	this->wu_ranges.push_back({this->blk_align(start),
+				   this->blk_align(start + size + this->blk_sz
+						   - 1)});
+      }
+
+      if (!this->wu_ranges.empty()
+	  && (this->mngr_mode == MNGR_DYNAMIC
+	      || this->consistency != CONS_SEQUENTIAL)) {
+	IVY_ERROR("write_update needs a central or fixed manager and"
+		  " sequential consistency");
+      }
+    }
+
+    /* Optional: "sigsegv" (default) serves faults in a signal
+       handler, "userfaultfd" on a thread reading fault events */
+    if (this->cfg.contains(FAULT_ENGINE_KEY)) {
+      auto engine = this->cfg[FAULT_ENGINE_KEY].get<string>();
+
+      if (engine == "userfaultfd") {
+	/* Write-update applies stores to pages we have no access to,
+	   which userfaultfd leaves unmapped */
+	if (!this->wu_ranges.empty())
+	  IVY_ERROR("userfaultfd doesn't support write_update");
+
+	this->uffd = std::make_unique<UffdEngine>();
+      } else if (engine != "sigsegv") {
+	IVY_ERROR("Unknown fault_engine " + engine);
+      }
+    }
+
+    /* Optional: compress page payloads, "off" (default), "on" or
+       "adaptive" to stop trying while pages don't compress */
+    if (this->cfg.contains(COMPRESSION_KEY)) {
+      auto mode = this->cfg[COMPRESSION_KEY].get<string>();
+
+      if (mode == "off") {
+	this->lz_policy.set_mode(LZ_OFF);
+      } else if (mode == "on") {
+	this->lz_policy.set_mode(LZ_ON);
+      } else if (mode == "adaptive") {
+	this->lz_policy.set_mode(LZ_ADAPTIVE);
+      } else {
+	IVY_ERROR("Unknown compression " + mode);
+      }
+    }
     
   } catch (nlohmann::json::exception &e) {
     IVY_ERROR("Config file has wrong format.");
@@ -79,10 +299,22 @@ Ivy::Ivy(std::string cfg_f, idx_t id) {
     IVY_ERROR("Node id cannot be greater than total number of nodes");
   }
 
+  /* A block with the run headers of a diff of it and the size of a
+     compressed one, or a lock's write notices listing every block */
+  this->max_payload = std::max<uint64_t>({
+      MAX_PAYLOAD,
+      this->blk_sz + 4 * (this->blk_sz / UINT16_MAX + 1) + sizeof(uint32_t),
+      (this->region_sz / this->blk_sz) * sizeof(uint64_t)});
+
+  if (this->max_payload > UINT32_MAX)
+    IVY_ERROR("block_sz or region_sz too large for a frame");
+
+  rpc_cfg.max_payload = this->max_payload;
+
   this->id = id;
   this->addr = this->nodes[id];
   this->rpcserver
-    = std::make_unique<RpcServer>(this->nodes, this->id);
+    = std::make_unique<RpcServer>(this->nodes, this->id, rpc_cfg);
   
   auto err = this->reg_fault_hdlr();
 
@@ -90,58 +322,160 @@ Ivy::Ivy(std::string cfg_f, idx_t id) {
     IVY_ERROR(PSTR());
   }
 
-  this->pg_tbl = std::make_unique<IvyPageTable>();
-  
-  auto get_rd_page_f
-    = [this](string in) -> string {
-      DBGH << "Got call for get_rd_page_from_manager" << std::endl;
-      
-      string result = this->serv_rd_rq_adapter(in);
-      DBGH << "Response to get_rd_page " << in << " -> size("
-	   << result.length() << ")" << std::endl;
+  auto base = reinterpret_cast<uint64_t>(this->base_addr);
+  this->pg_tbl = std::make_unique<IvyPageTable>(base, this->region_sz,
+						this->blk_sz);
 
-      return result;
-    };
-  auto get_wr_page_f
-    = [this](string in) -> string {
-      DBGH << "Got call for get_wr_page_from_manager" << std::endl;
+  /* Nobody wrote a block yet, its manager holds the initial copy */
+  for (auto blk = base; blk < base + this->region_sz; blk += this->blk_sz) {
+    auto &entry = this->pg_tbl->info[blk];
+    entry.access = IvyAccessType::NONE;
+    entry.owner = this->manager_of(blk);
+    entry.prob_owner = this->manager_of(blk);
+  }
 
-      string result = this->serv_wr_rq_adapter(in);
-      DBGH << "Response to get_wr_page " << in << " -> size("
-	   << result.length() << ")" << std::endl;
+  this->pg_prot = std::make_unique<std::atomic<uint8_t>[]>(
+    (this->region_sz + Ivy::PAGE_SZ - 1) / Ivy::PAGE_SZ);
+  this->note_prot(reinterpret_cast<uint64_t>(this->base_addr),
+		  this->region_sz, IvyAccessType::NONE);
+  this->diff_cache = std::make_unique<PageDiffCache>(this->blk_sz);
+  this->twins = std::make_unique<TwinTable>(this->blk_sz);
+  this->home_pgs = std::make_unique<HomeCopies>(this->blk_sz);
+
+  if (this->subblk_sz != 0)
+    this->subblks = std::make_unique<SubBlockTracker>(this->blk_sz,
+						      this->subblk_sz);
+  
+  /* Answered once the owner and the copies are, the thread serving
+     the request doesn't wait for them */
+  auto dir_request_f = [this](const msg_t &in, rpc_reply_f reply) {
+    this->dir_request(in, std::move(reply));
+  };
 
-      return result;
-    };
+  auto dir_ack_adapter_f = [this](const msg_t &in) -> msg_t {
+    return this->dir_ack_adapter(in);
+  };
 
-  auto fetch_pg_adapter_f = [&](string in) -> string {
+  auto fetch_pg_adapter_f = [&](const msg_t &in) -> msg_t {
     return this->fetch_pg_adapter(in);
   };
 
-  auto invalidate_adapter_f = [&](string in) -> string {
-    DBGH << "Got call for invalidate: " << in << std::endl;
+  auto push_pg_adapter_f = [this](const msg_t &in) -> msg_t {
+    return this->push_pg_adapter(in);
+  };
+
+  auto rc_fetch_adapter_f = [this](const msg_t &in) -> msg_t {
+    return this->rc_fetch_adapter(in);
+  };
+
+  auto rc_diff_adapter_f = [this](const msg_t &in) -> msg_t {
+    return this->rc_diff_adapter(in);
+  };
+
+  /* Answered once the lock is free, a waiting acquirer doesn't hold
+     a worker thread */
+  auto lock_acq_adapter_f = [this](const msg_t &in, rpc_reply_f reply) {
+    this->lock_acq_adapter(in, std::move(reply));
+  };
+
+  auto lock_rel_adapter_f = [this](const msg_t &in) -> msg_t {
+    return this->lock_rel_adapter(in);
+  };
+
+  auto wu_apply_adapter_f = [this](const msg_t &in) -> msg_t {
+    return this->wu_apply_adapter(in);
+  };
+
+  auto invalidate_adapter_f = [&](const msg_t &in) -> msg_t {
+    DBGH << "Got call for invalidate: " << P(in.hdr.pg_addr) << std::endl;
 
     return this->invalidate_adapter(in);
   };
-  
+
+  auto stats_f = [this](string in) -> string {
+    return this->stats.to_string() + this->false_sharing();
+  };
+
   this->rpcserver->register_recv_funcs({
-      {GET_RD_PAGE_FROM_MANAGER, get_rd_page_f},
-      {GET_WR_PAGE_FROM_MANAGER, get_wr_page_f},
-      {FETCH_PG, fetch_pg_adapter_f},
-      {INVALIDATE_PG, invalidate_adapter_f},
+      {STATS_FN, stats_f},
+    });
+  
+  this->rpcserver->register_async_funcs({
+      {OP_LOCK_ACQ, lock_acq_adapter_f},
+      {OP_GET_RD_PG, dir_request_f},
+      {OP_GET_WR_PG, dir_request_f},
+      {OP_WU_UPDATE, dir_request_f},
     });
 
-  this->rpcserver->start_serving();
+  this->rpcserver->register_msg_funcs({
+      {OP_DIR_ACK, dir_ack_adapter_f},
+      {OP_FETCH_PG, fetch_pg_adapter_f},
+      {OP_INVALIDATE, invalidate_adapter_f},
+      {OP_PUSH_PG, push_pg_adapter_f},
+      {OP_RC_FETCH, rc_fetch_adapter_f},
+      {OP_RC_DIFF, rc_diff_adapter_f},
+      {OP_LOCK_REL, lock_rel_adapter_f},
+      {OP_WU_APPLY, wu_apply_adapter_f},
+    });
+
+  auto serve_err = this->rpcserver->start_serving();
+
+  if (serve_err.has_value()) {
+    IVY_ERROR(serve_err.value());
+  }
 }
 
-Ivy::~Ivy() = default;
+Ivy::~Ivy() {
+  /* The fault engine serves faults with the page table and the RPC
+     server, stop it before either goes away */
+  this->uffd.reset();
+
+  /* Nothing comes in from other nodes past this point, and the jobs
+     still queued fail their calls instead of waiting on them */
+  this->rpcserver->stop();
+
+  /* Requests still held back by the pin window resume on the pools,
+     stop those last */
+  this->pin_timers.stop();
+  this->pf_pool.stop();
+  this->dir_pool.stop();
+}
 
 res_t<void_ptr> Ivy::get_shm() {
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  int fd = -1;
+
+  /* Updates land through a second view of the same memory, the app's
+     mapping is never opened up for them, see wu_apply_adapter() */
+  if (!this->wu_ranges.empty()) {
+    fd = memfd_create("ivy-region", MFD_CLOEXEC);
+    if (fd == -1 || ftruncate(fd, this->region_sz) == -1) {
+      auto err = "memfd failed: " + PSTR();
+      if (fd != -1) close(fd);
+      return {nullptr, {err}};
+    }
+
+    flags = MAP_SHARED;
+  }
+
   void_ptr result = mmap(this->base_addr, this->region_sz,
-			 PROT_READ | PROT_WRITE,
-			 MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+			 PROT_READ | PROT_WRITE, flags, fd, 0);
 
   if (result == MAP_FAILED) {
-    return {nullptr, {"MAP_FAILED: " + PSTR()}};
+    auto err = "MAP_FAILED: " + PSTR();
+    if (fd != -1) close(fd);
+    return {nullptr, {err}};
+  }
+
+  if (fd != -1) {
+    auto alias = mmap(nullptr, this->region_sz, PROT_READ | PROT_WRITE,
+		      MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (alias == MAP_FAILED)
+      return {nullptr, {"MAP_FAILED: " + PSTR()}};
+
+    this->wu_alias = static_cast<char*>(alias);
   }
 
   DBGH << "Registering range from " << result << " + "
@@ -165,71 +499,236 @@ res_t<bool> Ivy::is_manager() {
     return {false, {}};
   }
 }
-string Ivy::fetch_pg_adapter(string in) {
-  DBGH << "Fetch pg adapter called with input " << in << std::endl;
-  
-  auto sep_pos = in.find(':');
-  auto pg_addr = in.substr(0, sep_pos);
-  auto perm = in.substr(sep_pos + 1, in.length() - 1);
-
-  auto accessType = IvyAccessType::NONE;
-  if (perm == "rd") {
-    accessType = IvyAccessType::RD;
-  } else if (perm == "none") {
-    accessType = IvyAccessType::NONE;
-  } else {
-    IVY_ERROR("Unkown accessType for fetch_pg: " + perm);
+
+size_t Ivy::manager_of(uint64_t pg_addr) {
+  switch (this->mngr_mode) {
+  case MNGR_FIXED:
+  case MNGR_DYNAMIC: /* Only picks the first owner */
+    return (pg_addr / this->blk_sz) % this->nodes.size();
+  case MNGR_CENTRAL:
+  default:
+    return this->manager_id;
+  }
+}
+
+bool Ivy::manages(uint64_t pg_addr) {
+  if (this->mngr_mode == MNGR_DYNAMIC)
+    return false;
+
+  return this->manager_of(pg_addr) == this->id;
+}
+
+size_t Ivy::fault_target(uint64_t pg_addr) {
+  if (this->mngr_mode == MNGR_DYNAMIC)
+    return this->pg_entry(pg_addr).prob_owner;
+
+  return this->manager_of(pg_addr);
+}
+
+void Ivy::note_writes(uint64_t addr_val, idx_t node, uint64_t mask) {
+  if (!this->subblks)
+    return;
+
+  if (this->subblks->record(addr_val, node, mask)) {
+    DBGH << "False sharing on " << P(addr_val) << std::endl;
+    this->stats.fs_disjoint++;
   }
+}
+
+Task<> Ivy::pin_wait(uint64_t addr_val, IvyPageTable::cold_t &cold) {
+  auto delay = this->pin_policy.delay_ns(cold.pin_ns, cold.granted_ns,
+					 pin_now_ns());
+  if (delay == 0)
+    co_return;
+
+  this->stats.pin_deferred++;
+  this->stats.pin_wait_ns += delay;
+
+  co_await this->pin_timers.sleep(std::chrono::nanoseconds(delay));
+
+  /* Off the timer's thread, the others may be due */
+  co_await resume_via{[this, addr_val](std::function<void()> job) {
+    this->dir_submit(addr_val, std::move(job));
+  }};
+}
+
+IvyPageTable::info_t &Ivy::pg_entry(uint64_t pg_addr) {
+  return this->pg_tbl->info[pg_addr];
+}
+
+IvyPageTable::cold_t &Ivy::pg_cold(uint64_t pg_addr) {
+  return this->pg_tbl->cold(pg_addr);
+}
+
+msg_t Ivy::fetch_pg_adapter(const msg_t &in) {
+  auto resp = this->fetch_pg_msg(in);
+
+  if (!(resp.hdr.flags & MSG_F_ERR) && (in.hdr.flags & MSG_F_PUSH)
+      && in.hdr.node != this->id)
+    return this->push_pg_blocking(in.hdr.node, std::move(resp));
+
+  return resp;
+}
+
+Task<msg_t> Ivy::co_fetch_pg(msg_t in) {
+  auto resp = this->fetch_pg_msg(in);
 
+  if (!(resp.hdr.flags & MSG_F_ERR) && (in.hdr.flags & MSG_F_PUSH)
+      && in.hdr.node != this->id)
+    resp = co_await this->push_pg(in.hdr.node, std::move(resp));
 
-  auto addr_ul = std::stoul(pg_addr, nullptr, 10);
-  auto addr_ptr = reinterpret_cast<void_ptr>(addr_ul);
+  co_return resp;
+}
+
+msg_t Ivy::fetch_pg_msg(const msg_t &in) {
+  DBGH << "Fetch pg adapter called for page " << P(in.hdr.pg_addr)
+       << std::endl;
+  
+  auto accessType = static_cast<IvyAccessType>(in.hdr.access);
+  auto base = reinterpret_cast<uint64_t>(this->base_addr);
+
+  /* A malformed request fails on its own, the node keeps serving */
+  if ((accessType != IvyAccessType::RD && accessType != IvyAccessType::NONE)
+      || in.hdr.pg_addr < base || in.hdr.pg_addr >= base + this->region_sz) {
+    DBGH << "Bad fetch_pg request, access " << in.hdr.access
+	 << " addr " << P(in.hdr.pg_addr) << std::endl;
+
+    auto resp = make_msg(OP_FETCH_PG, this->id, in.hdr.pg_addr);
+    resp.hdr.flags |= MSG_F_ERR;
+    return resp;
+  }
+
+  auto addr_ptr = reinterpret_cast<void_ptr>(in.hdr.pg_addr);
 
   DBGH << "Address " << addr_ptr << std::endl;
   
   auto result = this->fetch_pg(addr_ptr, accessType);
-  DBGH << "Response to fetch_pg " << in << " -> size(" << result.length()
-       << ")" << std::endl;
-  return result;
-};
+  DBGH << "Response to fetch_pg " << addr_ptr << " -> size("
+       << result.length() << ")" << std::endl;
 
-res_t<bool> Ivy::ca_va() { return {true, {}}; }
+  auto resp = make_msg(OP_FETCH_PG, this->id, in.hdr.pg_addr, accessType);
 
-IvyAccessType Ivy::read_mem_perm(void_ptr addr) {
-  std::ifstream maps_f("/proc/" + std::to_string(getpid()) + "/maps");
+  /* Losing write access, tell the manager what we wrote */
+  if (this->subblks)
+    resp.hdr.written = this->subblks->take_mask(in.hdr.pg_addr,
+						result.data());
 
-  std::string line;
-  while (std::getline(maps_f, line)) {
-    std::stringstream token_stream(line);
-    std::vector<std::string> tokens;
-    
-    std::string token;
-    while (std::getline(token_stream, token, ' ')) {
-      tokens.push_back(token);
-    }
+  /* The requester still has an older version, only send the bytes
+     that changed since if we have that version too */
+  if (this->page_diff && (in.hdr.flags & MSG_F_DIFF)) {
+    auto diff = this->diff_cache->diff_from(in.hdr.pg_addr, in.hdr.version,
+					   result.data());
 
-    if (tokens.size() > 2) {
-      size_t hyp_pos = tokens[0].find("-");
-      std::string start_str = tokens[0].substr(0, hyp_pos);
-      std::string end_str = tokens[0].substr(hyp_pos+1, tokens[0].size()-1);
+    if (diff.has_value()) {
+      this->stats.diff_sent++;
+      this->stats.diff_bytes += diff->size();
 
-      auto start
-	= reinterpret_cast<void_ptr>(std::stoul(start_str, nullptr, 16));
-      auto end
-	= reinterpret_cast<void_ptr>(std::stoul(end_str, nullptr, 16));
-      
-      std::string perm = tokens[1];
-
-      if (addr >= start || addr < end) {
-	if (perm[0] == 'r' && perm[1] == 'w')
-	  return IvyAccessType::RW;
-	else if (perm[0] == 'r')
-	  return IvyAccessType::RD;
-	else if (perm[1] == 'w')
-	  return IvyAccessType::WR;
-      }
+      resp.hdr.flags |= MSG_F_DIFF;
+      result = std::move(diff.value());
+    } else {
+      this->stats.diff_full++;
     }
   }
+
+  resp.payload = std::move(result);
+
+  /* The manager passes the payload on as is, it gets decompressed
+     once it reaches the requester */
+  lz_pack(resp, this->lz_policy, this->stats);
+
+  return resp;
+}
+
+msg_t Ivy::push_prep(idx_t node, msg_t &page) {
+  auto addr_ul = page.hdr.pg_addr;
+  auto reply = make_msg(static_cast<IvyOpcode>(page.hdr.opcode), this->id,
+			addr_ul, static_cast<IvyAccessType>(page.hdr.access));
+  reply.hdr.written = page.hdr.written;
+
+  page.hdr.opcode = OP_PUSH_PG;
+  page.hdr.node = this->id;
+
+  DBGH << "Pushing page " << P(addr_ul) << " to node " << node << std::endl;
+
+  return reply;
+}
+
+Task<msg_t> Ivy::push_pg(idx_t node, msg_t page) {
+  auto reply = this->push_prep(node, page);
+
+  /* Wait for the ack, the faulting node must have the page before
+     the manager tells it to look for it */
+  auto [ack, err] = co_await this->rpcserver->co_call(node, std::move(page));
+  if (err.has_value()) {
+    reply.hdr.flags |= MSG_F_ERR;
+    co_return reply;
+  }
+
+  this->stats.pg_pushed++;
+  reply.hdr.flags |= MSG_F_PUSH;
+
+  co_return reply;
+}
+
+msg_t Ivy::push_pg_blocking(idx_t node, msg_t page) {
+  auto reply = this->push_prep(node, page);
+
+  auto [ack, err] = this->rpcserver->call(node, page);
+  if (err.has_value()) {
+    reply.hdr.flags |= MSG_F_ERR;
+    return reply;
+  }
+
+  this->stats.pg_pushed++;
+  reply.hdr.flags |= MSG_F_PUSH;
+
+  return reply;
+}
+
+msg_t Ivy::push_pg_adapter(const msg_t &in) {
+  auto addr_ul = this->blk_align(in.hdr.pg_addr);
+
+  {
+    ivyguard(this->push_lock);
+    this->pushed[addr_ul] = in;
+  }
+
+  return make_msg(OP_PUSH_PG, this->id, addr_ul);
+}
+
+mres_t Ivy::take_pushed(msg_t &resp) {
+  if (!(resp.hdr.flags & MSG_F_PUSH))
+    return {};
+
+  ivyguard(this->push_lock);
+
+  auto it = this->pushed.find(resp.hdr.pg_addr);
+  if (it == this->pushed.end())
+    return {"Pushed page " + std::to_string(resp.hdr.pg_addr)
+	    + " never arrived"};
+
+  /* The header from the manager has the version, the flags describe
+     the payload from the owner */
+  auto version = resp.hdr.version;
+  resp = std::move(it->second);
+  resp.hdr.version = version;
+
+  this->pushed.erase(it);
+
+  return {};
+}
+
+res_t<bool> Ivy::ca_va() { return {true, {}}; }
+
+IvyAccessType Ivy::read_mem_perm(void_ptr addr) {
+  auto addr_val = reinterpret_cast<uint64_t>(addr);
+  auto base = reinterpret_cast<uint64_t>(this->base_addr);
+
+  if (addr_val < base || addr_val >= base + this->region_sz)
+    return IvyAccessType::NONE;
+
+  auto prot = this->pg_prot[(addr_val - base) / Ivy::PAGE_SZ].load();
+  return static_cast<IvyAccessType>(prot);
 }
 
 void Ivy::sigaction_hdlr(int sig, siginfo_t *info, void *ctx_ptr) {
@@ -248,7 +747,11 @@ void Ivy::sigaction_hdlr(int sig, siginfo_t *info, void *ctx_ptr) {
     
     if (uctx->uc_mcontext.gregs[REG_ERR] & 0x2) {
       DBGH << "Write fault" << std::endl;
-      auto err = ivy_static_obj->wr_fault_hdlr(addr);
+      auto addr_val = ivy_static_obj->blk_align(reinterpret_cast<uint64_t>(addr));
+
+      auto err = ivy_static_obj->is_wu(addr_val)
+	? ivy_static_obj->wu_wr_fault(addr_val, uctx)
+	: ivy_static_obj->wr_fault_hdlr(addr);
 
       if (err.has_value()) {
 	DBGH << "Error: " << err.value() << std::endl;
@@ -267,6 +770,23 @@ void Ivy::sigaction_hdlr(int sig, siginfo_t *info, void *ctx_ptr) {
   }
 }
 
+void Ivy::sigtrap_hdlr(int sig, siginfo_t *info, void *ctx_ptr) {
+  auto uctx = reinterpret_cast<ucontext_t*>(ctx_ptr);
+
+  if (ivy_static_obj == nullptr || wu_step.addr == 0)
+    return;
+
+  /* The store went through, stop stepping */
+  uctx->uc_mcontext.gregs[REG_EFL] &= ~EFL_TF;
+
+  auto err = ivy_static_obj->wu_send_update();
+
+  if (err.has_value()) {
+    DBGH << "Error: " << err.value() << std::endl;
+    exit(1);
+  }
+}
+
 mres_t Ivy::reg_fault_hdlr() {
   struct sigaction act {};
 
@@ -279,6 +799,16 @@ mres_t Ivy::reg_fault_hdlr() {
     exit(1);
   }
 
+  /* Only write-update ranges single step stores */
+  if (!this->wu_ranges.empty()) {
+    act.sa_sigaction = &Ivy::sigtrap_hdlr;
+
+    if (sigaction(SIGTRAP, &act, NULL) == -1) {
+      DBGH << "sigaction failed: " << PSTR() << std::endl;
+      exit(1);
+    }
+  }
+
   return {};
 }
 
@@ -313,6 +843,20 @@ mres_t Ivy::set_access(void_ptr addr, size_t pg_cnt,
   auto addr_pg = pg_align(addr_val);
   auto addr_pg_ptr = reinterpret_cast<void_ptr>(addr_pg);
 
+  /* No access unmaps the pages, giving access back maps zeros unless
+     the pages are still there */
+  if (this->uffd) {
+    auto err = access == IvyAccessType::NONE
+      ? this->uffd->drop(addr_pg_ptr, pg_cnt * Ivy::PAGE_SZ)
+      : this->uffd->place(addr_pg_ptr, nullptr, pg_cnt * Ivy::PAGE_SZ,
+			  access == IvyAccessType::RD);
+
+    if (!err.has_value())
+      this->note_prot(addr_pg, pg_cnt * Ivy::PAGE_SZ, access);
+
+    return err;
+  }
+
   DBGH << "mprotect(" << addr_pg_ptr << ", "
        << pg_cnt*Ivy::PAGE_SZ << ", "
        << prot_str << ")" << std::endl;
@@ -325,506 +869,1722 @@ mres_t Ivy::set_access(void_ptr addr, size_t pg_cnt,
     return std::make_optional(PSTR());
   }
 
+  this->note_prot(addr_pg, pg_cnt * Ivy::PAGE_SZ, access);
+
   return {};
 }
 
 string
 Ivy::fetch_pg(void_ptr addr, IvyAccessType accessType) {
   auto addr_ul = reinterpret_cast<uint64_t>(addr);
-  auto addr_pg = pg_align(addr_ul);
+  auto addr_pg = this->blk_align(addr_ul);
   auto addr_str = std::to_string(addr_ul);
 
-  if (!unwrap(this->is_manager())) {
-    DBGH << "Getting lock for addr " << P(addr_ul) << std::endl;
-    wait_lock(this->pg_tbl->page_locks[addr_ul]);
-    DBGH << "Lock address = " << P(&pg_tbl->page_locks[addr_ul])
-	 << std::endl;
-  }
+  auto &lock = this->pg_tbl->page_locks[addr_ul];
+  auto &entry = this->pg_entry(addr_pg);
+
+  /* A fault on the page holds the lock until its manager answers,
+     which waits for this request to be done first. The fault lends
+     the lock out meanwhile, see call_for_fault(). */
+  DBGH << "Getting lock for addr " << P(addr_ul) << std::endl;
+  bool borrowed = lock.borrow();
 
   string req_name = "";
 
   /* Change this page to read only */
-  this->set_access((void_ptr)addr_pg, 1, IvyAccessType::RD);
+  this->set_access((void_ptr)addr_pg, this->blk_pgs(), IvyAccessType::RD);
   
   auto mem_str = this->read_page((void_ptr)addr_pg);
 
   DBGH << "Receive size = " << mem_str.length() << std::endl;
-  IVY_ASSERT(mem_str.length() == PAGE_SZ*2,
-	     "Fetch page did not receive 4096 bytes");
+  IVY_ASSERT(mem_str.length() == this->blk_sz,
+	     "Fetch page did not receive a whole block");
 
-  dump_from_hex(mem_str);
+  dump_page(mem_str);
+
+  /* Losing the page, keep it around as the base of a later diff */
+  if (this->page_diff && accessType == IvyAccessType::NONE)
+    this->diff_cache->save_live(addr_pg, mem_str.data());
   
-  this->set_access((void_ptr)addr_pg, 1, accessType);
+  this->set_access((void_ptr)addr_pg, this->blk_pgs(), accessType);
+  entry.access = accessType;
 
-  if (!unwrap(this->is_manager())) {
-    this->pg_tbl->page_locks[addr_ul].unlock();
-  }
+  if (borrowed)
+    lock.give_back();
+  else
+    lock.unlock();
   
   return mem_str;
 }
 
-res_t<string> Ivy::serv_rd_rq(void_ptr pg_addr, idx_t req_node) {
-  uint64_t addr_val = pg_align(reinterpret_cast<uint64_t>(pg_addr));
-
-  DBGH << "Getting lock for addr " << P(addr_val) << std::endl;
-  wait_lock(this->pg_tbl->page_locks[addr_val]);
-  DBGH << "Lock address = " << P(&pg_tbl->page_locks[addr_val])
-       << std::endl;
-    
-  FUNC_DUMP;
-  IVY_ASSERT(unwrap(this->is_manager()), "get rd on non manager node");
-  IVY_ASSERT(this->pg_tbl, "Page table uninit");
-
-  std::string page_contents = "";
+void Ivy::dir_request(const msg_t &in, rpc_reply_f reply) {
+  DBGH << "Got " << in.hdr.opcode << " request for addr = "
+       << P(in.hdr.pg_addr) << " from node " << in.hdr.node << std::endl;
 
-  /* Serve read request can only be called on the manager node,
-     manager would contact the owner and return the page to the
-     callee */
-  if (unwrap(this->is_manager())){
-    DBGH << "Getting info lock for addr " << P(addr_val) << std::endl;
-    wait_lock(this->pg_tbl->info_locks[addr_val]);
+  if (this->mngr_mode == MNGR_DYNAMIC) {
+    spawn(this->dyn_serve(in, std::move(reply), false));
+    return;
+  }
 
-    this->pg_tbl->info[addr_val].copyset.insert(req_node);
+  auto addr_val = this->blk_align(in.hdr.pg_addr);
+  IVY_ASSERT(this->manages(addr_val), "Request on non manager node");
 
-    auto owner_node = this->pg_tbl->info[addr_val].owner;
-    auto req = std::to_string(addr_val) + ":rd";
+  auto state = in.hdr.opcode == OP_GET_RD_PG ? IvyPageTable::DIR_FETCHING
+    : in.hdr.opcode == OP_GET_WR_PG ? IvyPageTable::DIR_INVALIDATING
+    : IvyPageTable::DIR_UPDATING;
+  auto start = [this, in, reply = std::move(reply)] {
+    spawn(this->dir_serve(in, reply));
+  };
 
-    DBGH << "Calling fetch_pg_adapter(" << req << ")" << std::endl;
+  this->stats.dir_requests++;
 
-    if (owner_node == 0) {
-      /* If the owner is the manager, don't go through the HTTP
-	 server */
-      page_contents = this->fetch_pg_adapter(req);
-    } else {
-      auto [page_cnt_, err_]
-	= this->rpcserver->call(owner_node, FETCH_PG, req);
+  {
+    std::lock_guard<PageLock> guard(this->pg_tbl->info_locks[addr_val]);
+    auto &entry = this->pg_entry(addr_val);
 
-      /* This call cannot be proceeded, return error to start again */
-      if (err_.has_value()) {
-	this->pg_tbl->info_locks[addr_val].unlock();
-	this->pg_tbl->page_locks[addr_val].unlock();
-	return {"", "call failed"};
-      }
-	
-      page_contents = page_cnt_;
+    /* Whoever finishes the request in flight starts this one */
+    if (entry.dir_state != IvyPageTable::DIR_IDLE) {
+      this->stats.dir_queued++;
+      this->pg_cold(addr_val).dir_queue.push_back({state, std::move(start)});
+      return;
     }
 
-    this->pg_tbl->info_locks[addr_val].unlock();
-  } else {
-    IVY_ERROR("Tried serving from non-manager node");
+    entry.dir_state = state;
   }
 
-  IVY_ASSERT(!page_contents.empty(), "Could not read the memory page");
+  start();
+}
 
-  DBGH << "Returning page's content" << std::endl;
+msg_t Ivy::dir_call(const msg_t &in) {
+  std::promise<msg_t> done;
+  auto resp = done.get_future();
 
-  this->pg_tbl->page_locks[addr_val].unlock();
-  return {page_contents, {}};
+  this->dir_request(in, [&done](msg_t out) {
+    done.set_value(std::move(out));
+  });
+
+  return resp.get();
 }
 
-res_t<string> Ivy::serv_wr_rq(void_ptr pg_addr, idx_t req_node) {
-  uint64_t addr_val = pg_align(reinterpret_cast<uint64_t>(pg_addr));
-  
-  DBGH << "Getting lock for addr " << P(addr_val) << std::endl;
-  wait_lock(this->pg_tbl->page_locks[addr_val]);
-  DBGH << "Lock address = " << P(&pg_tbl->page_locks[addr_val])
-       << std::endl;
-  
-  DBGH << "Address = " << pg_addr << std::endl;
-  IVY_ASSERT(unwrap(this->is_manager()), "get wr on non manager node");
+Task<> Ivy::dir_serve(msg_t in, rpc_reply_f reply) {
+  auto addr_val = this->blk_align(in.hdr.pg_addr);
+  auto opcode = static_cast<IvyOpcode>(in.hdr.opcode);
+  auto &entry = this->pg_entry(addr_val);
+  in.hdr.pg_addr = addr_val;
+
+  res_t<msg_t> res;
+  if (opcode == OP_GET_RD_PG)
+    res = co_await this->serv_rd_rq(in);
+  else if (opcode == OP_GET_WR_PG)
+    res = co_await this->serv_wr_rq(in);
+  else
+    res = co_await this->serv_wu_rq(in);
 
-  DBGH << "Addr_val = " << addr_val << std::endl;
-  DBGH << "owner = " << this->pg_tbl->info[addr_val].owner
-       << std::endl;
+  auto [resp, err] = std::move(res);
 
-  IVY_ASSERT(this->pg_tbl, "Page table uninit");
+  /* The requester retries */
+  if (err.has_value()) {
+    DBGH << "Serving " << P(addr_val) << " failed: " << err.value()
+	 << std::endl;
+    resp = make_msg(opcode, this->id, addr_val);
+    resp.hdr.flags |= MSG_F_ERR;
+  }
 
-  std::string page_contents = "";
-  
-  auto owner_node = this->pg_tbl->info[addr_val].owner;
+  std::function<void()> next;
+  {
+    std::lock_guard<PageLock> guard(this->pg_tbl->info_locks[addr_val]);
 
-  /* Similar to serv read req, serv write req can only be served from
-     the manager node */
-  if (unwrap(this->is_manager())) {
-    DBGH << "Getting info lock for addr " << P(addr_val) << std::endl;
-    wait_lock(this->pg_tbl->info_locks[addr_val]);
+    /* Nobody may fetch the page from the requester before it has it,
+       a write update has nothing to install */
+    if (!err.has_value() && opcode != OP_WU_UPDATE) {
+      entry.dir_state = IvyPageTable::DIR_CONFIRMING;
+      this->pg_cold(addr_val).dir_requester = in.hdr.node;
+    } else {
+      next = this->dir_pop(addr_val);
+    }
+  }
 
-    vector<size_t> ivld_set;
+  reply(std::move(resp));
 
-    /* Remove the node requesting the page before sending out
-       invalidations */
-    this->pg_tbl->info[addr_val].copyset.erase(req_node);
+  if (next)
+    this->dir_submit(addr_val, std::move(next));
+}
 
-    /* Convert the set to a vector */
-    std::copy(this->pg_tbl->info[addr_val].copyset.begin(),
-	      this->pg_tbl->info[addr_val].copyset.end(),
-	      std::back_inserter(ivld_set));
+Task<res_t<msg_t>> Ivy::serv_rd_rq(msg_t in) {
+  auto addr_val = in.hdr.pg_addr;
+  size_t req_node = in.hdr.node;
+  auto &entry = this->pg_entry(addr_val);
+  auto &cold = this->pg_cold(addr_val);
+  idx_t owner_node;
+  bool unwritten;
+
+  {
+    std::lock_guard<PageLock> guard(this->pg_tbl->info_locks[addr_val]);
+    owner_node = entry.owner;
+    unwritten = entry.version == 0 && !cold.updated;
+
+    if (owner_node != req_node)
+      cold.copyset.insert(req_node);
+  }
 
-    auto req = std::to_string(addr_val) + ":none";
-    
-    DBGH << "fetch_pg_adapter(" << req << ")" << std::endl;
+  msg_t page;
+  bool own_copy = owner_node == req_node;
 
-    if (owner_node == 0) {
-      /* Call the function directly if the manager is also the
-	 owner */
-      auto page_cnt_ = this->fetch_pg_adapter(req);
-      page_contents = page_cnt_;
-    } else if (owner_node == req_node) {
-      page_contents = "";
-    } else if (owner_node != 0) {
-      auto [page_cnt_, err_]
-	= this->rpcserver->call(owner_node, FETCH_PG, req);
-      
-      /* This call cannot be proceeded, return error to start again */
-      if (err_.has_value()) {
-	this->pg_tbl->info_locks[addr_val].unlock();
-	this->pg_tbl->page_locks[addr_val].unlock();
-	return {"", "call failed"};
-      }
-	
-      page_contents = page_cnt_;
-    } else {    
+  if (own_copy && unwritten) {
+    /* Nobody was ever granted or updated the block, it is still
+       zero */
+    page.payload.assign(this->blk_sz, '\0');
+  } else {
+    /* An owner without access still has the data in its memory, it
+       reads it back like anyone else's copy */
+    auto req = make_msg(OP_FETCH_PG, this->id, addr_val, IvyAccessType::RD);
+
+    /* Pass the requester's version on, the owner decides if it can
+       send a diff */
+    if (in.hdr.flags & MSG_F_DIFF) {
+      req.hdr.flags |= MSG_F_DIFF;
+      req.hdr.version = in.hdr.version;
     }
-    
-    auto err = this->send_invalidations(pg_addr, ivld_set);
 
-    this->pg_tbl->info[addr_val].copyset.clear();
-    this->pg_tbl->info[addr_val].owner = req_node;
+    /* Only the metadata comes back through here, the owner sends the
+       page to the requester */
+    if (this->direct_xfer && req_node != this->id && !own_copy) {
+      req.hdr.flags |= MSG_F_PUSH;
+      req.hdr.node = req_node;
+    }
 
-    this->pg_tbl->info_locks[addr_val].unlock();
-  } else {
-    IVY_ERROR("Tried serving from non-manager node");
+    /* The writer keeps the page a little longer, later requests queue
+       up behind this one */
+    if (!own_copy)
+      co_await this->pin_wait(addr_val, cold);
+
+    DBGH << "Calling fetch_pg_adapter(" << P(addr_val) << ")"
+	 << std::endl;
+
+    if (owner_node == this->id) {
+      /* If the owner is the manager, don't go through the RPC
+	 server */
+      page = co_await this->co_fetch_pg(req);
+
+      /* Pushing the page to the requester failed */
+      if (page.hdr.flags & MSG_F_ERR)
+	co_return {msg_t{}, "push failed"};
+    } else {
+      auto [page_, err_] = co_await this->rpcserver->co_call(owner_node, req);
+
+      /* This call cannot be proceeded, return error to start again */
+      if (err_.has_value())
+	co_return {msg_t{}, "call failed"};
+
+      page = std::move(page_);
+    }
+  }
+
+  if (!(page.hdr.flags & MSG_F_PUSH))
+    IVY_ASSERT(!page.payload.empty(), "Could not read the memory page");
+
+  std::lock_guard<PageLock> guard(this->pg_tbl->info_locks[addr_val]);
+
+  this->note_writes(addr_val, owner_node, page.hdr.written);
+
+  /* The owner is read only now */
+  cold.granted_ns = 0;
+
+  auto resp = make_msg(OP_GET_RD_PG, this->id, addr_val, IvyAccessType::RD,
+		       std::move(page.payload));
+  resp.hdr.flags |= page.hdr.flags & (MSG_F_DIFF | MSG_F_LZ | MSG_F_PUSH);
+  resp.hdr.version = entry.version;
+
+  co_return {resp, {}};
+}
+
+Task<res_t<msg_t>> Ivy::serv_wr_rq(msg_t in) {
+  auto addr_val = in.hdr.pg_addr;
+  auto addr_ptr = reinterpret_cast<void_ptr>(addr_val);
+  size_t req_node = in.hdr.node;
+  auto &entry = this->pg_entry(addr_val);
+  auto &cold = this->pg_cold(addr_val);
+  idx_t owner_node;
+  vector<size_t> ivld_set;
+
+  {
+    std::lock_guard<PageLock> guard(this->pg_tbl->info_locks[addr_val]);
+    owner_node = entry.owner;
+
+    /* Everyone but the node requesting the page gets invalidated */
+    for (auto node : cold.copyset)
+      if (node != req_node)
+	ivld_set.push_back(node);
+  }
+
+  msg_t page;
+  optional<RpcServer::pending_t> fetch;
+
+  if (owner_node != req_node) {
+    co_await this->pin_wait(addr_val, cold);
+
+    auto req = make_msg(OP_FETCH_PG, this->id, addr_val,
+			IvyAccessType::NONE);
+
+    if (this->direct_xfer && req_node != this->id) {
+      req.hdr.flags |= MSG_F_PUSH;
+      req.hdr.node = req_node;
+    }
+
+    DBGH << "fetch_pg_adapter(" << P(addr_val) << ")" << std::endl;
+
+    if (owner_node == this->id) {
+      /* Call the function directly if the manager is also the
+	 owner */
+      page = co_await this->co_fetch_pg(req);
+
+      if (page.hdr.flags & MSG_F_ERR)
+	co_return {msg_t{}, "push failed"};
+    } else {
+      /* Don't wait for the owner, the invalidations below can go out
+	 while the page is in flight */
+      fetch = this->rpcserver->co_call(owner_node, req);
+    }
+  }
+
+  auto missed = co_await this->send_invalidations(addr_ptr, ivld_set,
+						   req_node);
+
+  mres_t err;
+  if (!missed.empty())
+    err = "invalidation failed";
+
+  if (fetch.has_value()) {
+    auto [page_, err_] = co_await fetch.value();
+
+    if (err_.has_value())
+      err = "call failed";
+
+    page = std::move(page_);
+  }
+
+  /* This call cannot be proceeded, return error to start again. Only
+     the copies that are gone leave the copyset, the retry invalidates
+     the rest before anyone gets to write. */
+  if (err.has_value()) {
+    std::lock_guard<PageLock> guard(this->pg_tbl->info_locks[addr_val]);
+    for (auto node : ivld_set)
+      if (std::find(missed.begin(), missed.end(), node) == missed.end())
+	cold.copyset.erase(node);
+
+    co_return {msg_t{}, err.value()};
+  }
+
+  if (owner_node != req_node && !(page.hdr.flags & MSG_F_PUSH))
+    IVY_ASSERT(!page.payload.empty(), "Could not read the memory page");
+
+  std::lock_guard<PageLock> guard(this->pg_tbl->info_locks[addr_val]);
+
+  this->note_writes(addr_val, owner_node, page.hdr.written);
+
+  cold.copyset.clear();
+  entry.owner = req_node;
+  cold.granted_ns = pin_now_ns();
+
+  auto resp = make_msg(OP_GET_WR_PG, this->id, addr_val, IvyAccessType::WR,
+		       std::move(page.payload));
+  resp.hdr.flags |= page.hdr.flags & (MSG_F_LZ | MSG_F_PUSH);
+  resp.hdr.version = ++entry.version;
+
+  co_return {resp, {}};
+}
+
+Task<res_t<msg_t>> Ivy::serv_wu_rq(msg_t in) {
+  auto addr_val = in.hdr.pg_addr;
+  size_t writer = in.hdr.node;
+  auto &entry = this->pg_entry(addr_val);
+  set<size_t> targets;
+
+  {
+    std::lock_guard<PageLock> guard(this->pg_tbl->info_locks[addr_val]);
+    targets = this->pg_cold(addr_val).copyset;
+    targets.insert(entry.owner);
+    targets.erase(writer);
+  }
+
+  /* Updates of a page reach every copy in the same order, the next
+     one waits in the queue until all of them applied this one */
+  auto apply = make_msg(OP_WU_APPLY, writer, addr_val, IvyAccessType::WR,
+			std::move(in.payload));
+  bool failed = false;
+  vector<RpcServer::pending_t> acks;
+
+  for (auto node : targets) {
+    if (node == this->id) {
+      auto local = this->wu_apply_adapter(apply);
+      failed |= (local.hdr.flags & MSG_F_ERR) != 0;
+      continue;
+    }
+
+    acks.push_back(this->rpcserver->co_call(node, apply));
+  }
+
+  for (auto &ack : acks) {
+    auto [ack_resp, err] = co_await ack;
+    failed |= err.has_value();
+  }
+
+  if (failed)
+    co_return {msg_t{}, "update failed"};
+
+  /* The owner's memory holds data now even if nobody was granted the
+     block, see serv_rd_rq() */
+  {
+    std::lock_guard<PageLock> guard(this->pg_tbl->info_locks[addr_val]);
+    this->pg_cold(addr_val).updated = true;
+  }
+
+  co_return {make_msg(OP_WU_UPDATE, this->id, addr_val), {}};
+}
+
+std::function<void()> Ivy::dir_pop(uint64_t addr_val) {
+  auto &entry = this->pg_entry(addr_val);
+  auto &queue = this->pg_cold(addr_val).dir_queue;
+
+  if (queue.empty()) {
+    entry.dir_state = IvyPageTable::DIR_IDLE;
+    return {};
+  }
+
+  auto next = std::move(queue.front());
+  queue.pop_front();
+  entry.dir_state = next.state;
+
+  return std::move(next.start);
+}
+
+void Ivy::dir_submit(uint64_t addr_val, std::function<void()> job) {
+  /* The block's shard serves its requests one at a time anyway */
+  if (this->rpcserver->sharded())
+    this->rpcserver->submit_for(addr_val, std::move(job));
+  else
+    this->dir_pool.submit(std::move(job));
+}
+
+msg_t Ivy::dir_ack_adapter(const msg_t &in) {
+  auto addr_val = this->blk_align(in.hdr.pg_addr);
+  auto &entry = this->pg_entry(addr_val);
+  std::function<void()> next;
+
+  {
+    std::lock_guard<PageLock> guard(this->pg_tbl->info_locks[addr_val]);
+
+    if (entry.dir_state != IvyPageTable::DIR_CONFIRMING
+	|| this->pg_cold(addr_val).dir_requester != in.hdr.node) {
+      DBGH << "Stray confirmation for " << P(addr_val) << " from node "
+	   << in.hdr.node << std::endl;
+      return make_msg(OP_DIR_ACK, this->id, addr_val);
+    }
+
+    next = this->dir_pop(addr_val);
+  }
+
+  if (next)
+    this->dir_submit(addr_val, std::move(next));
+
+  return make_msg(OP_DIR_ACK, this->id, addr_val);
+}
+
+void Ivy::end_fault(uint64_t addr_val) {
+  auto &cold = this->pg_cold(addr_val);
+  auto mngr = std::exchange(cold.confirm_to, std::nullopt);
+
+  this->pg_tbl->page_locks[addr_val].unlock();
+
+  if (!mngr.has_value())
+    return;
+
+  auto ack = make_msg(OP_DIR_ACK, this->id, addr_val);
+
+  if (mngr.value() == this->id) {
+    this->dir_ack_adapter(ack);
+    return;
+  }
+
+  /* Nothing to wait for, only retry if it didn't get through */
+  this->rpcserver->call_async(mngr.value(), ack,
+			      [this, mngr, ack](res_t<msg_t> res) {
+    if (!res.second.has_value())
+      return;
+
+    this->dir_pool.submit([this, mngr, ack] {
+      Backoff backoff(this->retry_timeout);
+
+      while (this->rpcserver->call(mngr.value(), ack).second.has_value()) {
+	if (this->rpcserver->stopped() || !backoff.wait()) {
+	  DBGH << "Giving up confirming " << P(ack.hdr.pg_addr) << std::endl;
+	  return;
+	}
+      }
+    });
+  });
+}
+
+Task<> Ivy::dyn_serve(msg_t in, rpc_reply_f reply, bool queued) {
+  uint64_t addr_val = this->blk_align(in.hdr.pg_addr);
+  auto &lock = this->pg_tbl->page_locks[addr_val];
+  auto &entry = this->pg_entry(addr_val);
+  in.hdr.pg_addr = addr_val;
+
+  /* A fault here may be about to make this node the owner, a request
+     from elsewhere waits for it to be done. Our own request comes from
+     that fault, and a queued one may be all that fault waits for, they
+     borrow the lock instead. */
+  DBGH << "Getting lock for addr " << P(addr_val) << std::endl;
+  bool borrowed = false;
+  if (queued || in.hdr.node == this->id)
+    borrowed = lock.borrow();
+  else
+    wait_lock(lock);
+
+  size_t next = entry.prob_owner;
+  bool busy = false;
+  std::function<void()> start;
+
+  if (queued) {
+    /* dir_pop() handed the block to this request already. If the page
+       moved on meanwhile it goes after it, and the block to the next
+       request queued here. */
+    if (next != this->id) {
+      std::lock_guard<PageLock> guard(this->pg_tbl->info_locks[addr_val]);
+      start = this->dir_pop(addr_val);
+    }
+  } else if (next == this->id) {
+    auto state = in.hdr.opcode == OP_GET_RD_PG
+      ? IvyPageTable::DIR_FETCHING : IvyPageTable::DIR_INVALIDATING;
+
+    std::lock_guard<PageLock> guard(this->pg_tbl->info_locks[addr_val]);
+
+    /* Whoever finishes the request in flight starts this one, the
+       page may have moved on by then */
+    if (entry.dir_state != IvyPageTable::DIR_IDLE) {
+      this->stats.dir_queued++;
+      this->pg_cold(addr_val).dir_queue.push_back({state, [this, in, reply] {
+	spawn(this->dyn_serve(in, reply, true));
+      }});
+      busy = true;
+    } else {
+      entry.dir_state = state;
+    }
+  }
+
+  if (borrowed)
+    lock.give_back();
+  else
+    lock.unlock();
+
+  if (start)
+    this->dir_submit(addr_val, std::move(start));
+
+  if (busy)
+    co_return;
+
+  if (next != this->id) {
+    reply(co_await this->dyn_forward(in, next));
+    co_return;
+  }
+
+  auto resp = co_await this->serv_dyn_rq(in);
+
+  {
+    std::lock_guard<PageLock> guard(this->pg_tbl->info_locks[addr_val]);
+    start = this->dir_pop(addr_val);
+  }
+
+  reply(std::move(resp));
+
+  if (start)
+    this->dir_submit(addr_val, std::move(start));
+}
+
+Task<msg_t> Ivy::dyn_forward(msg_t in, size_t next) {
+  uint64_t addr_val = in.hdr.pg_addr;
+  size_t req_node = in.hdr.node;
+  bool is_wr = in.hdr.opcode == OP_GET_WR_PG;
+
+  DBGH << "Forwarding request for " << P(addr_val) << " from node "
+       << req_node << " to node " << next << std::endl;
+  this->stats.dyn_forwards++;
+
+  /* The owner sends the page to the requester, it doesn't need to
+     come back along the chain */
+  if (this->direct_xfer)
+    in.hdr.flags |= MSG_F_PUSH;
+
+  auto [resp, err] = co_await this->rpcserver->co_call(next, in);
+  if (err.has_value()) {
+    auto fail = make_msg(static_cast<IvyOpcode>(in.hdr.opcode), this->id,
+			 addr_val);
+    fail.hdr.flags |= MSG_F_ERR;
+    co_return fail;
+  }
+
+  /* A failed forward leaves the hint alone, the requester may not
+     own the page and pointing at it could close a cycle */
+  if (resp.hdr.flags & MSG_F_ERR)
+    co_return resp;
+
+  /* The requester owns the page now, anything we see for it later
+     should go there directly. Otherwise path compression, skip the
+     hops we just went through next time. Leave the hint alone if a
+     write moved it on meanwhile. */
+  {
+    std::lock_guard<PageLock> guard(this->pg_tbl->info_locks[addr_val]);
+    this->pg_entry(addr_val).prob_owner
+      .compare_exchange_strong(next, is_wr ? req_node : resp.hdr.node);
+  }
+
+  co_return resp;
+}
+
+Task<msg_t> Ivy::serv_dyn_rq(msg_t in) {
+  uint64_t addr_val = in.hdr.pg_addr;
+  auto addr_ptr = reinterpret_cast<void_ptr>(addr_val);
+  size_t req_node = in.hdr.node;
+  bool is_wr = in.hdr.opcode == OP_GET_WR_PG;
+  auto &entry = this->pg_entry(addr_val);
+  auto &cold = this->pg_cold(addr_val);
+  msg_t resp;
+
+  /* Nothing holds the page lock from here on, the requests queued
+     behind this one keep the block ours. Fetching the page takes the
+     lock for as long as that takes. */
+  if (req_node != this->id)
+    co_await this->pin_wait(addr_val, cold);
+
+  if (!is_wr) {
+    if (req_node != this->id) {
+      std::lock_guard<PageLock> guard(this->pg_tbl->info_locks[addr_val]);
+      cold.copyset.insert(req_node);
+    }
+
+    /* Downgrade our copy and pass the requester's version on, so it
+       can be a diff */
+    auto req = make_msg(OP_FETCH_PG, req_node, addr_val, IvyAccessType::RD);
+    req.hdr.flags |= in.hdr.flags & (MSG_F_DIFF | MSG_F_PUSH);
+    req.hdr.version = in.hdr.version;
+
+    auto page = co_await this->co_fetch_pg(req);
+
+    if (page.hdr.flags & MSG_F_ERR)
+      co_return page;
+
+    resp = make_msg(OP_GET_RD_PG, this->id, addr_val, IvyAccessType::RD,
+		    std::move(page.payload));
+    resp.hdr.flags |= page.hdr.flags & (MSG_F_DIFF | MSG_F_LZ | MSG_F_PUSH);
+
+    std::lock_guard<PageLock> guard(this->pg_tbl->info_locks[addr_val]);
+    resp.hdr.version = entry.version;
+    this->note_writes(addr_val, this->id, page.hdr.written);
+
+    cold.granted_ns = 0;
+    co_return resp;
+  }
+
+  bool has_copy;
+  vector<size_t> ivld_set;
+  {
+    std::lock_guard<PageLock> guard(this->pg_tbl->info_locks[addr_val]);
+    has_copy = cold.copyset.count(req_node) != 0;
+    for (auto node : cold.copyset)
+      if (node != req_node)
+	ivld_set.push_back(node);
+  }
+
+  auto missed = co_await this->send_invalidations(addr_ptr, ivld_set,
+						   req_node);
+
+  /* Only the copies that are gone leave the copyset, the requester
+     keeps its own and the retry invalidates the rest */
+  {
+    std::lock_guard<PageLock> guard(this->pg_tbl->info_locks[addr_val]);
+    for (auto node : ivld_set)
+      if (std::find(missed.begin(), missed.end(), node) == missed.end())
+	cold.copyset.erase(node);
+  }
+
+  if (!missed.empty()) {
+    auto fail = make_msg(OP_GET_WR_PG, this->id, addr_val);
+    fail.hdr.flags |= MSG_F_ERR;
+    co_return fail;
+  }
+
+  string page_contents = "";
+  uint64_t written = 0;
+  if (req_node != this->id) {
+    auto page = this->fetch_pg(addr_ptr, IvyAccessType::NONE);
+
+    if (this->subblks)
+      written = this->subblks->take_mask(addr_val, page.data());
+
+    /* A reader of the current version already has the bytes */
+    if (!has_copy)
+      page_contents = std::move(page);
+  }
+
+  resp = make_msg(OP_GET_WR_PG, this->id, addr_val, IvyAccessType::WR,
+		  std::move(page_contents));
+  lz_pack(resp, this->lz_policy, this->stats);
+
+  /* The new owner compares its own writes with these later */
+  resp.hdr.written = written;
+
+  if ((in.hdr.flags & MSG_F_PUSH) && !resp.payload.empty()) {
+    resp = co_await this->push_pg(req_node, std::move(resp));
+
+    /* Still the owner, the requester retries */
+    if (resp.hdr.flags & MSG_F_ERR)
+      co_return resp;
+  }
+
+  std::lock_guard<PageLock> guard(this->pg_tbl->info_locks[addr_val]);
+  this->note_writes(addr_val, this->id, written);
+  cold.copyset.clear();
+  entry.prob_owner = req_node;
+  resp.hdr.version = ++entry.version;
+
+  co_return resp;
+}
+
+mres_t Ivy::rd_fault_hdlr(void_ptr addr) {
+  FUNC_DUMP;
+
+  uint64_t addr_val = this->blk_align(reinterpret_cast<uint64_t>(addr));
+
+  if (this->consistency != CONS_SEQUENTIAL)
+    return this->rc_rd_fault(addr_val);
+
+  optional<err_t> err = {""};
+  Backoff backoff(this->retry_timeout);
+
+  while (err.has_value()) {
+    /* Held until the page is installed, invalidations and fetches
+       that come in meanwhile see the fault and don't wait for it */
+    DBGH << "Getting lock for addr " << P(addr_val) << std::endl;
+    wait_lock(this->pg_tbl->page_locks[addr_val]);
+    DBGH << "Lock address = " << P(&pg_tbl->page_locks[addr_val])
+	 << std::endl;
+
+    IVY_ASSERT(this->pg_tbl, "Page table uninit");
+
+    auto &entry = this->pg_entry(addr_val);
+
+    /* The prefetcher or another thread got it while we waited */
+    if (entry.access != IvyAccessType::NONE) {
+      this->stats.faults_coalesced++;
+      this->pg_tbl->page_locks[addr_val].unlock();
+      break;
+    }
+
+    entry.fault_state = IvyPageTable::FAULT_ACTIVE;
+
+    /* Ask the manager for the page, the manager will contact the
+       correct owner */
+    err = this->get_rd_page_from_mngr(addr);
+  
+    if (err.has_value()) {
+      DBGH << "Retrying read fault after sleep" << std::endl;
+      entry.fault_state = 0;
+      this->end_fault(addr_val);
+      if (!backoff.wait())
+	return err;
+      continue; // Continue here
+    }
+      
+  
+    entry.access = IvyAccessType::RD;
+
+    /* A write elsewhere invalidated the page while we waited, the
+       copy we just got may predate it. Drop it, the access faults
+       again and fetches a current one. */
+    if (entry.fault_state.exchange(0) & IvyPageTable::FAULT_INVAL) {
+      if (this->page_diff)
+	this->diff_cache->save_live(addr_val,
+				   reinterpret_cast<const char*>(addr_val));
+
+      this->invalidate(reinterpret_cast<void_ptr>(addr_val));
+      entry.access = IvyAccessType::NONE;
+    }
+
+    DBGH << "Read fault serviced " << std::endl;
+
+    this->end_fault(addr_val);
+  }
+
+  if (this->pf_depth != 0)
+    this->prefetch_after(addr_val);
+
+  return {};
+}
+
+mres_t Ivy::wr_fault_hdlr(void_ptr addr) {
+  IVY_ASSERT(this->pg_tbl, "Page table uninit");
+
+  uint64_t addr_val = this->blk_align(reinterpret_cast<uint64_t>(addr));
+
+  if (this->consistency != CONS_SEQUENTIAL)
+    return this->rc_wr_fault(addr_val);
+
+  optional<err_t> err = {""};
+  Backoff backoff(this->retry_timeout);
+
+  while (err.has_value()) {
+    DBGH << "Getting lock for addr " << P(addr_val) << std::endl;
+    wait_lock(this->pg_tbl->page_locks[addr_val]);
+    DBGH << "Lock address = " << P(&pg_tbl->page_locks[addr_val])
+	 << std::endl;
+
+    /* Another thread faulted on the page first and got write access
+       while we waited for the lock */
+    if (this->read_mem_perm(addr) == IvyAccessType::RW) {
+      this->stats.faults_coalesced++;
+      this->pg_tbl->page_locks[addr_val].unlock();
+      break;
+    }
+
+    auto &entry = this->pg_entry(addr_val);
+    entry.fault_state = IvyPageTable::FAULT_ACTIVE;
+
+    err = this->get_wr_page_from_mngr(addr);
+
+    if (err.has_value()) {
+      DBGH << "Retrying write fault after sleep"<< std::endl;
+      entry.fault_state = 0;
+      this->end_fault(addr_val);
+      if (!backoff.wait())
+	return err;
+      continue;
+    }
+
+    entry.access = IvyAccessType::WR;
+
+    /* Any invalidation that came in meanwhile was for the copy we had
+       before this grant, the page we hold now is current */
+    entry.fault_state = 0;
+
+    DBGH << "Write fault serviced" << std::endl;
+
+    this->end_fault(addr_val);
+  }
+  
+  return {};
+}
+
+mres_t Ivy::rc_fetch(uint64_t addr_val) {
+  auto addr_ptr = reinterpret_cast<void_ptr>(addr_val);
+  auto req = make_msg(OP_RC_FETCH, this->id, addr_val, IvyAccessType::RD);
+  auto home = this->manager_of(addr_val);
+
+  msg_t resp;
+
+  if (home == this->id) {
+    resp = this->rc_fetch_adapter(req);
+  } else {
+    auto [resp_, err_] = this->rpcserver->call(home, req);
+
+    if (err_.has_value())
+      return err_;
+
+    resp = std::move(resp_);
+  }
+
+  auto lz_err = lz_unpack(resp, this->stats, this->max_payload);
+  if (lz_err.has_value())
+    return lz_err;
+
+  if (resp.payload.length() != this->blk_sz)
+    return {"Home sent " + std::to_string(resp.payload.length())
+	    + " bytes for page " + std::to_string(addr_val)};
+
+  auto err = this->install(addr_ptr, resp.payload, IvyAccessType::RD);
+  if (err.has_value())
+    return err;
+
+  this->twins->set_cached(addr_val);
+
+  return {};
+}
+
+mres_t Ivy::rc_rd_fault(uint64_t addr_val) {
+  optional<err_t> err = {""};
+  Backoff backoff(this->retry_timeout);
+
+  while (err.has_value()) {
+    wait_lock(this->pg_tbl->page_locks[addr_val]);
+
+    /* Another thread got the page while we waited for the lock */
+    if (this->twins->is_cached(addr_val)) {
+      this->stats.faults_coalesced++;
+      this->pg_tbl->page_locks[addr_val].unlock();
+      break;
+    }
+
+    err = this->rc_fetch(addr_val);
+    this->pg_tbl->page_locks[addr_val].unlock();
+
+    if (err.has_value()) {
+      DBGH << "Retrying read fault after sleep: " << err.value()
+	   << std::endl;
+      if (!backoff.wait())
+	return err;
+    }
+  }
+
+  return {};
+}
+
+mres_t Ivy::rc_wr_fault(uint64_t addr_val) {
+  auto addr_ptr = reinterpret_cast<void_ptr>(addr_val);
+  optional<err_t> err = {""};
+  Backoff backoff(this->retry_timeout);
+
+  while (err.has_value()) {
+    wait_lock(this->pg_tbl->page_locks[addr_val]);
+
+    err = {};
+    if (!this->twins->is_cached(addr_val))
+      err = this->rc_fetch(addr_val);
+
+    if (err.has_value()) {
+      this->pg_tbl->page_locks[addr_val].unlock();
+
+      DBGH << "Retrying write fault after sleep: " << err.value()
+	   << std::endl;
+      if (!backoff.wait())
+	return err;
+      continue;
+    }
+
+    /* No ownership to take and nothing to invalidate, the twin is all
+       release() needs to find what this node wrote */
+    if (this->twins->make_twin(addr_val,
+			      reinterpret_cast<const char*>(addr_ptr)))
+      this->stats.rc_twins++;
+    else
+      this->stats.faults_coalesced++;
+
+    this->set_access(addr_ptr, this->blk_pgs(), IvyAccessType::RW);
+
+    this->pg_tbl->page_locks[addr_val].unlock();
+  }
+
+  return {};
+}
+
+mres_t Ivy::acquire() {
+  if (this->consistency == CONS_SEQUENTIAL)
+    return {};
+
+  /* Pages written since the last release keep their twins, the rest
+     is fetched again from its home on the next access */
+  for (auto addr_val : this->twins->take_clean()) {
+    wait_lock(this->pg_tbl->page_locks[addr_val]);
+    auto err = this->invalidate(reinterpret_cast<void_ptr>(addr_val));
+    this->pg_tbl->page_locks[addr_val].unlock();
+
+    if (err.has_value())
+      return err;
+  }
+
+  return {};
+}
+
+mres_t Ivy::release() {
+  if (this->consistency == CONS_SEQUENTIAL)
+    return {};
+
+  vector<uint64_t> written;
+  return this->flush_diffs(written);
+}
+
+mres_t Ivy::acquire(uint64_t lock) {
+  auto req = make_msg(OP_LOCK_ACQ, this->id, lock);
+
+  {
+    ivyguard(this->lock_seen_lock);
+    req.hdr.version = this->lock_seen[lock];
+  }
+
+  msg_t resp;
+  auto lock_home = lock % this->nodes.size();
+
+  if (lock_home == this->id) {
+    /* Granted from the release of another thread if it's held */
+    std::promise<msg_t> granted;
+    auto fut = granted.get_future();
+
+    this->lock_acq_adapter(req, [&granted](msg_t resp) {
+      granted.set_value(std::move(resp));
+    });
+
+    resp = fut.get();
+  } else {
+    auto [resp_, err_] = this->rpcserver->call(lock_home, req);
+
+    if (err_.has_value())
+      return err_;
+
+    resp = std::move(resp_);
+  }
+
+  this->stats.lock_acquires++;
+
+  {
+    ivyguard(this->lock_seen_lock);
+    this->lock_seen[lock] = resp.hdr.version;
+  }
+
+  if (this->consistency == CONS_RELEASE)
+    return this->acquire();
+
+  if (this->consistency == CONS_SEQUENTIAL)
+    return {};
+
+  /* Only what was written under this lock can be stale. A page we
+     wrote ourselves keeps its twin, the home merges both diffs. */
+  auto notices = unpack_addrs(resp.payload);
+  this->stats.lock_notices += notices.size();
+
+  for (auto addr_val : notices) {
+    wait_lock(this->pg_tbl->page_locks[addr_val]);
+
+    mres_t err;
+    if (this->twins->drop_clean(addr_val)) {
+      err = this->invalidate(reinterpret_cast<void_ptr>(addr_val));
+      this->stats.lock_notice_drops++;
+    }
+
+    this->pg_tbl->page_locks[addr_val].unlock();
+
+    if (err.has_value())
+      return err;
+  }
+
+  return {};
+}
+
+mres_t Ivy::release(uint64_t lock) {
+  vector<uint64_t> written;
+
+  /* The homes have merged every diff before the lock is free again,
+     the next holder fetches current pages */
+  if (this->consistency != CONS_SEQUENTIAL) {
+    auto err = this->flush_diffs(written);
+    if (err.has_value())
+      return err;
   }
-  
-  if (owner_node != req_node)
-    IVY_ASSERT(!page_contents.empty(),
-	       "Could not read the memory page");
-  
-  this->pg_tbl->page_locks[addr_val].unlock();
-  
-  return {page_contents, {}};
+
+  auto req = make_msg(OP_LOCK_REL, this->id, lock, IvyAccessType::NONE,
+		      pack_addrs(written));
+  auto lock_home = lock % this->nodes.size();
+
+  if (lock_home == this->id) {
+    this->lock_rel_adapter(req);
+    return {};
+  }
+
+  auto [resp, err] = this->rpcserver->call(lock_home, req);
+  return err;
 }
 
-mres_t Ivy::rd_fault_hdlr(void_ptr addr) {
-  FUNC_DUMP;
+mres_t Ivy::flush_diffs(vector<uint64_t> &written) {
+  vector<size_t> homes;
+  vector<std::future<res_t<msg_t>>> acks;
+  mres_t result;
 
-  uint64_t addr_val = pg_align(reinterpret_cast<uint64_t>(addr));
+  for (auto addr_val : this->twins->dirty()) {
+    auto addr_ptr = reinterpret_cast<void_ptr>(addr_val);
 
-  optional<err_t> err = {""};
+    /* Write protect before diffing, a store from another thread after
+       this faults and makes a new twin instead of getting lost */
+    wait_lock(this->pg_tbl->page_locks[addr_val]);
+    this->set_access(addr_ptr, this->blk_pgs(), IvyAccessType::RD);
+    auto diff = this->twins->take_diff(addr_val,
+				      reinterpret_cast<const char*>(addr_ptr));
+    this->pg_tbl->page_locks[addr_val].unlock();
 
-  while (err.has_value()) {
-    if (!unwrap(this->is_manager())) {
-      DBGH << "Getting lock for addr " << P(addr_val) << std::endl;
-      wait_lock(this->pg_tbl->page_locks[addr_val]);
-      DBGH << "Lock address = " << P(&pg_tbl->page_locks[addr_val])
-	   << std::endl;
-    }
+    /* Released by another thread meanwhile */
+    if (diff.empty())
+      continue;
 
-    IVY_ASSERT(this->pg_tbl, "Page table uninit");
+    written.push_back(addr_val);
 
-    /* Ask the manager for the page, the manager will contact the
-       correct owner */
-    err = this->get_rd_page_from_mngr(addr);
-  
-    if (err.has_value()) {
-      DBGH << "Retrying read fault after sleep" << std::endl;
-      if (!unwrap(this->is_manager()))
-	this->pg_tbl->page_locks[addr_val].unlock();
-      std::this_thread::sleep_for(1s);
-      continue; // Continue here
+    this->stats.rc_diffs++;
+    this->stats.rc_diff_bytes += diff.size();
+
+    auto req = make_msg(OP_RC_DIFF, this->id, addr_val, IvyAccessType::WR,
+			std::move(diff));
+    auto home = this->manager_of(addr_val);
+
+    if (home == this->id) {
+      auto resp = this->rc_diff_adapter(req);
+      if ((resp.hdr.flags & MSG_F_ERR) && !result.has_value())
+	result = "Merging diff of page " + std::to_string(addr_val)
+	  + " failed";
+      continue;
     }
-      
-  
-    this->pg_tbl->info[addr_val].access = IvyAccessType::RD;
 
-    DBGH << "Read fault serviced " << std::endl;
+    /* Every home merges in parallel, gather the acks below */
+    lz_pack(req, this->lz_policy, this->stats);
+    homes.push_back(home);
+    acks.push_back(this->rpcserver->call_async(home, req));
+  }
 
-    if (!unwrap(this->is_manager()))
-    this->pg_tbl->page_locks[addr_val].unlock();
+  for (size_t i = 0; i < acks.size(); i++) {
+    auto [resp, err] = acks[i].get();
+
+    if (!err.has_value() && (resp.hdr.flags & MSG_F_ERR))
+      err = "merge failed";
+
+    if (err.has_value() && !result.has_value())
+      result = "Release to node " + std::to_string(homes[i]) + " failed: "
+	+ err.value();
+  }
+
+  return result;
+}
+
+void Ivy::lock_acq_adapter(const msg_t &in, rpc_reply_f reply) {
+  auto lock = in.hdr.pg_addr;
+
+  this->locks.acquire(lock, in.hdr.version,
+		      [this, lock, reply](vector<uint64_t> notices,
+					  uint64_t seq) {
+    auto resp = make_msg(OP_LOCK_ACQ, this->id, lock, IvyAccessType::NONE,
+			 pack_addrs(notices));
+    resp.hdr.version = seq;
+
+    reply(std::move(resp));
+  });
+}
+
+msg_t Ivy::lock_rel_adapter(const msg_t &in) {
+  this->locks.release(in.hdr.pg_addr, unpack_addrs(in.payload));
+
+  return make_msg(OP_LOCK_REL, this->id, in.hdr.pg_addr);
+}
+
+msg_t Ivy::rc_fetch_adapter(const msg_t &in) {
+  auto addr_ul = this->blk_align(in.hdr.pg_addr);
+
+  IVY_ASSERT(this->manager_of(addr_ul) == this->id,
+	     "rc fetch on a node that isn't the page's home");
+
+  auto resp = make_msg(OP_RC_FETCH, this->id, addr_ul, IvyAccessType::RD,
+		       this->home_pgs->read(addr_ul));
+  lz_pack(resp, this->lz_policy, this->stats);
+
+  return resp;
+}
+
+msg_t Ivy::rc_diff_adapter(const msg_t &in) {
+  auto addr_ul = this->blk_align(in.hdr.pg_addr);
+  auto resp = make_msg(OP_RC_DIFF, this->id, addr_ul);
+
+  IVY_ASSERT(this->manager_of(addr_ul) == this->id,
+	     "rc diff on a node that isn't the page's home");
+
+  auto diff = in;
+  auto err = lz_unpack(diff, this->stats, this->max_payload);
+
+  if (!err.has_value())
+    err = this->home_pgs->merge(addr_ul, diff.payload);
+
+  if (err.has_value()) {
+    DBGH << "Merging diff into " << P(addr_ul) << " failed: "
+	 << err.value() << std::endl;
+    resp.hdr.flags |= MSG_F_ERR;
+  } else {
+    this->stats.rc_merged++;
   }
 
+  return resp;
+}
+
+bool Ivy::is_wu(uint64_t addr_val) {
+  for (auto &[start, end] : this->wu_ranges)
+    if (addr_val >= start && addr_val < end)
+      return true;
+
+  return false;
+}
+
+mres_t Ivy::wu_wr_fault(uint64_t addr_val, ucontext_t *uctx) {
+  auto addr_ptr = reinterpret_cast<void_ptr>(addr_val);
+
+  /* Writers hold a read copy like everyone else, the store faults
+     again once it is here */
+  if (this->pg_entry(addr_val).access == IvyAccessType::NONE)
+    return this->rd_fault_hdlr(addr_ptr);
+
+  /* Held until the store is done so no update is applied under it */
+  wait_lock(this->pg_tbl->page_locks[addr_val]);
+
+  wu_step.addr = addr_val;
+  wu_step.twin = this->read_page(addr_ptr);
+
+  this->set_access(addr_ptr, this->blk_pgs(), IvyAccessType::RW);
+  uctx->uc_mcontext.gregs[REG_EFL] |= EFL_TF;
+
   return {};
 }
 
-mres_t Ivy::wr_fault_hdlr(void_ptr addr) {
-  IVY_ASSERT(this->pg_tbl, "Page table uninit");
+mres_t Ivy::wu_send_update() {
+  auto addr_val = wu_step.addr;
+  auto addr_ptr = reinterpret_cast<void_ptr>(addr_val);
+
+  this->set_access(addr_ptr, this->blk_pgs(), IvyAccessType::RD);
+
+  auto upd = encode_update(wu_step.twin.data(),
+			   reinterpret_cast<const char*>(addr_ptr), this->blk_sz);
+  wu_step.addr = 0;
 
-  uint64_t addr_val = pg_align(reinterpret_cast<uint64_t>(addr));
+  this->pg_tbl->page_locks[addr_val].unlock();
+
+  this->stats.wu_updates++;
+  this->stats.wu_bytes += upd.size();
+
+  auto req = make_msg(OP_WU_UPDATE, this->id, addr_val, IvyAccessType::WR,
+		      std::move(upd));
+  auto mngr = this->manager_of(addr_val);
 
   optional<err_t> err = {""};
 
+  /* Bounded even if requests retry forever, see WU_TIMEOUT */
+  Backoff backoff(this->retry_timeout.count() == 0 ? WU_TIMEOUT
+		  : std::min(this->retry_timeout, WU_TIMEOUT));
+
+  /* The page lock is dropped above, a retry doesn't hold up the
+     manager's invalidations or other faults on the page */
   while (err.has_value()) {
-    if (!unwrap(this->is_manager())) {
-      DBGH << "Getting lock for addr " << P(addr_val) << std::endl;
-      wait_lock(this->pg_tbl->page_locks[addr_val]);
-      DBGH << "Lock address = " << P(&pg_tbl->page_locks[addr_val])
-	   << std::endl;
+    msg_t resp;
+
+    if (mngr == this->id) {
+      resp = this->dir_call(req);
+      err = {};
+    } else {
+      auto [resp_, err_] = this->rpcserver->call(mngr, req);
+      resp = std::move(resp_);
+      err = err_;
     }
 
-    err = this->get_wr_page_from_mngr(addr);
+    if (!err.has_value() && (resp.hdr.flags & MSG_F_ERR))
+      err = "update failed";
 
     if (err.has_value()) {
-      DBGH << "Retrying write fault after sleep"<< std::endl;
-      if (!unwrap(this->is_manager()))
-	      this->pg_tbl->page_locks[addr_val].unlock();
-      std::this_thread::sleep_for(1s);
-      continue;
+      DBGH << "Retrying update: " << err.value() << std::endl;
+      if (!backoff.wait())
+	return {"Update of " + std::to_string(addr_val) + " failed: "
+		+ err.value()};
     }
+  }
 
-    this->pg_tbl->info[addr_val].access = IvyAccessType::WR;
+  return {};
+}
 
-    DBGH << "Write fault serviced" << std::endl;
+msg_t Ivy::wu_apply_adapter(const msg_t &in) {
+  const auto addr_ul = this->blk_align(in.hdr.pg_addr);
+  const auto addr_ptr = reinterpret_cast<void_ptr>(addr_ul);
 
-    if (!unwrap(this->is_manager()))
-      this->pg_tbl->page_locks[addr_val].unlock();
+  auto resp = make_msg(OP_WU_APPLY, this->id, addr_ul);
+  auto &lock = this->pg_tbl->page_locks[addr_ul];
+  auto &entry = this->pg_entry(addr_ul);
+
+  /* Same as an invalidation, a fault in progress may be waiting on
+     this very update and lends the lock out meanwhile. The copy it
+     gets may predate the update, have it drop that copy. */
+  bool borrowed = lock.borrow();
+  if (borrowed)
+    entry.fault_state |= IvyPageTable::FAULT_INVAL;
+
+  /* Apply it through the alias even without access, the owner serves
+     new readers from this memory whether it maps the page or not.
+     Local threads stay off the block meanwhile: they fault, wait for
+     the page lock and find their access unchanged. */
+  auto base = reinterpret_cast<uint64_t>(this->region);
+  if (entry.access != IvyAccessType::NONE)
+    this->set_access(addr_ptr, this->blk_pgs(), IvyAccessType::NONE);
+
+  auto err = apply_update(this->wu_alias + (addr_ul - base), in.payload,
+			  this->blk_sz);
+
+  if (entry.access != IvyAccessType::NONE)
+    this->set_access(addr_ptr, this->blk_pgs(),
+		     entry.access == IvyAccessType::WR
+		     ? IvyAccessType::RW : entry.access);
+
+  if (err.has_value())
+    resp.hdr.flags |= MSG_F_ERR;
+  else
+    this->stats.wu_applied++;
+
+  if (borrowed)
+    lock.give_back();
+  else
+    lock.unlock();
+
+  return resp;
+}
+
+void Ivy::prefetch_after(uint64_t addr_val) {
+  auto &st = pf_stream;
+  auto dist = static_cast<int64_t>(addr_val - st.last);
+  this->stats.pf_misses++;
+
+  /* Still on the stride, the blocks in between were prefetched */
+  bool on_stride = st.stride != 0 && dist % st.stride == 0
+    && dist / st.stride > 0
+    && dist / st.stride <= static_cast<int64_t>(this->pf_depth) + 1;
+
+  st.last = addr_val;
+
+  if (!on_stride) {
+    st.stride = dist;
+    return;
+  }
+
+  {
+    ivyguard(this->pf_lock);
+
+    for (auto blk = addr_val - dist + st.stride; blk != addr_val;
+	 blk += st.stride) {
+      if (this->pf_pending.erase(blk) != 0)
+	this->stats.pf_hits++;
+    }
+  }
+
+  auto base = reinterpret_cast<uint64_t>(this->base_addr);
+  auto end = base + this->region_sz;
+
+  for (size_t i = 1; i <= this->pf_depth; i++) {
+    uint64_t blk = addr_val + st.stride * static_cast<int64_t>(i);
+    if (blk < base || blk >= end)
+      break;
+
+    {
+      ivyguard(this->pf_lock);
+      if (!this->pf_pending.insert(blk).second)
+	continue;
+    }
+
+    /* Every block is a separate request, they go out in parallel */
+    this->stats.pf_issued++;
+    this->pf_pool.submit([this, blk] { this->prefetch_one(blk); });
   }
-  
-  return {};
 }
 
-mres_t Ivy::reg_addr_range(void *start, size_t bytes) {
-  // IVY_ASSERT(this->fd != 0, "fd not initialized");
+void Ivy::prefetch_one(uint64_t addr_val) {
+  auto &lock = this->pg_tbl->page_locks[addr_val];
 
-  if (-1 == mprotect(start, bytes, PROT_NONE)) {
+  /* Someone is faulting on it already */
+  if (!lock.try_lock()) {
+    ivyguard(this->pf_lock);
+    this->pf_pending.erase(addr_val);
+    return;
+  }
+
+  auto &entry = this->pg_entry(addr_val);
+  mres_t err = {"present"};
+
+  if (entry.access == IvyAccessType::NONE) {
+    entry.fault_state = IvyPageTable::FAULT_ACTIVE;
+    err = this->get_rd_page_from_mngr(reinterpret_cast<void_ptr>(addr_val));
+
+    if (!err.has_value())
+      entry.access = IvyAccessType::RD;
+
+    /* Same as a read fault, a copy that raced a write is dropped */
+    if ((entry.fault_state.exchange(0) & IvyPageTable::FAULT_INVAL)
+	&& !err.has_value()) {
+      this->invalidate(reinterpret_cast<void_ptr>(addr_val));
+      entry.access = IvyAccessType::NONE;
+      err = {"invalidated"};
+    }
+  }
+
+  this->end_fault(addr_val);
+
+  /* Not prefetched after all, don't count a hit for it */
+  if (err.has_value()) {
+    ivyguard(this->pf_lock);
+    this->pf_pending.erase(addr_val);
+  }
+}
+
+mres_t Ivy::reg_addr_range(void *start, size_t bytes) {
+  if (this->uffd) {
+    auto err = this->uffd->start(start, bytes,
+				 [this](uint64_t addr, bool write) {
+				   this->uffd_fault(addr, write);
+				 });
+    if (err.has_value())
+      return err;
+  } else if (-1 == mprotect(start, bytes, PROT_NONE)) {
     return {PSTR()};
   }
+
+  this->note_prot(reinterpret_cast<uint64_t>(start), bytes,
+		  IvyAccessType::NONE);
   return {};
 }
 
+mres_t Ivy::install(void_ptr addr, const string &data,
+		    IvyAccessType access) {
+  if (this->uffd) {
+    auto err = this->uffd->place(addr, data.data(), this->blk_sz,
+				 access == IvyAccessType::RD);
+    if (!err.has_value())
+      this->note_prot(reinterpret_cast<uint64_t>(addr), this->blk_sz,
+		      access);
+
+    return err;
+  }
+
+  auto err = this->set_access(addr, this->blk_pgs(), IvyAccessType::RW);
+  if (err.has_value())
+    return err;
+
+  std::memcpy(addr, data.data(), this->blk_sz);
+
+  if (access == IvyAccessType::RW)
+    return {};
+
+  return this->set_access(addr, this->blk_pgs(), access);
+}
+
+void Ivy::uffd_fault(uint64_t addr, bool write) {
+  auto perm = this->read_mem_perm(reinterpret_cast<void_ptr>(addr));
+
+  /* An earlier fault on the block already got it */
+  if (perm == IvyAccessType::RW || (!write && perm == IvyAccessType::RD))
+    return;
+
+  auto addr_ptr = reinterpret_cast<void_ptr>(addr);
+  auto err = write ? this->wr_fault_hdlr(addr_ptr)
+    : this->rd_fault_hdlr(addr_ptr);
+
+  if (err.has_value()) {
+    DBGH << "Error: " << err.value() << std::endl;
+    exit(1);
+  }
+}
+
+void Ivy::note_prot(uint64_t addr, size_t bytes, IvyAccessType access) {
+  auto base = reinterpret_cast<uint64_t>(this->base_addr);
+  auto end = base + this->region_sz;
+
+  for (auto pg = std::max(pg_align(addr), base);
+       pg < std::min(addr + bytes, end); pg += Ivy::PAGE_SZ) {
+    this->pg_prot[(pg - base) / Ivy::PAGE_SZ] = access;
+  }
+}
+
+res_t<msg_t> Ivy::call_for_fault(size_t target, const msg_t &req) {
+  auto &lock = this->pg_tbl->page_locks[req.hdr.pg_addr];
+
+  /* The manager may have to fetch or invalidate our copy of the page
+     before it gets to this request, let those in while we wait */
+  lock.lend();
+
+  res_t<msg_t> res;
+  if (target == this->id) {
+    /* Skip the RPC server if I'm the manager */
+    res = {this->dir_call(req), {}};
+  } else {
+    res = this->rpcserver->call(target, req);
+  }
+
+  lock.reclaim();
+
+  return res;
+}
+
 mres_t Ivy::get_rd_page_from_mngr(void_ptr addr) {
-  auto addr_aligned = pg_align(addr);
+  auto addr_aligned = this->blk_align(addr);
   auto addr_ul = reinterpret_cast<uint64_t>(addr_aligned);
-  auto addr_str = std::to_string(addr_ul);
 
   string mem_str;
+  msg_t resp;
+
+  auto req = make_msg(OP_GET_RD_PG, this->id, addr_ul, IvyAccessType::RD);
 
-  string payload = ":" + std::to_string(this->id);
+  /* Offer the copy kept from the last time we held the page */
+  auto base = this->page_diff
+    ? this->diff_cache->saved_version(addr_ul) : std::nullopt;
+  if (base.has_value()) {
+    req.hdr.flags |= MSG_F_DIFF;
+    req.hdr.version = base.value();
+  }
   
-  if (unwrap(this->is_manager())) {
-    /* Skip the HTTP server if I'm the manager */
-    mem_str = this->serv_rd_rq_adapter(addr_str + payload);
-  } else {
-    /* Otherwise, call the manager node */
-    auto [mem_str_, err_]
-      = this->rpcserver->call(0, GET_RD_PAGE_FROM_MANAGER,
-				       addr_str + payload);
+  auto target = this->fault_target(addr_ul);
 
-    if (err_.has_value())
-      return err_;
-    
-    mem_str = mem_str_;
+  auto [resp_, err_] = this->call_for_fault(target, req);
+  if (err_.has_value())
+    return err_;
+
+  resp = std::move(resp_);
+
+  /* The manager gave up on the owner */
+  if (resp.hdr.flags & MSG_F_ERR)
+    return {"Manager could not serve the page"};
+
+  /* The manager holds off other requests for the page until we are
+     done with it, see end_fault() */
+  if (this->mngr_mode != MNGR_DYNAMIC)
+    this->pg_cold(addr_ul).confirm_to = target;
+
+  /* The reply comes from the owner, ask it directly next time */
+  if (this->mngr_mode == MNGR_DYNAMIC) {
+    std::lock_guard<PageLock> guard(this->pg_tbl->info_locks[addr_ul]);
+    this->pg_entry(addr_ul).prob_owner = resp.hdr.node;
+  }
+
+  auto push_err = this->take_pushed(resp);
+  if (push_err.has_value())
+    return push_err;
+
+  auto lz_err = lz_unpack(resp, this->stats, this->max_payload);
+  if (lz_err.has_value())
+    return lz_err;
+
+  if (resp.hdr.flags & MSG_F_DIFF) {
+    /* Fails if the saved copy went away, the retry asks for the
+       whole page */
+    auto [page, err] = this->diff_cache->patch(addr_ul, base.value(),
+					      resp.payload);
+    if (err.has_value())
+      return err;
+
+    mem_str = std::move(page);
+  } else {
+    mem_str = std::move(resp.payload);
   }
   
-  IVY_ASSERT(mem_str.length() == 2*PAGE_SZ,
+  IVY_ASSERT(mem_str.length() == this->blk_sz,
 	     "Not enough bytes received from the manager"
-	     + std::string(", expected ") + std::to_string(2*PAGE_SZ)
+	     + std::string(", expected ") + std::to_string(this->blk_sz)
 	     + std::string(", got ") + std::to_string(mem_str.length()));
   
-  auto mem = from_hex(mem_str);
-
   /* Write the page to node's memory and set the correct permission */
-  this->set_access(addr_aligned, 1, IvyAccessType::RW);
-  std::memcpy(addr_aligned, mem, PAGE_SZ);
-  this->set_access(addr_aligned, 1, IvyAccessType::RD);
+  auto err = this->install(addr_aligned, mem_str, IvyAccessType::RD);
+  if (err.has_value())
+    return err;
+
+  if (this->page_diff)
+    this->diff_cache->set_live(addr_ul, resp.hdr.version);
 
   return {};
 }
 
 mres_t Ivy::get_wr_page_from_mngr(void_ptr addr) {
-  auto addr_aligned = pg_align(addr);
+  auto addr_aligned = this->blk_align(addr);
   auto addr_ul = reinterpret_cast<uint64_t>(addr_aligned);
-  auto addr_str = std::to_string(addr_ul);
 
-  string mem_str;
+  msg_t resp;
   
-  string payload = ":" + std::to_string(this->id);
+  auto req = make_msg(OP_GET_WR_PG, this->id, addr_ul, IvyAccessType::WR);
 
   DBGH << "Getting the page from the manager for address: "
        << addr << std::endl;
   
-  if (unwrap(this->is_manager())) {
-    /* Skip the HTTP server if I'm the manager */
-    mem_str = this->serv_wr_rq_adapter(addr_str + payload);
-  } else {
-    /* Otherwise, call the manager for the page */
-    auto [mem_str_, err_]
-      = this->rpcserver->call(0, GET_WR_PAGE_FROM_MANAGER,
-				     addr_str + payload);
+  auto target = this->fault_target(addr_ul);
 
-    if (err_.has_value())
-      return err_;
-    
-    mem_str = mem_str_;
+  auto [resp_, err_] = this->call_for_fault(target, req);
+  if (err_.has_value())
+    return err_;
+
+  resp = std::move(resp_);
+
+  if (resp.hdr.flags & MSG_F_ERR)
+    return {"Manager could not serve the page"};
+
+  if (this->mngr_mode != MNGR_DYNAMIC)
+    this->pg_cold(addr_ul).confirm_to = target;
 
-    DBGH << "Call completed, page received:" << std::endl;
-    dump_from_hex(mem_str);
-    DBGH << std::endl;
+  /* We own the page now, requests for it end here */
+  if (this->mngr_mode == MNGR_DYNAMIC) {
+    std::lock_guard<PageLock> guard(this->pg_tbl->info_locks[addr_ul]);
+
+    auto &entry = this->pg_entry(addr_ul);
+    entry.prob_owner = this->id;
+    entry.version = resp.hdr.version;
+    this->pg_cold(addr_ul).granted_ns = pin_now_ns();
+
+    if (this->subblks)
+      this->subblks->record(addr_ul, resp.hdr.node, resp.hdr.written);
   }
 
-  auto cur_perm = this->read_mem_perm(addr_aligned);
-  
-  /* Set the correct permission and copy the page to node's memory */
-  this->set_access(addr_aligned, 1, IvyAccessType::RW);
+  auto push_err = this->take_pushed(resp);
+  if (push_err.has_value())
+    return push_err;
+
+  auto lz_err = lz_unpack(resp, this->stats, this->max_payload);
+  if (lz_err.has_value())
+    return lz_err;
 
+  auto mem_str = std::move(resp.payload);
+  auto version = resp.hdr.version;
+
+  DBGH << "Call completed, page received:" << std::endl;
+  dump_page(mem_str);
+  DBGH << std::endl;
 
   /* if this node already has read access to the page, no need to copy
      it to the memory */
-  if (mem_str.length() == 2*PAGE_SZ) {
+  if (!mem_str.empty()) {
     std::stringstream errmsg;
     errmsg << "Not enough bytes received from the manager, expected "
-	   << 2*PAGE_SZ << ", got " << mem_str.length()
+	   << this->blk_sz << ", got " << mem_str.length()
 	   << std::endl;
-    IVY_ASSERT(mem_str.length() == 2*PAGE_SZ, errmsg.str());
+    IVY_ASSERT(mem_str.length() == this->blk_sz, errmsg.str());
   
-    auto mem = from_hex(mem_str);
-
-    std::memcpy(addr_aligned, mem, PAGE_SZ);
+    auto err = this->install(addr_aligned, mem_str, IvyAccessType::RW);
+    if (err.has_value())
+      return err;
   } else {
     DBGH << "Not writing page " << P(addr_aligned)
 	 << " to memory, already have it"
 	 << std::endl;
+
+    this->set_access(addr_aligned, this->blk_pgs(), IvyAccessType::RW);
+  }
+
+  /* Twin the block to find the sub-blocks written once it goes */
+  if (this->subblks)
+    this->subblks->twin(addr_ul, reinterpret_cast<const char*>(addr_aligned));
+
+  /* What the page holds now is the version before this write grant,
+     nodes that read it get a diff against it later */
+  if (this->page_diff) {
+    this->diff_cache->save(addr_ul, version - 1,
+			  reinterpret_cast<const char*>(addr_aligned));
+    this->diff_cache->set_live(addr_ul, version);
   }
 
   return {};  
 }
 
 
-mres_t Ivy::send_invalidations(void_ptr addr, vector<size_t> nodes) {
+Task<vector<size_t>> Ivy::send_invalidations(void_ptr addr,
+					     vector<size_t> nodes,
+					     idx_t new_owner) {
   DBGH << "Sending out invalidations for addr " << addr << std::endl;
 
+  auto addr_ul = reinterpret_cast<uint64_t>(addr);
+  vector<RpcServer::pending_t> acks;
+
+  /* Send to the whole copyset first, then gather the acks, so a write
+     fault costs one round trip no matter how many readers there are */
+  auto inflight = this->stats.inval_inflight += nodes.size();
+  IvyStats::update_max(this->stats.inval_inflight_max, inflight);
+  this->stats.inval_sent += nodes.size();
+
   for (auto node : nodes) {
-    printf("Node = %ld\n", node);
-    // DBGH << "Processing node " << node << std::endl;
-    auto addr_ul = reinterpret_cast<uint64_t>(addr);
-    DBGH << this->rpcserver->ca_va() << std::endl;
-    auto [resp, err] = this->rpcserver->call(node, INVALIDATE_PG,
-					    std::to_string(addr_ul));
+    DBGH << "Invalidating node " << node << std::endl;
+
+    auto req = make_msg(OP_INVALIDATE, new_owner, addr_ul);
+    acks.push_back(this->rpcserver->co_call(node, req));
+  }
+
+  vector<size_t> missed;
+  for (size_t i = 0; i < nodes.size(); i++) {
+    auto [resp, err] = co_await acks[i];
+    this->stats.inval_inflight--;
 
     if (err.has_value()) {
-      return err;
-    } else if (resp != OK) {
-      return {"Invalidation failed for node " + std::to_string(node)};
-    } else {
-      DBGH << "Invalidation OK" << std::endl;
+      DBGH << "Invalidation failed for node " << nodes[i] << ": "
+	   << err.value() << std::endl;
+      missed.push_back(nodes[i]);
     }
   }
 
-  DBGH << "Invalidation complete" << std::endl;
-  
-  return {};
+  if (missed.empty())
+    DBGH << "Invalidation complete" << std::endl;
+
+  co_return missed;
 }
 
 mres_t Ivy::invalidate(void_ptr addr) {
-  return this->set_access(addr, 1, IvyAccessType::NONE);
+  return this->set_access(addr, this->blk_pgs(), IvyAccessType::NONE);
 }
 
-string Ivy::invalidate_adapter(const string in) {
-  const auto addr = in;
-  const auto addr_ul = pg_align(std::stoul(addr, nullptr, 10));
+msg_t Ivy::invalidate_adapter(const msg_t &in) {
+  const auto addr_ul = this->blk_align(in.hdr.pg_addr);
   const auto addr_ptr = reinterpret_cast<void_ptr>(addr_ul);
 
-  if (!unwrap(this->is_manager())) {
-    DBGH << "Getting lock for addr " << P(addr_ul) << std::endl;
-    wait_lock(this->pg_tbl->page_locks[addr_ul]);
-    DBGH << "Lock address = " << P(&pg_tbl->page_locks[addr_ul])
-	 << std::endl;
+  auto resp = make_msg(OP_INVALIDATE, this->id, addr_ul);
+  auto &lock = this->pg_tbl->page_locks[addr_ul];
+  auto &entry = this->pg_entry(addr_ul);
+
+  if (this->mngr_mode == MNGR_DYNAMIC) {
+    std::lock_guard<PageLock> guard(this->pg_tbl->info_locks[addr_ul]);
+    entry.prob_owner = in.hdr.node;
   }
 
+  /* A fault on this page holds the lock until its reply arrives,
+     which may be waiting on this very invalidation. It lends the lock
+     out meanwhile, and the copy it gets may predate this write: leave
+     a note for it to drop the copy once it is done. */
+  bool borrowed = lock.borrow();
+  if (borrowed) {
+    DBGH << "Invalidating " << P(addr_ul) << " under a fault" << std::endl;
+    entry.fault_state |= IvyPageTable::FAULT_INVAL;
+  }
+
+  /* Keep the copy we had, a later read of the page can be a diff */
+  if (this->page_diff)
+    this->diff_cache->save_live(addr_ul,
+			       reinterpret_cast<const char*>(addr_ptr));
+
   auto err = this->invalidate(addr_ptr);
+  entry.access = IvyAccessType::NONE;
 
-  if (!unwrap(this->is_manager())) {
-    this->pg_tbl->page_locks[addr_ul].unlock();
+  /* A prefetched copy lost before the scan got to it */
+  if (this->pf_depth != 0) {
+    ivyguard(this->pf_lock);
+    this->pf_pending.erase(addr_ul);
   }
-  
-  if (err.has_value())
-    return NOT_OK;
+
+  if (borrowed)
+    lock.give_back();
   else
-    return OK;
+    lock.unlock();
+
+  if (err.has_value())
+    resp.hdr.flags |= MSG_F_ERR;
+
+  return resp;
 }
 
 std::string Ivy::read_page(void_ptr addr) {
-  auto aligned_addr = pg_align(addr);
+  auto aligned_addr = this->blk_align(addr);
   auto *page = reinterpret_cast<const char*>(aligned_addr);
 
-  auto result = to_hex(page, PAGE_SZ);
+  auto result = string(page, this->blk_sz);
   DBGH << "read_page result.size = " << result.size() << std::endl;
-  IVY_ASSERT(result.size() == PAGE_SZ*2, "Reading memory failed");
+  IVY_ASSERT(result.size() == this->blk_sz, "Reading memory failed");
 
-  dump_from_hex(result);
+  dump_page(result);
 
   return result;
 }
 
-string Ivy::serv_rd_rq_adapter(string in) {
-  auto sep = in.find(":");
-  auto addr_str = in.substr(0, sep);
-  auto req_node_str = in.substr(sep+1, in.size()-1);
-
-  DBGH << "Got RD request for addr = " << addr_str << " from node "
-       << req_node_str << std::endl;
-
-  auto addr_ul = std::stoul(addr_str, nullptr, 10);
-  auto addr_ptr = reinterpret_cast<void_ptr>(addr_ul);
-  addr_ptr = pg_align(addr_ptr);
-  
-  auto req_node = std::stoul(req_node_str, nullptr, 10);
-
-  optional<err_t> err = {""};
-  string res = "";
-  
-  while (err.has_value()) {
-    auto [res_, err_] = this->serv_rd_rq(addr_ptr, req_node);
-
-    std::this_thread::sleep_for(1s);
-    
-    err = err_;
-    res = res_;
-  }
-  
-  return res;
-}
-    
-string Ivy::serv_wr_rq_adapter(string in) {
-  auto sep = in.find(":");
-  auto addr_str = in.substr(0, sep);
-  auto req_node_str = in.substr(sep+1, in.size()-1);
-
-  DBGH << "Got WR request for addr = " << addr_str << " from node "
-       << req_node_str << std::endl;
-
-
-  auto addr_ul = std::stoul(addr_str, nullptr, 10);
-  auto addr_ptr = reinterpret_cast<void_ptr>(addr_ul);
-  DBGH << addr_str << " -> " << addr_ul << " -> " << addr_ptr
-       << std::endl;
-  addr_ptr = pg_align(addr_ptr);
-
-  DBGH << addr_str << " -> " << addr_ul << " -> " << addr_ptr
-       << std::endl;
-
-  
-  auto req_node = std::stoul(req_node_str, nullptr, 10);
-  
-  optional<err_t> err = {""};
-  string res = "";
-  
-  while (err.has_value()) {
-    auto [res_, err_] = this->serv_wr_rq(addr_ptr, req_node);
-
-    std::this_thread::sleep_for(1s);
-    
-    err = err_;
-    res = res_;
-  }
-  
-  if (err.has_value()) IVY_ERROR(err.value());
-  return res;  
-}
-
 void Ivy::dump_shm_page(size_t page_num) {
   auto mem_str = this->read_page(((byte_ptr)this->base_addr)
 				 + page_num*PAGE_SZ);
 
-  dump_from_hex(mem_str);
+  dump_page(mem_str);
   
 }
+
+string Ivy::false_sharing() {
+  if (!this->subblks)
+    return "";
+
+  return this->subblks->report();
+}
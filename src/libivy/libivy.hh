@@ -9,6 +9,7 @@
 #ifndef IVY_HEADER_LIBIVY_IVY_H__
 #define IVY_HEADER_LIBIVY_IVY_H__
 
+#include <atomic>
 #include <memory>
 #include <optional>
 #include <stdexcept>
@@ -19,9 +20,21 @@
 
 #include "common.hh"
 #include "../common.hh"
+#include "backoff.hh"
+#include "compress.hh"
+#include "falseshare.hh"
 #include "ivypagetbl.hh"
 #include "json.hpp"
+#include "pagediff.hh"
+#include "pinwindow.hh"
+#include "relcons.hh"
 #include "rpcserver.hh"
+#include "stats.hh"
+#include "task.hh"
+#include "timerqueue.hh"
+#include "uffd.hh"
+#include "wire.hh"
+#include "workerpool.hh"
 
 #include <signal.h>
 
@@ -40,6 +53,13 @@ namespace libivy {
 
   constexpr char* FAIL_STR = (char*)"No can't do";
   constexpr size_t PG_SZ = 4096;
+
+  /** @brief Where the directory entry of a page lives */
+  enum IvyManagerMode {
+    MNGR_CENTRAL, /* Every entry on manager_id */
+    MNGR_FIXED,   /* Page number modulo the number of nodes */
+    MNGR_DYNAMIC, /* None, requests follow the probable owner */
+  };
   
   class Ivy {
     /* Private variables */
@@ -60,20 +80,105 @@ namespace libivy {
 
     void_ptr mem;
 
+    /* IvyAccessType of every page in the region, set with mprotect */
+    std::unique_ptr<std::atomic<uint8_t>[]> pg_prot;
+
     const string NODES_KEY = "nodes";
     const string MANAGER_ID_KEY = "manager_id";
     const string REGION_SZ_KEY = "region_sz";
     const string BASE_ADDR = "base_addr";
-
-    const string OK = "ok";
-    const string NOT_OK = "not-ok";
-
-    const string GET_RD_PAGE_FROM_MANAGER = "get_rd_page_from_manager";
-    const string GET_WR_PAGE_FROM_MANAGER = "get_wr_page_from_manager";
-    const string FETCH_PG = "fetch_pg";
-    const string INVALIDATE_PG = "invalidate_pg";
-
-    int fd;
+    const string LOCAL_TRANSPORT_KEY = "local_transport";
+    const string IO_BACKEND_KEY = "io_backend";
+    const string FAULT_ENGINE_KEY = "fault_engine";
+    const string MNGR_SHARDS_KEY = "manager_shards";
+    const string PAGE_DIFF_KEY = "page_diff";
+    const string COMPRESSION_KEY = "compression";
+    const string MANAGER_MODE_KEY = "manager_mode";
+    const string PAGE_TRANSFER_KEY = "page_transfer";
+    const string CONSISTENCY_KEY = "consistency";
+    const string WRITE_UPDATE_KEY = "write_update";
+    const string BLOCK_SZ_KEY = "block_sz";
+    const string SUBBLOCK_SZ_KEY = "subblock_sz";
+    const string PREFETCH_KEY = "prefetch_depth";
+    const string RETRY_TIMEOUT_KEY = "retry_timeout_ms";
+    const string PIN_WINDOW_KEY = "pin_window_us";
+    const string PIN_WINDOW_MAX_KEY = "pin_window_max_us";
+
+    /* Remote name of the stats dump, call with RpcServer::call() */
+    const string STATS_FN = "stats";
+
+    IvyStats stats;
+
+    IvyManagerMode mngr_mode = MNGR_CENTRAL;
+
+    /* Coherence unit, a multiple of PAGE_SZ */
+    bytes_t blk_sz = PAGE_SZ;
+
+    /* Longest payload a peer may send, see rpc_cfg_t::max_payload */
+    size_t max_payload = MAX_PAYLOAD;
+
+    /* Writes are tracked per sub-block to find false sharing, 0 if off */
+    bytes_t subblk_sz = 0;
+    unique_ptr<SubBlockTracker> subblks;
+
+    /* Send re-fetched pages as diffs against the last copy held */
+    bool page_diff = false;
+    unique_ptr<PageDiffCache> diff_cache;
+
+    /* Compression of page payloads on the way out */
+    LzPolicy lz_policy;
+
+    /* Owners send pages to the faulting node, not through the manager */
+    bool direct_xfer = false;
+
+    /* Release consistency: pages are fetched from their home and
+       written back as diffs on release */
+    IvyConsistency consistency = CONS_SEQUENTIAL;
+    unique_ptr<TwinTable> twins;
+    unique_ptr<HomeCopies> home_pgs;
+
+    /* Locks handed out by this node, lock id modulo the node count */
+    LockTable locks;
+
+    /* Sequence number of the last notices received, per lock */
+    mutex lock_seen_lock;
+    std::map<uint64_t, uint64_t> lock_seen;
+
+    /* Failed requests are retried for this long, 0 is forever */
+    std::chrono::milliseconds retry_timeout{60000};
+
+    /* Read ahead of strided scans, blocks in flight or installed and
+       not reached by the scan yet */
+    size_t pf_depth = 0;
+    mutex pf_lock;
+    std::set<uint64_t> pf_pending;
+    WorkerPool pf_pool;
+
+    /* Requests wait until the writer had the page for a while */
+    PinPolicy pin_policy;
+
+    /* [start, end) of the write-update ranges, page aligned */
+    vector<pair<uint64_t, uint64_t>> wu_ranges;
+
+    /* Second mapping of the region if there are write-update ranges,
+       updates are applied through it */
+    char *wu_alias = nullptr;
+
+    /* Pages pushed to us, picked up once the manager replies */
+    mutex push_lock;
+    std::map<uint64_t, msg_t> pushed;
+
+    /* Requests queued on a block start here once the one before is
+       done, off the thread that finished it, unless the manager is
+       sharded (see dir_submit). They resume where the RPC server runs
+       the block's requests after waiting on another node. */
+    WorkerPool dir_pool;
+
+    /* Requests held back by the pin window, see pin_wait */
+    TimerQueue pin_timers;
+
+    /* Serves faults instead of the SIGSEGV handler if set */
+    unique_ptr<UffdEngine> uffd;
 
     unique_ptr<libivy::IvyPageTable> pg_tbl;
 
@@ -90,12 +195,75 @@ namespace libivy {
 
     res_t<bool> ca_va();
     void dump_shm_page(size_t page_num);
+
+    /**
+     * @brief Start of a critical section in release consistency mode,
+     * drops the cached pages this node didn't write so later reads
+     * see what other nodes released. Does nothing otherwise.
+     */
+    mres_t acquire();
+
+    /**
+     * @brief End of a critical section in release consistency mode,
+     * merges the writes of this node into the home copies. Does
+     * nothing otherwise.
+     */
+    mres_t release();
+
+    /**
+     * @brief Take the cluster wide lock \p lock, blocks while another
+     * thread or node holds it. In lazy_release mode only the pages
+     * written under the lock since this node last held it are
+     * dropped, in release mode every clean page is.
+     */
+    mres_t acquire(uint64_t lock);
+
+    /**
+     * @brief Merge this node's writes into the home copies and free
+     * \p lock, the pages written go to the next holder as notices
+     */
+    mres_t release(uint64_t lock);
+
+    /**
+     * @brief Blocks this node saw move between writers of disjoint
+     * sub-blocks, one "fs_block address disjoint handoffs" line each.
+     * Empty unless subblock_sz is set, also part of "stats".
+     */
+    string false_sharing();
+
+    /** @brief Counters for this node, also served remotely as "stats" */
+    const IvyStats &get_stats() const { return this->stats; }
     /* Private methods */
   private:
     
     
-    /** @brief Check the permission of a memory location */
+    /** @brief Start of the block \p addr is in */
+    template <typename T>
+    T blk_align(T addr) const {
+      auto addr_ul = reinterpret_cast<uint64_t>(addr);
+      return reinterpret_cast<T>((addr_ul / this->blk_sz) * this->blk_sz);
+    }
+
+    /** @brief Pages in a block */
+    size_t blk_pgs() const { return this->blk_sz / PAGE_SZ; }
+
+    /**
+     * @brief Check the permission of a memory location, as last set
+     * through this node. Safe to call from the fault handler.
+     */
     IvyAccessType read_mem_perm(void_ptr addr);
+
+    /**
+     * @brief Copy a block received from another node into place and
+     * give it \p access
+     */
+    mres_t install(void_ptr addr, const string &data, IvyAccessType access);
+
+    /** @brief Fault reported by the userfaultfd engine */
+    void uffd_fault(uint64_t addr, bool write);
+
+    /** @brief Record the protection of a range for \ref read_mem_perm */
+    void note_prot(uint64_t addr, size_t bytes, IvyAccessType access);
     
     /** @brief Registers fault handler for this->mem */
     mres_t reg_fault_hdlr();
@@ -103,6 +271,9 @@ namespace libivy {
     /** @brief Handles the page faults for the memory region */
     static void sigaction_hdlr(int sig, siginfo_t *info, void * uctx);
 
+    /** @brief Sends out a write-update store once it executed */
+    static void sigtrap_hdlr(int sig, siginfo_t *info, void * uctx);
+
     /** @brief Register a range of address with pg fault hdlr */
     mres_t reg_addr_range(void *start, size_t bytes);
   
@@ -119,15 +290,113 @@ namespace libivy {
     mres_t set_access(void_ptr addr, size_t pg_cnt,
 		      IvyAccessType access);
 
-    /** @brief Set new perm and return the page as string */
+    /** @brief Set new perm and return the raw page bytes */
     string
     fetch_pg(void_ptr addr, IvyAccessType accessType);
 
-    /** @brief Service a read request for a page from the app */
-    res_t<string> serv_rd_rq(void_ptr page_addr, idx_t node);
-  
-    /** @brief Service a write request for a page from the app */
-    res_t<string> serv_wr_rq(void_ptr page_addr, idx_t node);
+    /**
+     * @brief Serve a read, write or write-update request as the
+     * block's manager. Starts it right away if no other request for
+     * the block is in flight and queues it otherwise, \p reply gets
+     * the response once the owner and the copies answered.
+     */
+    void dir_request(const msg_t &in, rpc_reply_f reply);
+
+    /** @brief Same as above, for a request of this node, waits for it */
+    msg_t dir_call(const msg_t &in);
+
+    /**
+     * @brief Serve a request the block is free for and answer it, then
+     * wait for the requester's confirmation or start the next one
+     */
+    Task<> dir_serve(msg_t in, rpc_reply_f reply);
+
+    /** @brief Get the owner's copy for a read request */
+    Task<res_t<msg_t>> serv_rd_rq(msg_t in);
+
+    /** @brief Get the page and invalidate the copies for a write request */
+    Task<res_t<msg_t>> serv_wr_rq(msg_t in);
+
+    /** @brief Pass a write update on to every copy */
+    Task<res_t<msg_t>> serv_wu_rq(msg_t in);
+
+    /**
+     * @brief Next request queued on \p addr_val to start, empty if none
+     * and the block is idle now. Call with the info lock held.
+     */
+    std::function<void()> dir_pop(uint64_t addr_val);
+
+    /**
+     * @brief Start \p job for the block at \p addr_val on its manager
+     * shard, or on dir_pool if requests aren't sharded
+     */
+    void dir_submit(uint64_t addr_val, std::function<void()> job);
+
+    /**
+     * @brief Release the page lock taken for a fault and confirm the
+     * grant it got, if any, so its manager moves on to the next
+     * request for the page
+     */
+    void end_fault(uint64_t addr_val);
+
+    /**
+     * @brief Service a read or write request in MNGR_DYNAMIC mode,
+     * serves it if this node owns the page and passes it on to the
+     * probable owner otherwise. Requests the owner gets while it
+     * serves one for the block queue up like a manager's, \p queued
+     * is set once they start from there.
+     */
+    Task<> dyn_serve(msg_t in, rpc_reply_f reply, bool queued);
+
+    /** @brief Pass a request on to the probable owner \p next */
+    Task<msg_t> dyn_forward(msg_t in, size_t next);
+
+    /** @brief Serve a request for a block this node owns */
+    Task<msg_t> serv_dyn_rq(msg_t in);
+
+    /** @brief Read fault in release consistency mode */
+    mres_t rc_rd_fault(uint64_t addr_val);
+
+    /**
+     * @brief Called after a read fault on \p addr_val, prefetches the
+     * next pf_depth blocks once the thread's faults follow a stride
+     */
+    void prefetch_after(uint64_t addr_val);
+
+    /** @brief Install a block read only ahead of demand, if still absent */
+    void prefetch_one(uint64_t addr_val);
+
+    /** @brief Write fault in release consistency mode */
+    mres_t rc_wr_fault(uint64_t addr_val);
+
+    /**
+     * @brief Send the diff of every twinned page to its home and wait
+     * for the merges, \p written gets the pages sent
+     */
+    mres_t flush_diffs(vector<uint64_t> &written);
+
+    /** @brief Copy the home copy of a page into memory, read only */
+    mres_t rc_fetch(uint64_t addr_val);
+
+    /** @brief Check if a page is in a write-update range */
+    bool is_wu(uint64_t addr_val);
+
+    /**
+     * @brief Write fault on a write-update page, lets the store
+     * through and single steps it
+     */
+    mres_t wu_wr_fault(uint64_t addr_val, ucontext_t *uctx);
+
+    /**
+     * @brief After a single stepped store, send the bytes it changed
+     * to the page's manager, which passes them to every copy. Gives
+     * up after \ref WU_TIMEOUT at the most.
+     */
+    mres_t wu_send_update();
+
+    /* Longest an update is retried for, even if requests retry
+       forever, the manager is taken to be gone past it */
+    static constexpr std::chrono::milliseconds WU_TIMEOUT{5000};
 
     /** @brief Check if the address is managed by the current node */
     bool is_owner(void_ptr pg_addr);
@@ -138,31 +407,103 @@ namespace libivy {
     /** @brief Get the owner node id from a page address */
     size_t get_owner(void_ptr pg_addr);
 
+    /** @brief Node holding the directory entry of a page */
+    size_t manager_of(uint64_t pg_addr);
+
+    /** @brief Check if this node holds the directory entry of a page */
+    bool manages(uint64_t pg_addr);
+
+    /** @brief Node a fault on the page sends its request to */
+    size_t fault_target(uint64_t pg_addr);
+
+    /** @brief Page table entry of the block a page is in */
+    IvyPageTable::info_t &pg_entry(uint64_t pg_addr);
+
+    /** @brief Side table entry of the same block, see cold_t */
+    IvyPageTable::cold_t &pg_cold(uint64_t pg_addr);
+
+    /** @brief Record the sub-blocks \p node wrote before losing a block */
+    void note_writes(uint64_t addr_val, idx_t node, uint64_t mask);
+
+    /**
+     * @brief Hold a request for a page until its writer is out of the
+     * pin window, the requests behind it stay queued meanwhile. It
+     * resumes where dir_submit starts the block's requests.
+     */
+    Task<> pin_wait(uint64_t addr_val, IvyPageTable::cold_t &cold);
+
     /** @brief Ask manager for access to a page, returns owner */
     res_t<size_t> req_manager(void_ptr addr, IvyAccessType access);
   
     /** @brief Acknowledge manager for access to a page */
     mres_t ack_manager(void_ptr addr, IvyAccessType access);
 
-    /** @brief Invalidates the page on every node (runs on manager) */
-    mres_t send_invalidations(void_ptr addr, vector<size_t> nodes);
+    /**
+     * @brief Invalidates the page on every node (runs on manager),
+     * \p new_owner is who the page goes to
+     * @return Nodes that could not be invalidated and still hold a copy
+     */
+    Task<vector<size_t>> send_invalidations(void_ptr addr,
+					    vector<size_t> nodes,
+					    idx_t new_owner);
     
     /** @brief Invalidates the page on this node */
     mres_t invalidate(void_ptr addr);
 
-    /** @brief Read a page from memory and convert it to a string */
+    /** @brief Read a page from memory as raw bytes */
     string read_page(void_ptr addr);
 
+    /**
+     * @brief Send the request of a fault holding the page lock to
+     * \p target and wait for the answer, lending the lock out
+     * meanwhile
+     */
+    res_t<msg_t> call_for_fault(size_t target, const msg_t &req);
+
     mres_t get_rd_page_from_mngr(void_ptr addr);
     mres_t get_wr_page_from_mngr(void_ptr addr);
     
     /* Adapter functions for RPC */
 
-    /** @brief Adapts \ref serv_rd_rq */
-    string serv_rd_rq_adapter(string in);
-    string serv_wr_rq_adapter(string in);
-    string fetch_pg_adapter(string in);
-    string invalidate_adapter(string in);
+    msg_t dir_ack_adapter(const msg_t &in);
+    msg_t fetch_pg_adapter(const msg_t &in);
+    msg_t push_pg_adapter(const msg_t &in);
+    msg_t rc_fetch_adapter(const msg_t &in);
+    msg_t rc_diff_adapter(const msg_t &in);
+    void lock_acq_adapter(const msg_t &in, rpc_reply_f reply);
+    msg_t lock_rel_adapter(const msg_t &in);
+    msg_t wu_apply_adapter(const msg_t &in);
+
+    /**
+     * @brief Page for a OP_FETCH_PG request \p in, compressed and ready
+     * to send or push
+     */
+    msg_t fetch_pg_msg(const msg_t &in);
+
+    /**
+     * @brief fetch_pg_adapter() for the manager's own pages, pushes
+     * without blocking the thread the directory runs on
+     */
+    Task<msg_t> co_fetch_pg(msg_t in);
+
+    /**
+     * @brief Send \p page to \p node and return what the manager gets
+     * back instead, the header flagged MSG_F_PUSH without the payload
+     */
+    Task<msg_t> push_pg(idx_t node, msg_t page);
+
+    /**
+     * @brief Same as \ref push_pg, blocking, for fetch_pg_adapter()
+     * which answers on the thread it runs on
+     */
+    msg_t push_pg_blocking(idx_t node, msg_t page);
+
+    /** @brief Reply for a push of \p page, retagged as OP_PUSH_PG */
+    msg_t push_prep(idx_t node, msg_t &page);
+
+    /** @brief Swap a MSG_F_PUSH reply for the page pushed earlier */
+    mres_t take_pushed(msg_t &resp);
+    msg_t invalidate_adapter(const msg_t &in);
   };
 
   template <typename T>
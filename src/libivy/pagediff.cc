@@ -0,0 +1,251 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   pagediff.cc
+ * @date   Oct 16, 2026
+ * @brief  Diff encoding for pages a node has held before
+ */
+
+#include "error.hh"
+#include "../common.hh"
+#include "pagediff.hh"
+
+#include <algorithm>
+
+using namespace libivy;
+
+/* Longest run a 16 bit count can describe */
+static constexpr size_t RUN_MAX = UINT16_MAX;
+
+static inline void put_u16(string &out, size_t val) {
+  out.push_back(static_cast<char>(val & 0xff));
+  out.push_back(static_cast<char>((val >> 8) & 0xff));
+}
+
+static inline size_t get_u16(const string &in, size_t off) {
+  return static_cast<uint8_t>(in[off])
+    | (static_cast<uint8_t>(in[off + 1]) << 8);
+}
+
+/** @brief Bytes starting at \p off that are the same in both */
+static size_t same_run(const char *a, const char *b, size_t off,
+		       size_t len) {
+  size_t end = off;
+
+  /* Compare a word at a time, most of a re-fetched page is unchanged */
+  while (end + sizeof(uint64_t) <= len) {
+    uint64_t wa, wb;
+    std::memcpy(&wa, a + end, sizeof(wa));
+    std::memcpy(&wb, b + end, sizeof(wb));
+
+    if (wa != wb) break;
+    end += sizeof(uint64_t);
+  }
+
+  while (end < len && a[end] == b[end])
+    end++;
+
+  return end - off;
+}
+
+/** @brief Byte sent for a changed byte, either XORed or as is */
+static inline char run_byte(const char *base, const char *cur, size_t i,
+			    bool xor_bytes) {
+  return xor_bytes ? base[i] ^ cur[i] : cur[i];
+}
+
+/** @brief Runs covering all \p len bytes, as long as they can be */
+static string whole_run(const char *base, const char *cur, size_t len,
+			bool xor_bytes) {
+  string out;
+
+  for (size_t off = 0; off < len; off += RUN_MAX) {
+    size_t cnt = std::min(len - off, RUN_MAX);
+
+    put_u16(out, 0);
+    put_u16(out, cnt);
+
+    for (size_t i = off; i < off + cnt; i++)
+      out.push_back(run_byte(base, cur, i, xor_bytes));
+  }
+
+  return out;
+}
+
+static string encode_runs(const char *base, const char *cur, size_t len,
+			  bool always, bool xor_bytes) {
+  string out;
+  size_t off = 0;
+
+  while (off < len) {
+    size_t skip = std::min(same_run(base, cur, off, len), RUN_MAX);
+
+    /* A short run of equal bytes costs less to send than to skip */
+    size_t diff_end = off + skip;
+    while (diff_end < len && diff_end - off - skip < RUN_MAX) {
+      if (base[diff_end] == cur[diff_end]
+	  && same_run(base, cur, diff_end, len) > 4)
+	break;
+      diff_end++;
+    }
+
+    size_t cnt = diff_end - off - skip;
+
+    /* Trailing unchanged bytes need no run */
+    if (cnt == 0 && off + skip == len)
+      break;
+
+    put_u16(out, skip);
+    put_u16(out, cnt);
+
+    for (size_t i = off + skip; i < diff_end; i++)
+      out.push_back(run_byte(base, cur, i, xor_bytes));
+
+    if (out.size() >= len)
+      return always ? whole_run(base, cur, len, xor_bytes) : "";
+
+    off = diff_end;
+  }
+
+  /* An unchanged page still needs a non-empty diff */
+  if (out.empty()) {
+    put_u16(out, 0);
+    put_u16(out, 0);
+  }
+
+  return out;
+}
+
+string libivy::encode_diff(const char *base, const char *cur, size_t len,
+			   bool always) {
+  return encode_runs(base, cur, len, always, true);
+}
+
+string libivy::encode_update(const char *base, const char *cur, size_t len) {
+  return encode_runs(base, cur, len, true, false);
+}
+
+static mres_t apply_runs(char *page, const string &diff, size_t len,
+			 bool xor_bytes) {
+  size_t off = 0, pos = 0;
+
+  while (pos < diff.size()) {
+    if (pos + 4 > diff.size())
+      return {"Truncated diff"};
+
+    size_t skip = get_u16(diff, pos);
+    size_t cnt = get_u16(diff, pos + 2);
+    pos += 4;
+
+    off += skip;
+    if (off + cnt > len || pos + cnt > diff.size())
+      return {"Diff runs past the end of the page"};
+
+    for (size_t i = 0; i < cnt; i++) {
+      if (xor_bytes)
+	page[off + i] ^= diff[pos + i];
+      else
+	page[off + i] = diff[pos + i];
+    }
+
+    off += cnt;
+    pos += cnt;
+  }
+
+  return {};
+}
+
+mres_t libivy::apply_diff(char *page, const string &diff, size_t len) {
+  return apply_runs(page, diff, len, true);
+}
+
+mres_t libivy::apply_update(char *page, const string &upd, size_t len) {
+  return apply_runs(page, upd, len, false);
+}
+
+void PageDiffCache::set_live(uint64_t addr, uint64_t version) {
+  ivyguard(this->lock);
+
+  auto &ent = this->pages[addr];
+  ent.live = true;
+  ent.live_ver = version;
+}
+
+uint64_t PageDiffCache::live_version(uint64_t addr) {
+  ivyguard(this->lock);
+
+  auto it = this->pages.find(addr);
+  return it == this->pages.end() ? 0 : it->second.live_ver;
+}
+
+void PageDiffCache::save(uint64_t addr, uint64_t version,
+			 const char *page) {
+  ivyguard(this->lock);
+
+  auto &ent = this->pages[addr];
+  ent.saved = true;
+  ent.saved_ver = version;
+  ent.data.assign(page, this->pg_sz);
+}
+
+void PageDiffCache::save_live(uint64_t addr, const char *page) {
+  ivyguard(this->lock);
+
+  /* Nothing mapped or already saved by an earlier invalidation */
+  auto &ent = this->pages[addr];
+  if (!ent.live)
+    return;
+
+  ent.live = false;
+  ent.saved = true;
+  ent.saved_ver = ent.live_ver;
+  ent.data.assign(page, this->pg_sz);
+}
+
+optional<uint64_t> PageDiffCache::saved_version(uint64_t addr) {
+  ivyguard(this->lock);
+
+  auto it = this->pages.find(addr);
+  if (it == this->pages.end() || !it->second.saved)
+    return {};
+
+  return it->second.saved_ver;
+}
+
+optional<string> PageDiffCache::diff_from(uint64_t addr, uint64_t version,
+					  const char *cur) {
+  ivyguard(this->lock);
+
+  auto it = this->pages.find(addr);
+  if (it == this->pages.end() || !it->second.saved
+      || it->second.saved_ver != version)
+    return {};
+
+  auto diff = encode_diff(it->second.data.data(), cur, this->pg_sz);
+  if (diff.empty())
+    return {};
+
+  return diff;
+}
+
+res_t<string> PageDiffCache::patch(uint64_t addr, uint64_t version,
+				   const string &diff) {
+  ivyguard(this->lock);
+
+  auto it = this->pages.find(addr);
+  if (it == this->pages.end() || !it->second.saved
+      || it->second.saved_ver != version)
+    return {"", "No saved copy of version " + std::to_string(version)};
+
+  /* The saved copy is only good as a base once, the page is live
+     again after this */
+  auto page = std::move(it->second.data);
+  it->second.saved = false;
+  it->second.data.clear();
+
+  auto err = apply_diff(page.data(), diff, this->pg_sz);
+  if (err.has_value())
+    return {"", err};
+
+  return {page, {}};
+}
@@ -0,0 +1,101 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   pagediff.hh
+ * @date   Oct 16, 2026
+ * @brief  Diff encoding for pages a node has held before
+ */
+
+#ifndef IVY_HEADER_LIBIVY_PAGEDIFF_H__
+#define IVY_HEADER_LIBIVY_PAGEDIFF_H__
+
+#include "common.hh"
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace libivy {
+  using std::string;
+
+  /**
+   * @brief Encode \p cur relative to \p base.
+   *
+   * The diff is a sequence of runs, each a 16 bit count of unchanged
+   * bytes to skip, a 16 bit count of changed bytes and then the
+   * changed bytes XORed with the base. Returns an empty string if the
+   * diff wouldn't be smaller than the page itself, unless \p always
+   * is set, then it falls back to a single run over the whole page.
+   *
+   * Bytes that are the same in both XOR to zero, so diffs from
+   * writers of disjoint bytes can be applied to one copy in any order.
+   */
+  string encode_diff(const char *base, const char *cur, size_t len,
+		     bool always = false);
+
+  /** @brief Apply a diff from \ref encode_diff to \p page in place */
+  mres_t apply_diff(char *page, const string &diff, size_t len);
+
+  /**
+   * @brief Like \ref encode_diff but the runs carry the new bytes
+   * instead of the XOR, so they apply to a copy that doesn't match
+   * \p base. Never empty.
+   */
+  string encode_update(const char *base, const char *cur, size_t len);
+
+  /** @brief Write the bytes of \ref encode_update into \p page */
+  mres_t apply_update(char *page, const string &upd, size_t len);
+
+  /**
+   * @brief Tracks the version of every page mapped on this node and
+   * keeps a copy of the last version held of pages that were taken
+   * away, to be used as the base of a diff later on.
+   *
+   * Versions are handed out by the manager, one per write grant. Once
+   * the writer loses write access the contents of that version never
+   * change, so two nodes holding the same version hold the same bytes.
+   */
+  class PageDiffCache {
+  public:
+    PageDiffCache(size_t pg_sz) : pg_sz(pg_sz) {}
+
+    /** @brief Record the version of the copy now mapped at \p addr */
+    void set_live(uint64_t addr, uint64_t version);
+
+    /** @brief Version of the mapped copy, 0 if never fetched */
+    uint64_t live_version(uint64_t addr);
+
+    /** @brief Keep \p page as the copy of \p version */
+    void save(uint64_t addr, uint64_t version, const char *page);
+
+    /** @brief Save the mapped copy at \p addr before it goes away */
+    void save_live(uint64_t addr, const char *page);
+
+    /** @brief Version of the saved copy, if there is one */
+    optional<uint64_t> saved_version(uint64_t addr);
+
+    /** @brief Diff \p cur against the saved copy of \p version */
+    optional<string> diff_from(uint64_t addr, uint64_t version,
+			       const char *cur);
+
+    /** @brief Rebuild the page from the saved copy and a diff */
+    res_t<string> patch(uint64_t addr, uint64_t version,
+			const string &diff);
+
+  private:
+    struct entry_t {
+      bool live = false;
+      uint64_t live_ver = 0;
+      bool saved = false;
+      uint64_t saved_ver = 0;
+      string data;
+    };
+
+    size_t pg_sz;
+    std::mutex lock;
+    std::map<uint64_t, entry_t> pages;
+  };
+} // namespace libivy
+
+#endif // IVY_HEADER_LIBIVY_PAGEDIFF_H__
@@ -0,0 +1,210 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   pagelock.hh
+ * @date   Oct 16, 2026
+ * @brief  Recursive FIFO lock for pages, waiters sleep on a futex
+ */
+
+#ifndef IVY_HEADER_LIBIVY_PAGELOCK_H__
+#define IVY_HEADER_LIBIVY_PAGELOCK_H__
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace libivy {
+  /**
+   * @brief Ticket lock handed to waiters in the order they arrived.
+   * Waiters sleep in the kernel until the holder hands the lock on,
+   * so a contended page costs a wakeup rather than a polling period.
+   * Each waiter sleeps on the bit of its ticket, so handing the lock
+   * on wakes the next waiter only, not everyone queued behind it.
+   * The holding thread may take it again, it is free once every
+   * lock() is matched by an unlock().
+   *
+   * A holder waiting on another node can lend() the lock out. Handlers
+   * serving other nodes take it with borrow(), which also gets in while
+   * it is lent, one borrower at a time. The holder reclaim()s it before
+   * touching the page again and waits for the borrower to give it back.
+   */
+  class PageLock {
+  public:
+    bool try_lock() {
+      if (this->owner.load(std::memory_order_relaxed) == self()) {
+	this->depth++;
+	return true;
+      }
+
+      /* Free only if nobody holds a ticket */
+      auto cur = this->tickets.load();
+      if (next_of(cur) != serving_of(cur)
+	  || !this->tickets.compare_exchange_strong(cur, cur + NEXT_ONE))
+	return false;
+
+      this->take();
+      return true;
+    }
+
+    void lock() {
+      if (this->owner.load(std::memory_order_relaxed) == self()) {
+	this->depth++;
+	return;
+      }
+
+      uint16_t ticket = next_of(this->tickets.fetch_add(NEXT_ONE));
+
+      while (true) {
+	auto cur = this->tickets.load();
+	if (serving_of(cur) == ticket)
+	  break;
+
+	futex(&this->tickets, FUTEX_WAIT_BITSET_PRIVATE, cur,
+	      ticket_bit(ticket));
+      }
+
+      this->take();
+    }
+
+    void unlock() {
+      if (--this->depth != 0)
+	return;
+
+      this->owner.store(0, std::memory_order_relaxed);
+
+      /* Serving wraps on its own, it must not carry into next */
+      auto cur = this->tickets.load();
+      uint32_t upd;
+      do {
+	upd = (cur & NEXT_MASK) | ((cur + 1) & SERVING_MASK);
+      } while (!this->tickets.compare_exchange_weak(cur, upd));
+
+      /* Only tickets sharing the bit of the next one wake up, that is
+	 the next waiter unless 32 or more are queued */
+      if (next_of(upd) != serving_of(upd))
+	futex(&this->tickets, FUTEX_WAKE_BITSET_PRIVATE, INT_MAX,
+	      ticket_bit(serving_of(upd)));
+
+      if (this->lending.load() & WATCHED)
+	this->wake_borrowers();
+    }
+
+    /** @brief Let a borrower in while this thread waits elsewhere */
+    void lend() {
+      if (this->lending.fetch_or(LENT) & WATCHED)
+	futex(&this->lending, FUTEX_WAKE_PRIVATE, INT_MAX);
+    }
+
+    /** @brief Stop lending, returns once the borrower is done */
+    void reclaim() {
+      auto cur = this->lending.fetch_and(~LENT) & ~LENT;
+
+      while (cur & BORROWED) {
+	futex(&this->lending, FUTEX_WAIT_PRIVATE, cur);
+	cur = this->lending.load();
+      }
+    }
+
+    /**
+     * @brief Wait until this thread holds the lock or borrowed it from
+     * a holder that lent it, true if borrowed. Release it with
+     * give_back(), or unlock() if it wasn't borrowed.
+     */
+    bool borrow() {
+      while (true) {
+	if (this->try_lock())
+	  return false;
+
+	auto cur = this->lending.load();
+	if ((cur & LENT) && !(cur & BORROWED)) {
+	  if (this->lending.compare_exchange_strong(cur, cur | BORROWED))
+	    return true;
+	  continue;
+	}
+
+	if (!(cur & WATCHED)) {
+	  if (!this->lending.compare_exchange_strong(cur, cur | WATCHED))
+	    continue;
+	  cur |= WATCHED;
+	}
+
+	/* The holder may have let go before it saw the flag */
+	if (this->try_lock())
+	  return false;
+
+	futex(&this->lending, FUTEX_WAIT_PRIVATE, cur);
+      }
+    }
+
+    void give_back() {
+      auto cur = this->lending.fetch_and(~BORROWED);
+
+      /* The holder reclaiming it, or another borrower, is waiting */
+      if (!(cur & LENT) || (cur & WATCHED))
+	this->wake_borrowers();
+    }
+
+  private:
+    /* Next ticket to hand out in the high half, the one holding the
+       lock in the low half */
+    static constexpr uint32_t NEXT_ONE = 1u << 16;
+    static constexpr uint32_t NEXT_MASK = 0xffff0000u;
+    static constexpr uint32_t SERVING_MASK = 0x0000ffffu;
+
+    /* Lending state, the low bits count changes so waiters notice */
+    static constexpr uint32_t LENT = 1u << 31;
+    static constexpr uint32_t WATCHED = 1u << 30;  /* Borrowers asleep */
+    static constexpr uint32_t BORROWED = 1u << 29;
+    static constexpr uint32_t FLAGS = LENT | WATCHED | BORROWED;
+
+    std::atomic<uint32_t> tickets{0};
+    std::atomic<uint32_t> owner{0};   /* Holding thread, see self() */
+    uint32_t depth = 0;               /* Times the owner locked it */
+    std::atomic<uint32_t> lending{0};
+
+    /**
+     * @brief Tells threads apart without a syscall. A number rather than
+     * a pointer keeps the lock at 16 bytes, two of them and a block's
+     * state share a cache line in the page table.
+     */
+    static uint32_t self() {
+      static std::atomic<uint32_t> last{0};
+      static thread_local uint32_t tag = ++last;
+      return tag;
+    }
+
+    static uint16_t next_of(uint32_t tickets) { return tickets >> 16; }
+    static uint16_t serving_of(uint32_t tickets) { return tickets; }
+
+    void take() {
+      this->owner.store(self(), std::memory_order_relaxed);
+      this->depth = 1;
+    }
+
+    /** @brief Change the lending word and wake everyone sleeping on it */
+    void wake_borrowers() {
+      auto cur = this->lending.load();
+      uint32_t upd;
+      do {
+	upd = (cur & FLAGS & ~WATCHED) | ((cur + 1) & ~FLAGS);
+      } while (!this->lending.compare_exchange_weak(cur, upd));
+
+      futex(&this->lending, FUTEX_WAKE_PRIVATE, INT_MAX);
+    }
+
+    static uint32_t ticket_bit(uint16_t ticket) {
+      return 1u << (ticket % 32);
+    }
+
+    static void futex(std::atomic<uint32_t> *word, int op, uint32_t val,
+		      uint32_t bitset = FUTEX_BITSET_MATCH_ANY) {
+      syscall(SYS_futex, word, op, val, nullptr, nullptr, bitset);
+    }
+  };
+} // namespace libivy
+
+#endif // IVY_HEADER_LIBIVY_PAGELOCK_H__
@@ -0,0 +1,74 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   pinwindow.hh
+ * @date   Oct 16, 2026
+ * @brief  Minimum time a writer keeps a page before it is taken away
+ */
+
+#ifndef IVY_HEADER_LIBIVY_PINWINDOW_H__
+#define IVY_HEADER_LIBIVY_PINWINDOW_H__
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+namespace libivy {
+  /** @brief Monotonic time in ns */
+  static inline uint64_t pin_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+	     std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  /**
+   * @brief Decides how long a request for a page waits so its writer
+   * gets to keep it for a while (Mirage's Δ).
+   *
+   * Every page has its own window, starting at the configured minimum.
+   * A request that arrives while the writer is still inside its window
+   * means the page is thrashing, it waits out the rest and the window
+   * doubles, up to the maximum. A request that comes long after it
+   * halves the window back towards the minimum.
+   */
+  class PinPolicy {
+  public:
+    void configure(uint64_t min_ns, uint64_t max_ns) {
+      this->min_ns = min_ns;
+      this->max_ns = std::max(min_ns, max_ns);
+    }
+
+    bool enabled() const { return this->min_ns != 0; }
+
+    /**
+     * @brief Delay for a request at \p now_ns for a page written since
+     * \p granted_ns (0 if nobody holds it writable), adapts \p window_ns
+     */
+    uint64_t delay_ns(uint64_t &window_ns, uint64_t granted_ns,
+		      uint64_t now_ns) const {
+      if (!this->enabled() || granted_ns == 0)
+	return 0;
+
+      if (window_ns == 0)
+	window_ns = this->min_ns;
+
+      uint64_t age = now_ns - granted_ns;
+
+      if (age < window_ns) {
+	uint64_t delay = window_ns - age;
+	window_ns = std::min(window_ns * 2, this->max_ns);
+	return delay;
+      }
+
+      if (age > 4 * window_ns)
+	window_ns = std::max(window_ns / 2, this->min_ns);
+
+      return 0;
+    }
+
+  private:
+    uint64_t min_ns = 0;
+    uint64_t max_ns = 0;
+  };
+} // namespace libivy
+
+#endif // IVY_HEADER_LIBIVY_PINWINDOW_H__
@@ -0,0 +1,180 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   relcons.cc
+ * @date   Oct 16, 2026
+ * @brief  Twins and home copies for the release consistency mode
+ */
+
+#include "error.hh"
+#include "../common.hh"
+#include "pagediff.hh"
+#include "relcons.hh"
+
+using namespace libivy;
+
+string libivy::pack_addrs(const vector<uint64_t> &addrs) {
+  string out(addrs.size() * sizeof(uint64_t), '\0');
+  std::memcpy(out.data(), addrs.data(), out.size());
+
+  return out;
+}
+
+vector<uint64_t> libivy::unpack_addrs(const string &payload) {
+  vector<uint64_t> addrs(payload.size() / sizeof(uint64_t));
+  std::memcpy(addrs.data(), payload.data(),
+	      addrs.size() * sizeof(uint64_t));
+
+  return addrs;
+}
+
+void TwinTable::set_cached(uint64_t addr) {
+  ivyguard(this->lock);
+
+  this->cached.insert(addr);
+}
+
+bool TwinTable::is_cached(uint64_t addr) {
+  ivyguard(this->lock);
+
+  return this->cached.count(addr) != 0;
+}
+
+bool TwinTable::make_twin(uint64_t addr, const char *page) {
+  ivyguard(this->lock);
+
+  return this->twins.try_emplace(addr, page, this->pg_sz).second;
+}
+
+string TwinTable::take_diff(uint64_t addr, const char *page) {
+  ivyguard(this->lock);
+
+  auto it = this->twins.find(addr);
+  if (it == this->twins.end())
+    return "";
+
+  /* Always a diff, even if the whole page changed, the home may have
+     merged other writers' bytes that a full page would overwrite */
+  auto diff = encode_diff(it->second.data(), page, this->pg_sz, true);
+  this->twins.erase(it);
+
+  return diff;
+}
+
+vector<uint64_t> TwinTable::dirty() {
+  ivyguard(this->lock);
+
+  vector<uint64_t> result;
+  for (auto &[addr, twin] : this->twins)
+    result.push_back(addr);
+
+  return result;
+}
+
+bool TwinTable::drop_clean(uint64_t addr) {
+  ivyguard(this->lock);
+
+  if (this->twins.count(addr) != 0)
+    return false;
+
+  return this->cached.erase(addr) != 0;
+}
+
+vector<uint64_t> TwinTable::take_clean() {
+  ivyguard(this->lock);
+
+  vector<uint64_t> result;
+  for (auto it = this->cached.begin(); it != this->cached.end();) {
+    if (this->twins.count(*it) != 0) {
+      ++it;
+      continue;
+    }
+
+    result.push_back(*it);
+    it = this->cached.erase(it);
+  }
+
+  return result;
+}
+
+string HomeCopies::read(uint64_t addr) {
+  ivyguard(this->lock);
+
+  auto it = this->pages.find(addr);
+  if (it == this->pages.end())
+    return string(this->pg_sz, '\0');
+
+  return it->second;
+}
+
+mres_t HomeCopies::merge(uint64_t addr, const string &diff) {
+  ivyguard(this->lock);
+
+  auto [it, fresh] = this->pages.try_emplace(addr);
+  if (fresh)
+    it->second.assign(this->pg_sz, '\0');
+
+  return apply_diff(it->second.data(), diff, this->pg_sz);
+}
+
+vector<uint64_t> LockTable::notices_since(const lock_t &lk, uint64_t seen) {
+  vector<uint64_t> pages;
+  for (auto &[addr, seq] : lk.notices)
+    if (seq > seen)
+      pages.push_back(addr);
+
+  return pages;
+}
+
+void LockTable::acquire(uint64_t lock, uint64_t seen, grant_f grant) {
+  vector<uint64_t> pages;
+  uint64_t seq;
+
+  {
+    ivyguard(this->mtx);
+
+    auto &lk = this->locks[lock];
+    if (lk.held) {
+      lk.waiters.push_back({seen, std::move(grant)});
+      return;
+    }
+
+    lk.held = true;
+    pages = notices_since(lk, seen);
+    seq = lk.seq;
+  }
+
+  grant(std::move(pages), seq);
+}
+
+void LockTable::release(uint64_t lock, const vector<uint64_t> &pages) {
+  waiter_t next;
+  vector<uint64_t> notices;
+  uint64_t seq;
+
+  {
+    ivyguard(this->mtx);
+
+    auto &lk = this->locks[lock];
+    lk.seq++;
+
+    /* Only the latest write of a page matters to an acquirer */
+    for (auto addr : pages)
+      lk.notices[addr] = lk.seq;
+
+    if (lk.waiters.empty()) {
+      lk.held = false;
+      return;
+    }
+
+    /* Handed straight to the next waiter, it never looks free */
+    next = std::move(lk.waiters.front());
+    lk.waiters.pop_front();
+
+    notices = notices_since(lk, next.seen);
+    seq = lk.seq;
+  }
+
+  /* Replies go out on the network, not under the table's lock */
+  next.grant(std::move(notices), seq);
+}
@@ -0,0 +1,147 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   relcons.hh
+ * @date   Oct 16, 2026
+ * @brief  Twins and home copies for the release consistency mode
+ */
+
+#ifndef IVY_HEADER_LIBIVY_RELCONS_H__
+#define IVY_HEADER_LIBIVY_RELCONS_H__
+
+#include "common.hh"
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace libivy {
+  using std::string;
+  using std::vector;
+
+  /** @brief Memory model the shared region follows */
+  enum IvyConsistency {
+    CONS_SEQUENTIAL, /* Single writer, invalidate on every write fault */
+    CONS_RELEASE,    /* Multiple writers, diffs merged on release */
+    CONS_LAZY,       /* As above, acquiring a lock only drops the pages
+			written under it (home-based lazy release) */
+  };
+
+  /** @brief Page addresses as a payload, 64 bits each */
+  string pack_addrs(const vector<uint64_t> &addrs);
+
+  /** @brief Undo \ref pack_addrs */
+  vector<uint64_t> unpack_addrs(const string &payload);
+
+  /**
+   * @brief Pages this node holds in release consistency mode.
+   *
+   * A page is cached once it was fetched from its home. The first
+   * write to a cached page makes a twin, a copy of the page as it was
+   * before, and on release the twin is diffed against the page to
+   * find the bytes this node wrote.
+   */
+  class TwinTable {
+  public:
+    TwinTable(size_t pg_sz) : pg_sz(pg_sz) {}
+
+    /** @brief Remember that \p addr holds a copy from its home */
+    void set_cached(uint64_t addr);
+
+    /** @brief Check if \p addr holds a copy from its home */
+    bool is_cached(uint64_t addr);
+
+    /** @brief Twin \p page unless it has one already, true if made */
+    bool make_twin(uint64_t addr, const char *page);
+
+    /**
+     * @brief Diff \p page against its twin and drop the twin, the
+     * page is clean again after this. Empty if it has no twin.
+     */
+    string take_diff(uint64_t addr, const char *page);
+
+    /** @brief Pages with a twin */
+    vector<uint64_t> dirty();
+
+    /** @brief Forget \p addr if it is cached without a twin */
+    bool drop_clean(uint64_t addr);
+
+    /** @brief Forget and return the cached pages without a twin */
+    vector<uint64_t> take_clean();
+
+  private:
+    size_t pg_sz;
+    std::mutex lock;
+    std::set<uint64_t> cached;
+    std::map<uint64_t, string> twins;
+  };
+
+  /**
+   * @brief Master copies of the pages this node is the home of. The
+   * diffs of every writer are merged in here, pages nobody wrote yet
+   * are zero like the rest of the region.
+   */
+  class HomeCopies {
+  public:
+    HomeCopies(size_t pg_sz) : pg_sz(pg_sz) {}
+
+    /** @brief Current contents of the home copy */
+    string read(uint64_t addr);
+
+    /** @brief Merge a diff from \ref TwinTable::take_diff */
+    mres_t merge(uint64_t addr, const string &diff);
+
+  private:
+    size_t pg_sz;
+    std::mutex lock;
+    std::map<uint64_t, string> pages;
+  };
+  /**
+   * @brief Locks this node hands out, along with the write notices of
+   * each: the pages written by holders of the lock. A notice carries
+   * the lock's sequence number of the release that sent it, so an
+   * acquirer only gets the notices it hasn't seen.
+   */
+  class LockTable {
+  public:
+    /** @brief Receives the notices and sequence number of a grant */
+    using grant_f = std::function<void(vector<uint64_t>, uint64_t)>;
+
+    /**
+     * @brief Take \p lock, \p grant gets the pages written under it
+     * since sequence number \p seen and the sequence number to pass
+     * next time. Runs \p grant before returning if the lock is free,
+     * otherwise from the \ref release that hands it over.
+     */
+    void acquire(uint64_t lock, uint64_t seen, grant_f grant);
+
+    /** @brief Free \p lock, \p pages were written while it was held */
+    void release(uint64_t lock, const vector<uint64_t> &pages);
+
+  private:
+    struct waiter_t {
+      uint64_t seen;
+      grant_f grant;
+    };
+
+    struct lock_t {
+      bool held = false;
+      uint64_t seq = 0;
+      std::map<uint64_t, uint64_t> notices; /* Page -> seq written at */
+      std::deque<waiter_t> waiters;         /* In the order they came */
+    };
+
+    /** @brief Notices of \p lk newer than \p seen */
+    static vector<uint64_t> notices_since(const lock_t &lk, uint64_t seen);
+
+    std::mutex mtx;
+    std::map<uint64_t, lock_t> locks;
+  };
+} // namespace libivy
+
+#endif // IVY_HEADER_LIBIVY_RELCONS_H__
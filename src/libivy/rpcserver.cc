@@ -6,18 +6,30 @@
  * @brief  Brief description here
  */
 
+#include "backoff.hh"
 #include "error.hh"
 #include "../common.hh"
 #include "rpcserver.hh"
 
 #include <future>
+#include <sstream>
 #include <thread>
+#include <utility>
+
+#include <ifaddrs.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 using namespace libivy;
 
 pair<string, size_t> parse_addr(string addr) {
   string hostname_str, port_str;
-  
+
   hostname_str = addr.substr(0, addr.find(":"));
   port_str = addr.substr(addr.find(":")+1, addr.length()-1);
 
@@ -27,7 +39,7 @@ pair<string, size_t> parse_addr(string addr) {
 
   if (hostname_str.empty())
     IVY_ERROR("Unable to parse hostname");
-  
+
   if (port_str.empty())
     IVY_ERROR("Unable to parse port");
 
@@ -37,7 +49,7 @@ pair<string, size_t> parse_addr(string addr) {
   }
 
   DBGH << "Returning " << port_num << std::endl;
-  
+
   return {hostname_str, port_num};
 }
 
@@ -45,15 +57,188 @@ string ping(string buf) {
   return "pong";
 }
 
-RpcServer::RpcServer(vector<string> nodes, size_t myId)
-  : nodes(nodes), myId(myId) {
-  
+/** @brief Write the header and the payload of a message in one go */
+static mres_t send_frame(int fd, const msg_t &msg) {
+  msg_hdr_t hdr = msg.hdr;
+  hdr.len = static_cast<uint32_t>(msg.payload.size());
+
+  struct iovec iov[2] = {
+    {&hdr, sizeof(hdr)},
+    {const_cast<char*>(msg.payload.data()), msg.payload.size()},
+  };
+
+  struct msghdr mh {};
+  mh.msg_iov = iov;
+  mh.msg_iovlen = msg.payload.empty() ? 1 : 2;
+
+  size_t left = sizeof(hdr) + msg.payload.size();
+  while (left > 0) {
+    auto sent = sendmsg(fd, &mh, MSG_NOSIGNAL);
+
+    if (sent == -1) {
+      if (errno == EINTR) continue;
+      return {"sendmsg failed: " + PSTR()};
+    }
+
+    left -= sent;
+
+    /* Skip over whatever made it out on a partial write */
+    while (sent > 0 && mh.msg_iovlen > 0) {
+      if ((size_t)sent >= mh.msg_iov[0].iov_len) {
+	sent -= mh.msg_iov[0].iov_len;
+	mh.msg_iov++;
+	mh.msg_iovlen--;
+      } else {
+	mh.msg_iov[0].iov_base = (char*)mh.msg_iov[0].iov_base + sent;
+	mh.msg_iov[0].iov_len -= sent;
+	sent = 0;
+      }
+    }
+  }
+
+  return {};
+}
+
+static mres_t read_all(int fd, void *buf, size_t len) {
+  auto cur = reinterpret_cast<char*>(buf);
+
+  while (len > 0) {
+    auto got = read(fd, cur, len);
+
+    if (got == 0) return {"Connection closed"};
+    if (got == -1) {
+      if (errno == EINTR) continue;
+      return {"read failed: " + PSTR()};
+    }
+
+    cur += got;
+    len -= got;
+  }
+
+  return {};
+}
+
+static res_t<msg_t> recv_frame(int fd, uint32_t max_len) {
+  msg_t msg{};
+
+  auto err = read_all(fd, &msg.hdr, sizeof(msg.hdr));
+  if (err.has_value()) return {msg, err};
+
+  if (msg.hdr.len > max_len)
+    return {msg, "Frame of " + std::to_string(msg.hdr.len) + " bytes"};
+
+  msg.payload.resize(msg.hdr.len);
+  err = read_all(fd, msg.payload.data(), msg.hdr.len);
+
+  return {msg, err};
+}
+
+static void set_nodelay(int fd) {
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/**
+ * @brief Id shared by every node of a cluster, an FNV-1a hash of the
+ * node list. Two clusters on one host get different Unix socket names
+ * even if they reuse a port.
+ */
+static uint64_t cluster_hash(const vector<string> &nodes) {
+  uint64_t hash = 14695981039346656037ull;
+
+  for (const auto &node : nodes) {
+    for (unsigned char c : node + '\0') {
+      hash ^= c;
+      hash *= 1099511628211ull;
+    }
+  }
+
+  return hash;
+}
+
+/**
+ * @brief Address of the Unix socket a node listens on. Lives in the
+ * abstract namespace so there is no file to clean up. The cluster id
+ * and the full bind address keep nodes of different clusters, or
+ * bound to different addresses with the same port, apart.
+ */
+static socklen_t uds_addr(uint64_t cluster, const string &host,
+			  uint16_t port, struct sockaddr_un &sun) {
+  std::memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+
+  std::ostringstream name;
+  name << "ivy-" << std::hex << cluster << "-" << host << ":"
+       << std::dec << port;
+
+  /* Leading NUL marks the abstract namespace, the rest must fit */
+  auto str = name.str().substr(0, sizeof(sun.sun_path) - 1);
+  std::memcpy(sun.sun_path + 1, str.data(), str.size());
+
+  return offsetof(struct sockaddr_un, sun_path) + 1 + str.size();
+}
+
+static bool same_ip(const struct sockaddr *a, const struct sockaddr *b) {
+  if (a->sa_family != b->sa_family) return false;
+
+  if (a->sa_family == AF_INET) {
+    auto a4 = reinterpret_cast<const struct sockaddr_in*>(a);
+    auto b4 = reinterpret_cast<const struct sockaddr_in*>(b);
+    return a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+  } else if (a->sa_family == AF_INET6) {
+    auto a6 = reinterpret_cast<const struct sockaddr_in6*>(a);
+    auto b6 = reinterpret_cast<const struct sockaddr_in6*>(b);
+    return std::memcmp(&a6->sin6_addr, &b6->sin6_addr,
+		       sizeof(a6->sin6_addr)) == 0;
+  }
+
+  return false;
+}
+
+/** @brief Check if a hostname resolves to an address of this machine */
+static bool is_local_host(const string &host) {
+  struct addrinfo hints {}, *res = nullptr;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  if (getaddrinfo(host.c_str(), nullptr, &hints, &res) != 0)
+    return false;
+
+  struct ifaddrs *ifs = nullptr;
+  if (getifaddrs(&ifs) != 0)
+    ifs = nullptr;
+
+  bool local = false;
+  for (auto cur = res; cur != nullptr && !local; cur = cur->ai_next) {
+    if (cur->ai_family == AF_INET) {
+      auto a4 = reinterpret_cast<struct sockaddr_in*>(cur->ai_addr);
+      local = (ntohl(a4->sin_addr.s_addr) >> 24) == 127;
+    } else if (cur->ai_family == AF_INET6) {
+      auto a6 = reinterpret_cast<struct sockaddr_in6*>(cur->ai_addr);
+      local = IN6_IS_ADDR_LOOPBACK(&a6->sin6_addr);
+    }
+
+    for (auto ifa = ifs; ifa != nullptr && !local; ifa = ifa->ifa_next) {
+      if (ifa->ifa_addr != nullptr)
+	local = same_ip(cur->ai_addr, ifa->ifa_addr);
+    }
+  }
+
+  if (ifs != nullptr) freeifaddrs(ifs);
+  freeaddrinfo(res);
+
+  return local;
+}
+
+RpcServer::RpcServer(vector<string> nodes, size_t myId, rpc_cfg_t cfg)
+  : cfg(cfg), nodes(nodes), myId(myId) {
+
   IVY_ASSERT(myId < nodes.size(), "myID greater than number of nodes");
 
   string addr = nodes[myId];
-  
+
   DBGH << "Trying to translate " << addr << std::endl;
-  
+
   this->hostname = addr.substr(0, addr.find(":"));
   string port_str = addr.substr(addr.find(":")+1, addr.length()-1);
 
@@ -63,7 +248,7 @@ RpcServer::RpcServer(vector<string> nodes, size_t myId)
 
   if (hostname.empty())
     IVY_ERROR("Unable to parse hostname");
-  
+
   if (port_str.empty())
     IVY_ERROR("Unable to parse port");
 
@@ -73,20 +258,30 @@ RpcServer::RpcServer(vector<string> nodes, size_t myId)
   }
 
   this->port = port_num;
+  this->cluster_id = cluster_hash(this->nodes);
 
-  this->server = std::make_unique<httplib::Server>();
+  auto cores = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t shard = 0; shard < this->cfg.mngr_shards; shard++)
+    this->shards.push_back(std::make_unique<PinnedWorker>(shard % cores));
 
-  size_t client_iter = 0;
   for (string client_name : this->nodes) {
     DBGH << "Creating client " << client_name << std::endl;
 
-    auto c = std::make_unique<httplib::Client>(client_name.c_str());
-    this->clients.push_back(std::move(c));
-	
-    client_iter++;
+    this->peers.push_back(std::make_unique<peer_t>());
+
+    auto host = client_name.substr(0, client_name.find(":"));
+    bool local = this->cfg.same_host_uds && is_local_host(host);
+    this->same_host.push_back(local);
+
+    DBGH << client_name << " is "
+	 << (local ? "on this host, using a Unix socket" : "remote")
+	 << std::endl;
   }
-  
-  this->recv_funcs.push_back(std::make_pair("ping", ping));
+
+  this->recv_funcs["ping"] = ping;
+
+  this->msg_funcs[OP_CALL]
+    = [this](const msg_t &in) { return this->call_adapter(in); };
 
   DBGH << "Created an RPCServer at " << (void*)this << std::endl;
 }
@@ -94,42 +289,523 @@ RpcServer::RpcServer(vector<string> nodes, size_t myId)
 mres_t RpcServer::start_recv() {
   DBGH << "Starting RPC server for " << this->hostname
        << ":" << this->port << std::endl;
-  
-  for (auto &recv_fun : this->recv_funcs) {
-    DBGH << "Registering function " << recv_fun.first << std::endl;
-    
-    auto fun = [&](const auto &req, auto &res) {
-      auto arg = std::string(req.body);
-      
-      auto &user_fun = recv_fun.second;
-
-      auto val = user_fun(arg);
-
-      // DBGH << "RPC(" << req.path << ") -> ("
-	   // << to_hex(val.c_str(), val.length()) << ")" << std::endl;
-      
-      res.set_content(val.c_str(), "text/plain");
-    };
-
-    auto fun_name = recv_fun.first;
-    
-    this->server->Post(fun_name.c_str(), fun);
-  }
-
-  std::thread([&]() {
-    this->server->listen(this->hostname.c_str(), this->port);
-  }).detach();
-  
+
+  struct addrinfo hints {}, *res = nullptr;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  auto port_str = std::to_string(this->port);
+  int gai_err = getaddrinfo(this->hostname.c_str(), port_str.c_str(),
+			    &hints, &res);
+  if (gai_err != 0)
+    return {"getaddrinfo failed: " + string(gai_strerror(gai_err))};
+
+  int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (fd == -1) {
+    freeaddrinfo(res);
+    return {"socket failed: " + PSTR()};
+  }
+
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  if (bind(fd, res->ai_addr, res->ai_addrlen) == -1
+      || listen(fd, SOMAXCONN) == -1) {
+    auto err = PSTR();
+    freeaddrinfo(res);
+    close(fd);
+    return {"Unable to listen on " + this->hostname + ":" + port_str
+	    + ": " + err};
+  }
+
+  freeaddrinfo(res);
+  this->listen_fd = fd;
+
+  if (this->reactor) {
+    this->reactor->add_listener(fd, [this](int conn_fd) {
+      set_nodelay(conn_fd);
+      this->serve_conn_uring(conn_fd);
+    });
+  } else {
+    this->start_thread([this, fd]() { this->accept_loop(fd); });
+  }
+
+  if (this->cfg.same_host_uds)
+    return this->start_recv_uds();
+
   return {};
 }
 
+mres_t RpcServer::start_recv_uds() {
+  struct sockaddr_un sun;
+  auto sun_len = uds_addr(this->cluster_id, this->hostname, this->port,
+			  sun);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    return {"socket failed: " + PSTR()};
+
+  if (bind(fd, reinterpret_cast<struct sockaddr*>(&sun), sun_len) == -1
+      || listen(fd, SOMAXCONN) == -1) {
+    auto err = PSTR();
+    close(fd);
+    return {"Unable to listen on the Unix socket for port "
+	    + std::to_string(this->port) + ": " + err};
+  }
+
+  this->uds_listen_fd = fd;
+
+  if (this->reactor) {
+    this->reactor->add_listener(fd, [this](int conn_fd) {
+      this->serve_conn_uring(conn_fd);
+    });
+  } else {
+    this->start_thread([this, fd]() { this->accept_loop(fd); });
+  }
+
+  return {};
+}
+
+void RpcServer::start_thread(std::function<void()> fun) {
+  ivyguard(this->thread_lock);
+  this->threads.emplace_back(std::move(fun));
+}
+
+void RpcServer::accept_loop(int listen_fd) {
+  while (!this->stopping) {
+    int fd = accept(listen_fd, nullptr, nullptr);
+
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+
+      DBGH << "accept() failed: " << PSTR() << std::endl;
+      return;
+    }
+
+    if (listen_fd == this->listen_fd)
+      set_nodelay(fd);
+
+    auto conn = std::make_shared<conn_t>();
+    conn->fd = fd;
+
+    /* stop() shuts down the connections it finds here, one accepted
+       after it looked must not start a reader */
+    ivyguard(this->thread_lock);
+    if (this->stopping) {
+      close(fd);
+      return;
+    }
+
+    this->accepted.push_back(conn);
+    this->threads.emplace_back([this, conn]() { this->serve_conn(conn); });
+  }
+}
+
+void RpcServer::serve_conn(std::shared_ptr<conn_t> conn) {
+  while (true) {
+    auto [msg, err] = recv_frame(conn->fd, this->cfg.max_payload);
+
+    if (err.has_value()) {
+      DBGH << "Closing connection: " << err.value() << std::endl;
+      break;
+    }
+
+    /* Requests on one connection are independent of each other,
+       handlers may block on their own RPCs so don't run them on
+       the reader */
+    this->submit_req(conn, std::move(msg));
+  }
+
+  ivyguard(conn->tx_lock);
+  close(conn->fd);
+  conn->fd = -1;
+}
+
+void RpcServer::serve_conn_uring(int fd) {
+  auto conn = std::make_shared<conn_t>();
+  conn->fd = fd;
+
+  /* The reactor drops both callbacks once the connection is gone,
+     which also releases the reference they hold */
+  conn->rid = this->reactor->add_conn(
+    fd,
+    [this, conn](msg_t msg) {
+      this->submit_req(conn, std::move(msg));
+    },
+    [conn](string reason) {
+      DBGH << "Closing connection: " << reason << std::endl;
+
+      ivyguard(conn->tx_lock);
+      conn->fd = -1;
+    });
+}
+
+mres_t RpcServer::transmit(conn_t &conn, const msg_t &msg) {
+  ivyguard(conn.tx_lock);
+  if (conn.fd == -1)
+    return {"Connection closed"};
+
+  /* The reactor batches the frame with whatever else is queued */
+  if (conn.rid != 0) {
+    this->reactor->send(conn.rid, msg);
+    return {};
+  }
+
+  return send_frame(conn.fd, msg);
+}
+
+void RpcServer::submit_req(std::shared_ptr<conn_t> conn, msg_t msg) {
+  bool mngr_op = msg.hdr.opcode == OP_GET_RD_PG
+    || msg.hdr.opcode == OP_GET_WR_PG || msg.hdr.opcode == OP_WU_UPDATE
+    || msg.hdr.opcode == OP_DIR_ACK;
+  auto addr = msg.hdr.pg_addr;
+
+  auto job = [this, conn, msg = std::move(msg)]() mutable {
+    this->dispatch(conn, std::move(msg));
+  };
+
+  if (mngr_op)
+    this->submit_for(addr, std::move(job));
+  else
+    this->workers.submit(std::move(job));
+}
+
+void RpcServer::submit_for(uint64_t addr, std::function<void()> job) {
+  if (this->shards.empty()) {
+    this->workers.submit(std::move(job));
+    return;
+  }
+
+  auto shard = (addr / this->cfg.shard_unit) % this->shards.size();
+  this->shards[shard]->submit(std::move(job));
+}
+
+void RpcServer::dispatch(std::shared_ptr<conn_t> conn, msg_t msg) {
+  auto tag = msg.hdr.tag;
+  auto async = this->async_funcs.find(msg.hdr.opcode);
+
+  /* The connection stays around until the handler replies */
+  if (async != this->async_funcs.end()) {
+    async->second(msg, [this, conn, tag](msg_t resp) {
+      this->respond(*conn, tag, std::move(resp));
+    });
+    return;
+  }
+
+  msg_t resp;
+  auto handler = this->msg_funcs.find(msg.hdr.opcode);
+
+  if (handler == this->msg_funcs.end()) {
+    DBGH << "No handler for opcode " << msg.hdr.opcode << std::endl;
+    resp = make_msg(IvyOpcode(msg.hdr.opcode), this->myId,
+		    msg.hdr.pg_addr);
+    resp.hdr.flags |= MSG_F_ERR;
+  } else {
+    resp = handler->second(msg);
+  }
+
+  this->respond(*conn, tag, std::move(resp));
+}
+
+void RpcServer::respond(conn_t &conn, uint64_t tag, msg_t resp) {
+  resp.hdr.tag = tag;
+  resp.hdr.flags |= MSG_F_RESP;
+
+  auto err = this->transmit(conn, resp);
+  if (err.has_value()) {
+    DBGH << "Dropping response for tag " << tag << ": "
+	 << err.value() << std::endl;
+  }
+}
+
 mres_t RpcServer::start_serving() {
   DBGH << "Starting RPC server thread asynchronously" << std::endl;
 
-  auto bg_fun = [&] () { this->start_recv(); };
-  std::thread(bg_fun).detach();
+  if (this->cfg.io_uring) {
+    this->reactor = std::make_unique<UringReactor>(this->cfg.max_payload);
 
-  return {};
+    auto err = this->reactor->start();
+    if (err.has_value())
+      return err;
+  }
+
+  return this->start_recv();
+}
+
+res_t<std::shared_ptr<RpcServer::conn_t>>
+RpcServer::connect_peer(size_t nodeId) {
+  auto &peer = *this->peers[nodeId];
+  ivyguard(peer.conn_lock);
+
+  if (peer.conn)
+    return {peer.conn, {}};
+
+  if (this->stopping)
+    return {nullptr, "Shutting down"};
+
+  auto [host, port] = parse_addr(this->nodes[nodeId]);
+
+  int fd = -1;
+
+  /* Nodes on this host are a Unix socket away, fall back to TCP if
+     the peer didn't open one */
+  if (this->same_host[nodeId]) {
+    struct sockaddr_un sun;
+    auto sun_len = uds_addr(this->cluster_id, host, port, sun);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd != -1
+	&& connect(fd, reinterpret_cast<struct sockaddr*>(&sun),
+		   sun_len) == -1) {
+      DBGH << "Unix socket connect to node " << nodeId << " failed: "
+	   << PSTR() << std::endl;
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  if (fd == -1) {
+    auto [tcp_fd, err] = this->connect_tcp(host, port);
+    if (err.has_value())
+      return {nullptr, err};
+
+    fd = tcp_fd;
+  }
+
+  auto conn = std::make_shared<conn_t>();
+  conn->fd = fd;
+
+  if (this->reactor) {
+    conn->rid = this->reactor->add_conn(
+      fd,
+      [this, conn](msg_t msg) {
+	this->handle_response(*conn, std::move(msg));
+      },
+      [this, nodeId, conn](string reason) {
+	{
+	  ivyguard(conn->tx_lock);
+	  conn->fd = -1;
+	}
+	this->drop_conn(nodeId, conn, reason);
+      });
+  } else {
+    this->start_thread([this, nodeId, conn]() {
+      this->recv_loop(nodeId, conn);
+    });
+  }
+
+  peer.conn = conn;
+
+  DBGH << "Connected to node " << nodeId << std::endl;
+
+  return {conn, {}};
+}
+
+res_t<int> RpcServer::connect_tcp(const string &host, uint16_t port) {
+  struct addrinfo hints {}, *res = nullptr;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  int gai_err = getaddrinfo(host.c_str(), std::to_string(port).c_str(),
+			    &hints, &res);
+  if (gai_err != 0)
+    return {-1, "getaddrinfo failed: " + string(gai_strerror(gai_err))};
+
+  int fd = -1;
+  for (auto cur = res; cur != nullptr; cur = cur->ai_next) {
+    fd = socket(cur->ai_family, cur->ai_socktype, cur->ai_protocol);
+    if (fd == -1) continue;
+
+    if (connect(fd, cur->ai_addr, cur->ai_addrlen) == 0) break;
+
+    close(fd);
+    fd = -1;
+  }
+
+  freeaddrinfo(res);
+
+  if (fd == -1)
+    return {-1, "Unable to connect to " + host + ":"
+	    + std::to_string(port)};
+
+  set_nodelay(fd);
+
+  return {fd, {}};
+}
+
+void RpcServer::recv_loop(size_t nodeId, std::shared_ptr<conn_t> conn) {
+  while (true) {
+    auto [msg, err] = recv_frame(conn->fd, this->cfg.max_payload);
+
+    if (err.has_value()) {
+      this->drop_conn(nodeId, conn, err.value());
+      break;
+    }
+
+    this->handle_response(*conn, std::move(msg));
+  }
+
+  ivyguard(conn->tx_lock);
+  close(conn->fd);
+  conn->fd = -1;
+}
+
+void RpcServer::handle_response(conn_t &conn, msg_t msg) {
+  rpc_done_f done;
+  {
+    ivyguard(conn.pend_lock);
+    auto it = conn.pending.find(msg.hdr.tag);
+
+    if (it == conn.pending.end()) {
+      DBGH << "Response for unknown tag " << msg.hdr.tag << std::endl;
+      return;
+    }
+
+    done = std::move(it->second);
+    conn.pending.erase(it);
+  }
+
+  if (msg.hdr.flags & MSG_F_ERR) {
+    auto opcode = msg.hdr.opcode;
+    done({std::move(msg), "Remote failed to serve opcode "
+	  + std::to_string(opcode)});
+  } else {
+    done({std::move(msg), {}});
+  }
+}
+
+void RpcServer::drop_conn(size_t nodeId, std::shared_ptr<conn_t> conn,
+			  string reason) {
+  DBGH << "Dropping connection to node " << nodeId << ": "
+       << reason << std::endl;
+
+  {
+    auto &peer = *this->peers[nodeId];
+    ivyguard(peer.conn_lock);
+    if (peer.conn == conn)
+      peer.conn.reset();
+  }
+
+  std::map<uint64_t, rpc_done_f> failed;
+  {
+    ivyguard(conn->pend_lock);
+    if (conn->dead) return;
+
+    conn->dead = true;
+    std::swap(failed, conn->pending);
+  }
+
+  {
+    /* Wakes up the reader, which closes the fd */
+    ivyguard(conn->tx_lock);
+    if (conn->rid != 0)
+      this->reactor->close_conn(conn->rid);
+    else if (conn->fd != -1)
+      shutdown(conn->fd, SHUT_RDWR);
+  }
+
+  for (auto &[tag, done] : failed) {
+    done({msg_t{}, "RPC failed: " + reason});
+  }
+}
+
+void RpcServer::call_async(size_t nodeId, msg_t msg, rpc_done_f done) {
+  DBGH << "Sending opcode " << msg.hdr.opcode << " for page "
+       << P(msg.hdr.pg_addr) << " to node " << nodeId << std::endl;
+
+  if (nodeId >= this->nodes.size()) {
+    done({msg_t{}, "No node with id " + std::to_string(nodeId)});
+    return;
+  }
+
+  auto [conn, err] = this->connect_peer(nodeId);
+  if (err.has_value()) {
+    DBGH << "RPC failed: " << err.value() << std::endl;
+    done({msg_t{}, "RPC failed: " + err.value()});
+    return;
+  }
+
+  msg.hdr.tag = this->next_tag++;
+  msg.hdr.flags &= ~MSG_F_RESP;
+
+  {
+    ivyguard(conn->pend_lock);
+    if (conn->dead) {
+      done({msg_t{}, "RPC failed: connection closed"});
+      return;
+    }
+    conn->pending[msg.hdr.tag] = std::move(done);
+  }
+
+  auto send_err = this->transmit(*conn, msg);
+
+  /* Fails this request along with everything else in flight on the
+     connection */
+  if (send_err.has_value())
+    this->drop_conn(nodeId, conn, send_err.value());
+}
+
+std::future<res_t<msg_t>>
+RpcServer::call_async(size_t nodeId, msg_t msg) {
+  auto promise = std::make_shared<std::promise<res_t<msg_t>>>();
+  auto result = promise->get_future();
+
+  this->call_async(nodeId, std::move(msg),
+		   [promise](res_t<msg_t> res) {
+		     promise->set_value(std::move(res));
+		   });
+
+  return result;
+}
+
+RpcServer::pending_t RpcServer::co_call(size_t nodeId, msg_t msg) {
+  pending_t result(this);
+  auto addr = msg.hdr.pg_addr;
+
+  this->call_async(nodeId, std::move(msg),
+		   [this, addr, st = result.st](res_t<msg_t> res) {
+		     std::coroutine_handle<> waiter;
+		     {
+		       ivyguard(st->lock);
+		       st->result = std::move(res);
+		       waiter = st->waiter;
+		     }
+
+		     /* Off the reader thread, the coroutine may block. It
+			carries on with the page's requests, on their shard. */
+		     if (waiter)
+		       this->submit_for(addr, [waiter] { waiter.resume(); });
+		   });
+
+  return result;
+}
+
+bool RpcServer::pending_t::await_ready() {
+  ivyguard(this->st->lock);
+
+  return this->st->result.has_value();
+}
+
+bool RpcServer::pending_t::await_suspend(std::coroutine_handle<> waiter) {
+  ivyguard(this->st->lock);
+
+  /* Came in since await_ready(), carry on without suspending */
+  if (this->st->result.has_value())
+    return false;
+
+  this->st->waiter = waiter;
+  return true;
+}
+
+res_t<msg_t> RpcServer::pending_t::await_resume() {
+  ivyguard(this->st->lock);
+
+  return std::move(this->st->result.value());
+}
+
+res_t<msg_t> RpcServer::call(size_t nodeId, const msg_t &msg) {
+  return this->call_async(nodeId, msg).get();
 }
 
 res_t<string> RpcServer::call(size_t nodeId, string name, string buf) {
@@ -137,46 +813,59 @@ res_t<string> RpcServer::call(size_t nodeId, string name, string buf) {
        << " with buffer " << buf << " addr = " << this->nodes[nodeId]
        << std::endl;
 
-  res_t<string> ret_val;
-  
-  try {
-    auto msg = this->clients[nodeId]->Post(name.c_str(),
-					   buf.c_str(), "text/plain");
+  string payload = name;
+  payload.push_back('\0');
+  payload += buf;
 
-    if (!msg)
-      throw std::runtime_error(std::to_string((int)msg.error()));
+  auto [resp, err] = this->call(nodeId, make_msg(OP_CALL, this->myId, 0,
+						 IvyAccessType::NONE,
+						 std::move(payload)));
 
-    
-    DBGH << "Message = " << msg << std::endl;
+  if (err.has_value()) {
+    DBGH << "RPC failed: " << err.value() << std::endl;
+    return {"", "RPC failed"};
+  }
 
-    auto result = std::string(msg->body);
+  DBGH << "Call complete" << std::endl;
 
-    // DBGH << "result = " << result << std::endl;
-  
-    ret_val = {result, {}};
+  return {resp.payload, {}};
+}
 
-    DBGH << "Call complete" << std::endl;
-  } catch (std::exception &e) {
-    DBGH << "RPC failed: " << e.what() << std::endl;
-    return {"", "RPC failed"};
+msg_t RpcServer::call_adapter(const msg_t &in) {
+  auto sep = in.payload.find('\0');
+  auto name = in.payload.substr(0, sep);
+  auto arg = sep == string::npos ? "" : in.payload.substr(sep + 1);
+
+  auto resp = make_msg(OP_CALL, this->myId, 0);
+
+  auto fun = this->recv_funcs.find(name);
+  if (fun == this->recv_funcs.end()) {
+    DBGH << "No function named " << name << std::endl;
+    resp.hdr.flags |= MSG_F_ERR;
+    return resp;
   }
-  
-  return ret_val;
+
+  resp.payload = fun->second(arg);
+
+  return resp;
 }
 
 res_t<string>
 RpcServer::call_blocking(size_t nodeId, string name, string buf) {
   optional<err_t> err = "";
   string val;
-  
+  Backoff backoff(0ms);
+
   while (err.has_value()) {
     auto [res_, err_] = this->call(nodeId, name, buf);
 
-    DBGH << "Sleeping for 1000ms" << std::endl;
-    std::this_thread::sleep_for(1000ms);
-
     val = res_;
     err = err_;
+
+    if (err.has_value()) {
+      DBGH << "Call failed, retrying" << std::endl;
+      backoff.wait();
+    }
   }
 
   return {val, {}};
@@ -185,11 +874,94 @@ RpcServer::call_blocking(size_t nodeId, string name, string buf) {
 void
 RpcServer::register_recv_funcs(vector<pair<string, rpc_recv_f>> lst) {
   for (auto elem : lst) {
-    this->recv_funcs.push_back({elem.first, elem.second});
+    this->recv_funcs[elem.first] = elem.second;
+  }
+}
+
+void
+RpcServer::register_msg_funcs(vector<pair<IvyOpcode, rpc_msg_f>> lst) {
+  for (auto elem : lst) {
+    this->msg_funcs[elem.first] = elem.second;
+  }
+}
+
+void
+RpcServer::register_async_funcs(vector<pair<IvyOpcode, rpc_async_f>> lst) {
+  for (auto elem : lst) {
+    this->async_funcs[elem.first] = elem.second;
   }
 }
 
 
 RpcServer::~RpcServer() {
   DBGH << "Destructor for rpcserver called" << std::endl;
+
+  this->stop();
+}
+
+void RpcServer::stop() {
+  this->stopping = true;
+
+  if (this->listen_fd != -1)
+    shutdown(this->listen_fd, SHUT_RDWR);
+
+  if (this->uds_listen_fd != -1)
+    shutdown(this->uds_listen_fd, SHUT_RDWR);
+
+  for (size_t node = 0; node < this->peers.size(); node++) {
+    std::shared_ptr<conn_t> conn;
+    {
+      ivyguard(this->peers[node]->conn_lock);
+      conn = this->peers[node]->conn;
+    }
+
+    if (conn)
+      this->drop_conn(node, conn, "Shutting down");
+  }
+
+  /* Wakes up their readers, which close the fds */
+  {
+    ivyguard(this->thread_lock);
+    for (auto &weak : this->accepted) {
+      auto conn = weak.lock();
+      if (!conn) continue;
+
+      ivyguard(conn->tx_lock);
+      if (conn->fd != -1)
+	shutdown(conn->fd, SHUT_RDWR);
+    }
+    this->accepted.clear();
+  }
+
+  while (true) {
+    vector<std::thread> threads;
+    {
+      ivyguard(this->thread_lock);
+      std::swap(threads, this->threads);
+    }
+
+    if (threads.empty())
+      break;
+
+    for (auto &thread : threads)
+      thread.join();
+  }
+
+  if (this->reactor)
+    this->reactor->stop();
+
+  /* Manager requests queued on the shards or resuming there run
+     against the caller's page table, finish them while it's around */
+  for (auto &shard : this->shards)
+    shard->stop();
+
+  /* Handlers still running may only be waiting on calls that just
+     failed */
+  this->workers.stop();
+
+  if (this->listen_fd != -1)
+    close(std::exchange(this->listen_fd, -1));
+
+  if (this->uds_listen_fd != -1)
+    close(std::exchange(this->uds_listen_fd, -1));
 }
@@ -11,13 +11,18 @@
 #define IVY_HEADER_LIBIVY_RPCSERVER_H__
 
 #include "common.hh"
+#include "uring.hh"
+#include "wire.hh"
+#include "workerpool.hh"
 
+#include <atomic>
+#include <coroutine>
+#include <future>
+#include <map>
 #include <string>
 #include <vector>
 #include <functional>
 
-#include "httplib.h"
-
 namespace libivy {
   using std::pair;
   using std::string;
@@ -26,39 +31,229 @@ namespace libivy {
 
   using rpc_recv_f = std::function<string(string)>;
   using rpc_send_f = std::function<mres_t(string)>;
-  
+  using rpc_msg_f = std::function<msg_t(const msg_t&)>;
+
+  /** @brief Completion callback for \ref RpcServer::call_async */
+  using rpc_done_f = std::function<void(res_t<msg_t>)>;
+
+  /** @brief Sends the response to a request served by a rpc_async_f */
+  using rpc_reply_f = std::function<void(msg_t)>;
+
+  /**
+   * @brief Handler that answers later, it calls the reply function
+   * exactly once, from any thread, instead of returning the response
+   */
+  using rpc_async_f = std::function<void(const msg_t&, rpc_reply_f)>;
+
+  /** @brief Knobs for the transport used between nodes */
+  struct rpc_cfg_t {
+    /* Talk to nodes on the same host over a Unix domain socket */
+    bool same_host_uds = true;
+
+    /* Drive every socket from an io_uring reactor instead of a
+       thread per connection */
+    bool io_uring = false;
+
+    /* Frames announcing a longer payload drop their connection */
+    uint32_t max_payload = MAX_PAYLOAD;
+
+    /* Serve page requests to the manager on this many pinned threads,
+       each owning the blocks whose number modulo shards is its index.
+       The requests resume there after waiting on other nodes too. 0
+       runs them on the shared worker pool. */
+    size_t mngr_shards = 0;
+
+    /* Bytes per block, to find the shard of a request */
+    uint64_t shard_unit = 4096;
+  };
+
   class RpcServer {
+  public:
+    /**
+     * @brief Response to a message sent with \ref co_call. Awaiting it
+     * suspends the coroutine until the response (or an error) is in,
+     * it resumes where \ref submit_for runs jobs for the message's page
+     * then.
+     */
+    class pending_t {
+    public:
+      bool await_ready();
+      bool await_suspend(std::coroutine_handle<> waiter);
+      res_t<msg_t> await_resume();
+
+    private:
+      friend class RpcServer;
+
+      struct state_t {
+	std::mutex lock;
+	std::optional<res_t<msg_t>> result;
+	std::coroutine_handle<> waiter;
+      };
+
+      pending_t(RpcServer *server)
+	: server(server), st(std::make_shared<state_t>()) {}
+
+      RpcServer *server;
+      std::shared_ptr<state_t> st;
+    };
+
   private:
+    /**
+     * @brief A persistent connection. Any number of requests can be
+     * outstanding on it, responses are matched back to their caller
+     * using the tag in the header and may arrive in any order.
+     */
+    struct conn_t {
+      int fd = -1;
+      uint64_t rid = 0;       /* Reactor connection id, 0 if threaded */
+      std::mutex tx_lock;     /* Serializes frames written to fd */
+      std::mutex pend_lock;   /* Protects pending and dead */
+      std::map<uint64_t, rpc_done_f> pending;
+      bool dead = false;
+    };
+
+    struct peer_t {
+      std::mutex conn_lock;   /* Held while (re)connecting */
+      std::shared_ptr<conn_t> conn;
+    };
+
     string hostname;
     uint16_t port;
+    uint64_t cluster_id;    /* Names the Unix sockets, see uds_addr() */
+    int listen_fd = -1;
+    int uds_listen_fd = -1;
+    std::atomic<bool> stopping = false;
 
-    unique_ptr<httplib::Server> server;
-    vector<unique_ptr<httplib::Client>> clients;
-    
-    vector<pair<string, rpc_recv_f>> recv_funcs;
+    /* Acceptors and connection readers, joined by stop() */
+    std::mutex thread_lock;
+    vector<std::thread> threads;
+    vector<std::weak_ptr<conn_t>> accepted;
+
+    vector<unique_ptr<peer_t>> peers;
+    vector<bool> same_host;   /* Peers reachable over a Unix socket */
+    rpc_cfg_t cfg;
+    std::atomic<uint64_t> next_tag = 1;
+
+    WorkerPool workers;
+
+    /* Manager requests, see rpc_cfg_t::mngr_shards */
+    vector<unique_ptr<PinnedWorker>> shards;
+
+    std::map<string, rpc_recv_f> recv_funcs;
+    std::map<uint16_t, rpc_msg_f> msg_funcs;
+    std::map<uint16_t, rpc_async_f> async_funcs;
 
     vector<string> nodes;
     size_t myId;
 
+    /* Declared last so it stops before anything its callbacks use */
+    unique_ptr<UringReactor> reactor;
+
     mres_t start_recv();
-    mres_t start_send();    
+    mres_t start_send();
+
+    /** @brief Run \p fun on a thread joined by \ref stop */
+    void start_thread(std::function<void()> fun);
+
+    /** @brief Accept connections and spawn a reader for each */
+    void accept_loop(int fd);
+
+    /** @brief Listen on the Unix socket other local nodes connect to */
+    mres_t start_recv_uds();
+
+    /** @brief Read requests from a connection and dispatch them */
+    void serve_conn(std::shared_ptr<conn_t> conn);
+
+    /** @brief Serve requests on an accepted socket from the reactor */
+    void serve_conn_uring(int fd);
+
+    /** @brief Write a frame to a connection */
+    mres_t transmit(conn_t &conn, const msg_t &msg);
+
+    /** @brief Complete the caller waiting for a response */
+    void handle_response(conn_t &conn, msg_t msg);
+
+    /** @brief Queue a request on its shard or the worker pool */
+    void submit_req(std::shared_ptr<conn_t> conn, msg_t msg);
+
+    /** @brief Run the handler for a request and write the response */
+    void dispatch(std::shared_ptr<conn_t> conn, msg_t msg);
+
+    /** @brief Write the response to the request tagged \p tag */
+    void respond(conn_t &conn, uint64_t tag, msg_t resp);
+
+    /** @brief Read responses from a peer and complete their callers */
+    void recv_loop(size_t nodeId, std::shared_ptr<conn_t> conn);
+
+    /** @brief Connect to a peer if there is no live connection */
+    res_t<std::shared_ptr<conn_t>> connect_peer(size_t nodeId);
+
+    /** @brief Open a TCP connection to host:port */
+    res_t<int> connect_tcp(const string &host, uint16_t port);
+
+    /** @brief Fail every outstanding request on a broken connection */
+    void drop_conn(size_t nodeId, std::shared_ptr<conn_t> conn,
+		   string reason);
+
+    /** @brief Serves the named string functions over OP_CALL */
+    msg_t call_adapter(const msg_t &in);
   public:
-    RpcServer(vector<string> nodes, size_t myId);
+    RpcServer(vector<string> nodes, size_t myId, rpc_cfg_t cfg = {});
     ~RpcServer();
     /** @brief Register */
     void register_recv_funcs(vector<pair<string, rpc_recv_f>>);
 
+    /** @brief Register handlers for binary messages by opcode */
+    void register_msg_funcs(vector<pair<IvyOpcode, rpc_msg_f>>);
+
+    /** @brief Same as above, for handlers that reply later */
+    void register_async_funcs(vector<pair<IvyOpcode, rpc_async_f>>);
+
     /** @brief Call a remote function */
     res_t<string> call(size_t nodeId, string name, string buf);
 
+    /** @brief Send a binary message and wait for the response */
+    res_t<msg_t> call(size_t nodeId, const msg_t &msg);
+
+    /**
+     * @brief Send a binary message without waiting, \p done runs on
+     * the connection's reader thread once the response (or an error)
+     * arrives and must not block.
+     */
+    void call_async(size_t nodeId, msg_t msg, rpc_done_f done);
+
+    /** @brief Same as above, but returns a future for the response */
+    std::future<res_t<msg_t>> call_async(size_t nodeId, msg_t msg);
+
+    /**
+     * @brief Same as above, for coroutines. The message goes out right
+     * away, so several calls can be in flight before awaiting any.
+     */
+    pending_t co_call(size_t nodeId, msg_t msg);
+
     /** @brief Same as \ref call , but blocks until the success */
     res_t<string> call_blocking(size_t nodeId, string name, string buf);
 
     mres_t start_serving();
 
+    /**
+     * @brief Run \p job on the shard owning the page at \p addr, or on
+     * the worker pool if requests aren't sharded
+     */
+    void submit_for(uint64_t addr, std::function<void()> job);
+
+    bool sharded() const { return !this->shards.empty(); }
+
+    /**
+     * @brief Close every socket, fail the outstanding calls and join
+     * the threads serving them. Calls made afterwards fail right away.
+     */
+    void stop();
+
+    bool stopped() const { return this->stopping; }
+
     string ca_va() { return "ca va"; }
   };
 }
 
 #endif // IVY_HEADER_LIBIVY_RPCSERVER_H__
-
@@ -0,0 +1,116 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   stats.hh
+ * @date   Oct 16, 2026
+ * @brief  Runtime counters exported by an Ivy node
+ */
+
+#ifndef IVY_HEADER_LIBIVY_STATS_H__
+#define IVY_HEADER_LIBIVY_STATS_H__
+
+#include <atomic>
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+namespace libivy {
+  /** @brief Counters updated by the protocol, safe to read any time */
+  struct IvyStats {
+    using counter_t = std::atomic<uint64_t>;
+
+    counter_t dir_requests{0};       /* Faults served as a manager */
+    counter_t dir_queued{0};         /* Of those, queued behind another
+					request for the same block */
+    counter_t dyn_forwards{0};       /* Requests passed to prob_owner */
+    counter_t pg_pushed{0};          /* Pages sent straight to the faulter */
+
+    counter_t pin_deferred{0};       /* Requests held for the pin window */
+    counter_t pin_wait_ns{0};        /* Time they were held */
+
+    counter_t fs_disjoint{0};        /* Hand-offs between disjoint writers */
+
+    counter_t faults_coalesced{0};   /* Found the page fetched by another
+					thread once they got the lock */
+
+    counter_t pf_issued{0};          /* Blocks prefetched */
+    counter_t pf_hits{0};            /* Of those, reached by the scan */
+    counter_t pf_misses{0};          /* Read faults the prefetcher missed */
+
+    counter_t inval_sent{0};         /* Invalidations sent */
+    counter_t inval_inflight{0};     /* Sent but not acknowledged yet */
+    counter_t inval_inflight_max{0}; /* High watermark of the above */
+
+    counter_t diff_sent{0};          /* Pages served as a diff */
+    counter_t diff_full{0};          /* Diff asked for, full page sent */
+    counter_t diff_bytes{0};         /* Payload bytes of the diffs */
+
+    counter_t rc_twins{0};           /* Twins made on a first write */
+    counter_t rc_diffs{0};           /* Diffs sent to a home on release */
+    counter_t rc_diff_bytes{0};      /* Payload bytes of the above */
+    counter_t rc_merged{0};          /* Diffs merged as a home */
+    counter_t lock_acquires{0};      /* Locks taken by this node */
+    counter_t lock_notices{0};       /* Write notices received with them */
+    counter_t lock_notice_drops{0};  /* Cached pages dropped for a notice */
+
+    counter_t wu_updates{0};         /* Stores sent as write updates */
+    counter_t wu_bytes{0};           /* Payload bytes of the above */
+    counter_t wu_applied{0};         /* Updates applied to our copies */
+
+    counter_t lz_sent{0};            /* Payloads sent compressed */
+    counter_t lz_skipped{0};         /* Tried, but didn't get smaller */
+    counter_t lz_in_bytes{0};        /* Bytes before compression */
+    counter_t lz_out_bytes{0};       /* Bytes after compression */
+    counter_t lz_cpu_ns{0};          /* CPU time compressing and back */
+
+    /** @brief Raise \p peak to \p val if it is larger */
+    static void update_max(counter_t &peak, uint64_t val) {
+      auto cur = peak.load();
+      while (val > cur && !peak.compare_exchange_weak(cur, val));
+    }
+
+    /** @brief One "name value" pair per line */
+    std::string to_string() const {
+      std::ostringstream out;
+
+      out << "dir_requests " << dir_requests << "\n"
+	  << "dir_queued " << dir_queued << "\n"
+	  << "dyn_forwards " << dyn_forwards << "\n"
+	  << "pg_pushed " << pg_pushed << "\n"
+	  << "pin_deferred " << pin_deferred << "\n"
+	  << "pin_wait_ns " << pin_wait_ns << "\n"
+	  << "fs_disjoint " << fs_disjoint << "\n"
+	  << "faults_coalesced " << faults_coalesced << "\n"
+	  << "pf_issued " << pf_issued << "\n"
+	  << "pf_hits " << pf_hits << "\n"
+	  << "pf_misses " << pf_misses << "\n"
+	  << "inval_sent " << inval_sent << "\n"
+	  << "inval_inflight " << inval_inflight << "\n"
+	  << "inval_inflight_max " << inval_inflight_max << "\n"
+	  << "diff_sent " << diff_sent << "\n"
+	  << "diff_full " << diff_full << "\n"
+	  << "diff_bytes " << diff_bytes << "\n"
+	  << "rc_twins " << rc_twins << "\n"
+	  << "rc_diffs " << rc_diffs << "\n"
+	  << "rc_diff_bytes " << rc_diff_bytes << "\n"
+	  << "rc_merged " << rc_merged << "\n"
+	  << "lock_acquires " << lock_acquires << "\n"
+	  << "lock_notices " << lock_notices << "\n"
+	  << "lock_notice_drops " << lock_notice_drops << "\n"
+	  << "wu_updates " << wu_updates << "\n"
+	  << "wu_bytes " << wu_bytes << "\n"
+	  << "wu_applied " << wu_applied << "\n"
+	  << "lz_sent " << lz_sent << "\n"
+	  << "lz_skipped " << lz_skipped << "\n"
+	  << "lz_in_bytes " << lz_in_bytes << "\n"
+	  << "lz_out_bytes " << lz_out_bytes << "\n"
+	  << "lz_ratio " << (lz_out_bytes ? (double)lz_in_bytes
+				 / lz_out_bytes : 0.0) << "\n"
+	  << "lz_cpu_ns " << lz_cpu_ns << "\n";
+
+      return out.str();
+    }
+  };
+} // namespace libivy
+
+#endif // IVY_HEADER_LIBIVY_STATS_H__
@@ -0,0 +1,157 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   task.hh
+ * @date   Oct 16, 2026
+ * @brief  Coroutines for protocol steps that wait on other nodes
+ */
+
+#ifndef IVY_HEADER_LIBIVY_TASK_H__
+#define IVY_HEADER_LIBIVY_TASK_H__
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <utility>
+
+namespace libivy {
+  template <typename T = void>
+  class Task;
+
+  namespace detail {
+    /* Hands control back to whoever awaits the task, if anyone */
+    struct task_final_t {
+      bool await_ready() noexcept { return false; }
+
+      template <typename P>
+      std::coroutine_handle<>
+      await_suspend(std::coroutine_handle<P> self) noexcept {
+	auto next = self.promise().next;
+
+	/* Nobody holds a spawned task, it goes away on its own */
+	if (self.promise().detached)
+	  self.destroy();
+
+	return next ? next : std::noop_coroutine();
+      }
+
+      void await_resume() noexcept {}
+    };
+
+    struct task_promise_base_t {
+      std::coroutine_handle<> next;
+      bool detached = false;
+
+      std::suspend_always initial_suspend() noexcept { return {}; }
+      task_final_t final_suspend() noexcept { return {}; }
+
+      /* Nothing in libivy throws, see error.hh */
+      void unhandled_exception() { std::terminate(); }
+    };
+  }
+
+  /**
+   * @brief A coroutine returning a T. It starts once awaited, runs on
+   * the awaiting thread until it suspends itself, and resumes the
+   * awaiting coroutine when done. Awaiting a response from another
+   * node (see \ref RpcServer::co_call) doesn't hold a thread, so any
+   * number of them can be in flight on a few threads.
+   */
+  template <typename T>
+  class Task {
+  public:
+    struct promise_type : detail::task_promise_base_t {
+      std::optional<T> value;
+
+      Task get_return_object() {
+	return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+      }
+
+      void return_value(T val) { this->value = std::move(val); }
+    };
+
+    Task(Task &&other) : coro(std::exchange(other.coro, nullptr)) {}
+    Task(const Task&) = delete;
+    ~Task() { if (this->coro) this->coro.destroy(); }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<> caller) noexcept {
+      this->coro.promise().next = caller;
+      return this->coro;
+    }
+
+    T await_resume() { return std::move(*this->coro.promise().value); }
+
+  private:
+    template <typename> friend class Task;
+    friend void spawn(Task<void> task);
+
+    explicit Task(std::coroutine_handle<promise_type> coro) : coro(coro) {}
+
+    std::coroutine_handle<promise_type> coro;
+  };
+
+  template <>
+  class Task<void> {
+  public:
+    struct promise_type : detail::task_promise_base_t {
+      Task get_return_object() {
+	return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+      }
+
+      void return_void() {}
+    };
+
+    Task(Task &&other) : coro(std::exchange(other.coro, nullptr)) {}
+    Task(const Task&) = delete;
+    ~Task() { if (this->coro) this->coro.destroy(); }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<> caller) noexcept {
+      this->coro.promise().next = caller;
+      return this->coro;
+    }
+
+    void await_resume() {}
+
+  private:
+    friend void spawn(Task<void> task);
+
+    explicit Task(std::coroutine_handle<promise_type> coro) : coro(coro) {}
+
+    std::coroutine_handle<promise_type> coro;
+  };
+
+  /**
+   * @brief Run \p task without waiting for it. It runs on this thread
+   * until it first suspends and frees itself once done.
+   */
+  inline void spawn(Task<void> task) {
+    auto coro = std::exchange(task.coro, nullptr);
+    coro.promise().detached = true;
+    coro.resume();
+  }
+
+  /**
+   * @brief Awaiting it moves the coroutine to whatever thread \p submit
+   * runs the job it is given on
+   */
+  struct resume_via {
+    std::function<void(std::function<void()>)> submit;
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> waiter) {
+      this->submit([waiter] { waiter.resume(); });
+    }
+
+    void await_resume() const noexcept {}
+  };
+}
+
+#endif // IVY_HEADER_LIBIVY_TASK_H__
@@ -0,0 +1,127 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   timerqueue.hh
+ * @date   Oct 16, 2026
+ * @brief  Delayed jobs, and a delay coroutines can await
+ */
+
+#ifndef IVY_HEADER_LIBIVY_TIMERQUEUE_H__
+#define IVY_HEADER_LIBIVY_TIMERQUEUE_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+
+namespace libivy {
+  /**
+   * @brief Runs jobs once their delay is over, on a single thread that
+   * keeps the deadlines. A job must be short or it holds back the ones
+   * due after it, a coroutine moves elsewhere first thing (see
+   * \ref resume_via). stop() runs the jobs still waiting early, later
+   * ones run right away on the caller.
+   */
+  class TimerQueue {
+  private:
+    using job_t = std::function<void()>;
+    using clock = std::chrono::steady_clock;
+
+    std::mutex lock;
+    std::condition_variable cv;
+    std::multimap<clock::time_point, job_t> due;
+    bool stopping = false;
+    std::thread thread;
+
+    void run() {
+      std::unique_lock<std::mutex> guard(this->lock);
+
+      while (!this->stopping) {
+	if (this->due.empty()) {
+	  this->cv.wait(guard);
+	  continue;
+	}
+
+	auto first = this->due.begin();
+	if (first->first > clock::now()) {
+	  this->cv.wait_until(guard, first->first);
+	  continue;
+	}
+
+	auto job = std::move(first->second);
+	this->due.erase(first);
+
+	guard.unlock();
+	job();
+	guard.lock();
+      }
+    }
+
+  public:
+    /**
+     * @brief Waits out a delay without holding a thread meanwhile, the
+     * coroutine resumes on the queue's thread
+     */
+    class sleep_t {
+    public:
+      bool await_ready() const noexcept { return false; }
+
+      void await_suspend(std::coroutine_handle<> waiter) {
+	this->timers.after(this->delay, [waiter] { waiter.resume(); });
+      }
+
+      void await_resume() const noexcept {}
+
+    private:
+      friend class TimerQueue;
+
+      sleep_t(TimerQueue &timers, clock::duration delay)
+	: timers(timers), delay(delay) {}
+
+      TimerQueue &timers;
+      clock::duration delay;
+    };
+
+    TimerQueue() : thread([this] { this->run(); }) {}
+    TimerQueue(const TimerQueue&) = delete;
+    ~TimerQueue() { this->stop(); }
+
+    void after(clock::duration delay, job_t job) {
+      {
+	std::lock_guard<std::mutex> guard(this->lock);
+
+	if (!this->stopping) {
+	  this->due.emplace(clock::now() + delay, std::move(job));
+	  this->cv.notify_one();
+	  return;
+	}
+      }
+
+      job();
+    }
+
+    /** @brief co_await it to resume once \p delay is over */
+    sleep_t sleep(clock::duration delay) { return sleep_t(*this, delay); }
+
+    void stop() {
+      std::multimap<clock::time_point, job_t> left;
+      {
+	std::lock_guard<std::mutex> guard(this->lock);
+	this->stopping = true;
+	std::swap(left, this->due);
+      }
+
+      this->cv.notify_one();
+      if (this->thread.joinable())
+	this->thread.join();
+
+      for (auto &[when, job] : left)
+	job();
+    }
+  };
+} // namespace libivy
+
+#endif // IVY_HEADER_LIBIVY_TIMERQUEUE_H__
@@ -0,0 +1,186 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   uffd.cc
+ * @date   Oct 16, 2026
+ * @brief  userfaultfd based fault handling for the shared region
+ */
+
+#include "error.hh"
+#include "../common.hh"
+#include "uffd.hh"
+
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace libivy;
+
+static const char zero_pg[UffdEngine::PAGE_SZ] = {};
+
+UffdEngine::~UffdEngine() {
+  if (this->running.exchange(false)) {
+    uint64_t one = 1;
+    if (write(this->wake_fd, &one, sizeof(one)) == -1)
+      DBGH << "Waking the fault thread failed: " << PSTR() << std::endl;
+
+    if (this->fault_thread.joinable())
+      this->fault_thread.join();
+  }
+
+  /* Faults still being served wake their threads through fd */
+  this->workers.stop();
+
+  if (this->wake_fd != -1)
+    close(this->wake_fd);
+
+  if (this->fd != -1)
+    close(this->fd);
+}
+
+mres_t UffdEngine::start(void *start, size_t bytes, fault_f on_fault) {
+  this->fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+  if (this->fd == -1)
+    return {"userfaultfd failed: " + PSTR()};
+
+  struct uffdio_api api {};
+  api.api = UFFD_API;
+  api.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+
+  if (ioctl(this->fd, UFFDIO_API, &api) == -1)
+    return {"UFFDIO_API failed: " + PSTR()};
+
+  struct uffdio_register reg {};
+  reg.range.start = reinterpret_cast<uint64_t>(start);
+  reg.range.len = bytes;
+  reg.mode = UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_WP;
+
+  if (ioctl(this->fd, UFFDIO_REGISTER, &reg) == -1)
+    return {"UFFDIO_REGISTER failed: " + PSTR()};
+
+  this->wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (this->wake_fd == -1)
+    return {"eventfd failed: " + PSTR()};
+
+  this->on_fault = std::move(on_fault);
+  this->running = true;
+  this->fault_thread = std::thread([this]() { this->serve(); });
+
+  return {};
+}
+
+mres_t UffdEngine::place(void *addr, const char *src, size_t bytes,
+			 bool wp) {
+  auto base = reinterpret_cast<uint64_t>(addr);
+
+  for (size_t off = 0; off < bytes; off += PAGE_SZ) {
+    auto pg = reinterpret_cast<char*>(base + off);
+
+    struct uffdio_copy copy {};
+    copy.dst = base + off;
+    copy.src = reinterpret_cast<uint64_t>(src == nullptr ? zero_pg
+					  : src + off);
+    copy.len = PAGE_SZ;
+    copy.mode = UFFDIO_COPY_MODE_DONTWAKE
+      | (wp ? UFFDIO_COPY_MODE_WP : 0);
+
+    if (ioctl(this->fd, UFFDIO_COPY, &copy) == 0)
+      continue;
+
+    if (errno != EEXIST)
+      return {"UFFDIO_COPY failed: " + PSTR()};
+
+    /* Mapped already. New contents replace the page as a whole, a
+       thread touching it meanwhile faults and waits for the copy. */
+    if (src != nullptr) {
+      auto err = this->drop(pg, PAGE_SZ);
+      if (err.has_value())
+	return err;
+
+      if (ioctl(this->fd, UFFDIO_COPY, &copy) == -1)
+	return {"UFFDIO_COPY failed: " + PSTR()};
+
+      continue;
+    }
+
+    auto err = this->protect(pg, PAGE_SZ, wp);
+    if (err.has_value())
+      return err;
+  }
+
+  return {};
+}
+
+mres_t UffdEngine::drop(void *addr, size_t bytes) {
+  if (madvise(addr, bytes, MADV_DONTNEED) == -1)
+    return {"madvise failed: " + PSTR()};
+
+  return {};
+}
+
+mres_t UffdEngine::protect(void *addr, size_t bytes, bool wp) {
+  struct uffdio_writeprotect prot {};
+  prot.range.start = reinterpret_cast<uint64_t>(addr);
+  prot.range.len = bytes;
+  /* Protecting wakes nobody, the kernel refuses DONTWAKE with it */
+  prot.mode = wp ? UFFDIO_WRITEPROTECT_MODE_WP
+    : UFFDIO_WRITEPROTECT_MODE_DONTWAKE;
+
+  if (ioctl(this->fd, UFFDIO_WRITEPROTECT, &prot) == -1)
+    return {"UFFDIO_WRITEPROTECT failed: " + PSTR()};
+
+  return {};
+}
+
+void UffdEngine::wake(void *addr, size_t bytes) {
+  struct uffdio_range range {};
+  range.start = reinterpret_cast<uint64_t>(addr);
+  range.len = bytes;
+
+  if (ioctl(this->fd, UFFDIO_WAKE, &range) == -1)
+    DBGH << "UFFDIO_WAKE failed: " << PSTR() << std::endl;
+}
+
+void UffdEngine::serve() {
+  struct pollfd fds[2] = {
+    {this->fd, POLLIN, 0},
+    {this->wake_fd, POLLIN, 0},
+  };
+
+  while (this->running) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR)
+	continue;
+
+      DBGH << "poll failed: " << PSTR() << std::endl;
+      return;
+    }
+
+    if (fds[1].revents & POLLIN)
+      return;
+
+    struct uffd_msg msg;
+    if (read(this->fd, &msg, sizeof(msg)) != sizeof(msg))
+      continue;
+
+    if (msg.event != UFFD_EVENT_PAGEFAULT)
+      continue;
+
+    uint64_t addr = msg.arg.pagefault.address;
+    auto flags = msg.arg.pagefault.flags;
+    bool write = flags & (UFFD_PAGEFAULT_FLAG_WRITE
+			  | UFFD_PAGEFAULT_FLAG_WP);
+
+    this->workers.submit([this, addr, write]() {
+      this->on_fault(addr, write);
+
+      /* The page is in place, or the access faults again */
+      this->wake(reinterpret_cast<void*>(pg_align(addr)), PAGE_SZ);
+    });
+  }
+}
@@ -0,0 +1,76 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   uffd.hh
+ * @date   Oct 16, 2026
+ * @brief  userfaultfd based fault handling for the shared region
+ */
+
+#ifndef IVY_HEADER_LIBIVY_UFFD_H__
+#define IVY_HEADER_LIBIVY_UFFD_H__
+
+#include "common.hh"
+#include "workerpool.hh"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <thread>
+
+namespace libivy {
+  /**
+   * @brief Serves the faults of a registered range on a thread of its
+   * own instead of in a signal handler.
+   *
+   * The protection states of the SIGSEGV engine map to page states
+   * here: no access is an unmapped page, read only is a page write
+   * protected through userfaultfd, and read-write is a plain mapped
+   * page. Pages are placed with UFFDIO_COPY, so a faulting thread
+   * never sees a page half written.
+   *
+   * The fault thread only reads events, the callback runs on a pool
+   * so faults on different pages are served in parallel. Nothing
+   * wakes a faulting thread but the job serving its fault, once the
+   * callback returned.
+   */
+  class UffdEngine {
+  public:
+    using fault_f = std::function<void(uint64_t addr, bool write)>;
+
+    static constexpr size_t PAGE_SZ = 4096;
+
+    UffdEngine() = default;
+    ~UffdEngine();
+
+    /**
+     * @brief Take over the faults of [\p start, \p start + \p bytes)
+     * and start the fault thread, which calls \p on_fault for each
+     */
+    mres_t start(void *start, size_t bytes, fault_f on_fault);
+
+    /**
+     * @brief Map \p bytes at \p addr, write protected if \p wp. Pages
+     * already mapped are dropped and placed again from \p src, or only
+     * have their protection changed if \p src is null. Missing pages are filled
+     * from \p src, or with zeros if it is null.
+     */
+    mres_t place(void *addr, const char *src, size_t bytes, bool wp);
+
+    /** @brief Unmap the pages, the next access faults */
+    mres_t drop(void *addr, size_t bytes);
+
+  private:
+    int fd = -1;
+    int wake_fd = -1;
+    std::atomic<bool> running = false;
+    std::thread fault_thread;
+    fault_f on_fault;
+    WorkerPool workers;
+
+    mres_t protect(void *addr, size_t bytes, bool wp);
+    void wake(void *addr, size_t bytes);
+    void serve();
+  };
+} // namespace libivy
+
+#endif // IVY_HEADER_LIBIVY_UFFD_H__
@@ -0,0 +1,613 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   uring.cc
+ * @date   Oct 16, 2026
+ * @brief  io_uring based event loop serving every connection of a node
+ */
+
+#include "error.hh"
+#include "../common.hh"
+#include "uring.hh"
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace libivy;
+
+static inline uint64_t mk_ud(uint64_t id, uint64_t op) {
+  return (id << 4) | op;
+}
+
+UringReactor::~UringReactor() {
+  this->stop();
+
+  for (auto &[id, conn] : this->conns)
+    close(conn->fd);
+
+  if (this->ring.fd != -1) {
+    munmap(this->ring.sqes, this->ring.sqes_sz);
+    if (this->ring.cq_ptr != this->ring.sq_ptr)
+      munmap(this->ring.cq_ptr, this->ring.cq_sz);
+    munmap(this->ring.sq_ptr, this->ring.sq_sz);
+    close(this->ring.fd);
+  }
+
+  if (this->bufs != nullptr)
+    munmap(this->bufs, BUF_CNT * BUF_SZ);
+
+  if (this->wake_fd != -1)
+    close(this->wake_fd);
+}
+
+void UringReactor::stop() {
+  if (this->running.exchange(false)) {
+    this->wake();
+    if (this->loop_thread.joinable())
+      this->loop_thread.join();
+  }
+}
+
+mres_t UringReactor::setup_ring(unsigned entries) {
+  struct io_uring_params p {};
+
+  int fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (fd < 0)
+    return {"io_uring_setup failed: " + PSTR()};
+
+  auto &r = this->ring;
+  r.fd = fd;
+  r.sq_entries = p.sq_entries;
+  r.sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r.cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+  bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap)
+    r.sq_sz = r.cq_sz = std::max(r.sq_sz, r.cq_sz);
+
+  r.sq_ptr = mmap(nullptr, r.sq_sz, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (r.sq_ptr == MAP_FAILED)
+    return {"Mapping the SQ ring failed: " + PSTR()};
+
+  if (single_mmap) {
+    r.cq_ptr = r.sq_ptr;
+  } else {
+    r.cq_ptr = mmap(nullptr, r.cq_sz, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (r.cq_ptr == MAP_FAILED)
+      return {"Mapping the CQ ring failed: " + PSTR()};
+  }
+
+  r.sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+  auto sqes = mmap(nullptr, r.sqes_sz, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+    return {"Mapping the SQEs failed: " + PSTR()};
+
+  auto sq = reinterpret_cast<char*>(r.sq_ptr);
+  auto cq = reinterpret_cast<char*>(r.cq_ptr);
+
+  r.sqes     = reinterpret_cast<struct io_uring_sqe*>(sqes);
+  r.sq_head  = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+  r.sq_tail  = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+  r.sq_mask  = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+  r.sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+  r.cq_head  = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+  r.cq_tail  = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+  r.cq_mask  = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+  r.cqes     = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+
+  r.sq_local_tail = *r.sq_tail;
+
+  return {};
+}
+
+void UringReactor::register_bufs() {
+  auto area = mmap(nullptr, BUF_CNT * BUF_SZ, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (area == MAP_FAILED) {
+    DBGW << "No memory for registered buffers: " << PSTR() << std::endl;
+    return;
+  }
+
+  vector<struct iovec> iov(BUF_CNT);
+  for (size_t i = 0; i < BUF_CNT; i++) {
+    iov[i].iov_base = reinterpret_cast<char*>(area) + i * BUF_SZ;
+    iov[i].iov_len = BUF_SZ;
+  }
+
+  int ret = syscall(__NR_io_uring_register, this->ring.fd,
+		    IORING_REGISTER_BUFFERS, iov.data(), BUF_CNT);
+  if (ret < 0) {
+    /* Not fatal, payloads are received into the message instead */
+    DBGW << "Registering buffers failed: " << PSTR() << std::endl;
+    munmap(area, BUF_CNT * BUF_SZ);
+    return;
+  }
+
+  this->bufs = reinterpret_cast<char*>(area);
+  for (size_t i = 0; i < BUF_CNT; i++)
+    this->free_bufs.push_back(i);
+}
+
+mres_t UringReactor::start(unsigned entries) {
+  auto err = this->setup_ring(entries);
+  if (err.has_value())
+    return err;
+
+  this->register_bufs();
+
+  this->wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (this->wake_fd == -1)
+    return {"eventfd failed: " + PSTR()};
+
+  this->running = true;
+  this->loop_thread = std::thread([this]() { this->loop(); });
+
+  return {};
+}
+
+struct io_uring_sqe *UringReactor::get_sqe() {
+  auto &r = this->ring;
+
+  unsigned head = __atomic_load_n(r.sq_head, __ATOMIC_ACQUIRE);
+  if (r.sq_local_tail - head >= r.sq_entries) {
+    /* Ring full, push what we have to the kernel */
+    this->submit(0);
+    head = __atomic_load_n(r.sq_head, __ATOMIC_ACQUIRE);
+
+    if (r.sq_local_tail - head >= r.sq_entries)
+      IVY_ERROR("io_uring submission queue stuck");
+  }
+
+  unsigned idx = r.sq_local_tail & *r.sq_mask;
+  auto sqe = &r.sqes[idx];
+  std::memset(sqe, 0, sizeof(*sqe));
+
+  r.sq_array[idx] = idx;
+  r.sq_local_tail++;
+  r.to_submit++;
+
+  return sqe;
+}
+
+int UringReactor::submit(unsigned wait_nr) {
+  auto &r = this->ring;
+
+  __atomic_store_n(r.sq_tail, r.sq_local_tail, __ATOMIC_RELEASE);
+
+  while (true) {
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int ret = syscall(__NR_io_uring_enter, r.fd, r.to_submit, wait_nr,
+		      flags, nullptr, 0);
+
+    if (ret >= 0) {
+      r.to_submit -= ret;
+      return ret;
+    }
+
+    if (errno == EINTR)
+      continue;
+
+    /* Completion queue is full, the caller reaps and comes back */
+    if (errno == EBUSY || errno == EAGAIN)
+      return 0;
+
+    IVY_PERROR("io_uring_enter failed");
+  }
+}
+
+void UringReactor::post(cmd_t cmd) {
+  {
+    ivyguard(this->cmd_lock);
+    this->cmds.push_back(std::move(cmd));
+  }
+
+  this->wake();
+}
+
+void UringReactor::wake() {
+  /* One eventfd write is enough to get the loop going again */
+  if (!this->wake_pending.exchange(true)) {
+    uint64_t one = 1;
+    if (write(this->wake_fd, &one, sizeof(one)) == -1)
+      DBGE << "Waking the reactor failed: " << PSTR() << std::endl;
+  }
+}
+
+uint64_t UringReactor::add_conn(int fd, frame_f on_frame,
+				close_f on_close) {
+  cmd_t cmd {};
+  cmd.kind = cmd_t::ADD;
+  cmd.id = this->next_id++;
+  cmd.fd = fd;
+  cmd.on_frame = std::move(on_frame);
+  cmd.on_close = std::move(on_close);
+
+  auto id = cmd.id;
+  this->post(std::move(cmd));
+
+  return id;
+}
+
+void UringReactor::add_listener(int fd, accept_f on_accept) {
+  cmd_t cmd {};
+  cmd.kind = cmd_t::LISTEN;
+  cmd.id = this->next_id++;
+  cmd.fd = fd;
+  cmd.on_accept = std::move(on_accept);
+
+  this->post(std::move(cmd));
+}
+
+void UringReactor::send(uint64_t conn, msg_t msg) {
+  cmd_t cmd {};
+  cmd.kind = cmd_t::SEND;
+  cmd.id = conn;
+  cmd.msg = std::move(msg);
+
+  this->post(std::move(cmd));
+}
+
+void UringReactor::close_conn(uint64_t conn) {
+  cmd_t cmd {};
+  cmd.kind = cmd_t::CLOSE;
+  cmd.id = conn;
+
+  this->post(std::move(cmd));
+}
+
+void UringReactor::loop() {
+  this->arm_wake();
+
+  while (this->running) {
+    this->run_cmds();
+    this->submit(1);
+
+    /* Reap everything that completed, new SQEs queued by the handlers
+       go out with the next io_uring_enter() */
+    auto &r = this->ring;
+    unsigned head = *r.cq_head;
+    while (head != __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE)) {
+      auto cqe = r.cqes[head & *r.cq_mask];
+      __atomic_store_n(r.cq_head, ++head, __ATOMIC_RELEASE);
+
+      this->complete(cqe.user_data, cqe.res);
+    }
+  }
+}
+
+void UringReactor::run_cmds() {
+  vector<cmd_t> pending;
+  {
+    ivyguard(this->cmd_lock);
+    std::swap(pending, this->cmds);
+  }
+
+  for (auto &cmd : pending) {
+    switch (cmd.kind) {
+    case cmd_t::ADD: {
+      auto conn = std::make_unique<uconn_t>();
+      conn->id = cmd.id;
+      conn->fd = cmd.fd;
+      conn->on_frame = std::move(cmd.on_frame);
+      conn->on_close = std::move(cmd.on_close);
+
+      auto &ref = *conn;
+      this->conns[cmd.id] = std::move(conn);
+      this->arm_rx(ref);
+      break;
+    }
+    case cmd_t::LISTEN: {
+      auto &lst = this->listeners[cmd.id];
+      lst.fd = cmd.fd;
+      lst.on_accept = std::move(cmd.on_accept);
+      this->arm_accept(cmd.id, lst);
+      break;
+    }
+    case cmd_t::SEND: {
+      auto it = this->conns.find(cmd.id);
+      if (it == this->conns.end() || it->second->closing) {
+	DBGH << "Dropping frame for closed connection " << cmd.id
+	     << std::endl;
+	break;
+      }
+
+      it->second->txq.push_back(std::move(cmd.msg));
+      this->kick_tx(*it->second);
+      break;
+    }
+    case cmd_t::CLOSE: {
+      auto it = this->conns.find(cmd.id);
+      if (it != this->conns.end()) {
+	this->fail(*it->second, "Closed locally");
+	this->maybe_finalize(cmd.id);
+      }
+      break;
+    }
+    }
+  }
+}
+
+void UringReactor::arm_wake() {
+  auto sqe = this->get_sqe();
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = this->wake_fd;
+  sqe->addr = reinterpret_cast<uint64_t>(&this->wake_buf);
+  sqe->len = sizeof(this->wake_buf);
+  sqe->user_data = mk_ud(0, OP_WAKE);
+}
+
+void UringReactor::arm_accept(uint64_t id, listener_t &lst) {
+  auto sqe = this->get_sqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = lst.fd;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = mk_ud(id, OP_ACCEPT);
+}
+
+void UringReactor::arm_rx(uconn_t &conn) {
+  auto sqe = this->get_sqe();
+  sqe->fd = conn.fd;
+  sqe->user_data = mk_ud(conn.id, OP_RX);
+
+  if (conn.hdr_got < sizeof(conn.hdr)) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->addr = reinterpret_cast<uint64_t>(&conn.hdr) + conn.hdr_got;
+    sqe->len = sizeof(conn.hdr) - conn.hdr_got;
+  } else if (conn.buf >= 0) {
+    /* Sockets don't have a file position, the offset must stay 0 */
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->addr = reinterpret_cast<uint64_t>(this->bufs
+					   + conn.buf * BUF_SZ
+					   + conn.pay_got);
+    sqe->len = conn.hdr.len - conn.pay_got;
+    sqe->buf_index = conn.buf;
+    sqe->off = 0;
+  } else {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->addr = reinterpret_cast<uint64_t>(conn.payload.data()
+					   + conn.pay_got);
+    sqe->len = conn.hdr.len - conn.pay_got;
+  }
+
+  conn.inflight++;
+}
+
+void UringReactor::kick_tx(uconn_t &conn) {
+  if (conn.tx_busy || conn.txq.empty() || conn.closing)
+    return;
+
+  /* Everything queued so far leaves in one sendmsg */
+  size_t cnt = std::min(conn.txq.size(), TX_BATCH);
+
+  conn.tx_batch.clear();
+  conn.tx_hdrs.resize(cnt);
+  conn.tx_iov.clear();
+  conn.tx_iov.reserve(cnt * 2);
+
+  for (size_t i = 0; i < cnt; i++) {
+    conn.tx_batch.push_back(std::move(conn.txq.front()));
+    conn.txq.pop_front();
+  }
+
+  /* Only point into the batch once it is complete, growing it moves
+     the messages and short payloads live inside them */
+  for (size_t i = 0; i < cnt; i++) {
+    auto &msg = conn.tx_batch[i];
+    conn.tx_hdrs[i] = msg.hdr;
+    conn.tx_hdrs[i].len = static_cast<uint32_t>(msg.payload.size());
+
+    conn.tx_iov.push_back({&conn.tx_hdrs[i], sizeof(msg_hdr_t)});
+    if (!msg.payload.empty())
+      conn.tx_iov.push_back({msg.payload.data(), msg.payload.size()});
+  }
+
+  conn.tx_iov_off = 0;
+  conn.tx_busy = true;
+  this->arm_tx(conn);
+}
+
+void UringReactor::arm_tx(uconn_t &conn) {
+  std::memset(&conn.tx_mh, 0, sizeof(conn.tx_mh));
+  conn.tx_mh.msg_iov = conn.tx_iov.data() + conn.tx_iov_off;
+  conn.tx_mh.msg_iovlen = conn.tx_iov.size() - conn.tx_iov_off;
+
+  auto sqe = this->get_sqe();
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = conn.fd;
+  sqe->addr = reinterpret_cast<uint64_t>(&conn.tx_mh);
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = mk_ud(conn.id, OP_TX);
+
+  conn.inflight++;
+}
+
+void UringReactor::complete(uint64_t user_data, int res) {
+  uint64_t id = user_data >> 4;
+  auto op = static_cast<op_t>(user_data & 0xf);
+
+  if (op == OP_WAKE) {
+    this->wake_pending = false;
+    if (this->running)
+      this->arm_wake();
+    return;
+  }
+
+  if (op == OP_ACCEPT) {
+    auto it = this->listeners.find(id);
+    if (it == this->listeners.end()) {
+      if (res >= 0) close(res);
+      return;
+    }
+
+    if (res >= 0) {
+      it->second.on_accept(res);
+    } else if (res != -EINTR && res != -ECONNABORTED && res != -EAGAIN) {
+      DBGH << "accept failed: " << strerror(-res) << std::endl;
+      this->listeners.erase(it);
+      return;
+    }
+
+    this->arm_accept(id, it->second);
+    return;
+  }
+
+  auto it = this->conns.find(id);
+  if (it == this->conns.end()) {
+    DBGE << "Completion for unknown connection " << id << std::endl;
+    return;
+  }
+
+  auto &conn = *it->second;
+  conn.inflight--;
+
+  if (op == OP_RX)
+    this->on_rx(conn, res);
+  else
+    this->on_tx(conn, res);
+
+  this->maybe_finalize(id);
+}
+
+void UringReactor::on_rx(uconn_t &conn, int res) {
+  if (conn.closing)
+    return;
+
+  if (res == -EINTR || res == -EAGAIN) {
+    this->arm_rx(conn);
+    return;
+  }
+
+  if (res <= 0) {
+    this->fail(conn, res == 0 ? "Connection closed" : strerror(-res));
+    return;
+  }
+
+  bool frame_done = false;
+
+  if (conn.hdr_got < sizeof(conn.hdr)) {
+    conn.hdr_got += res;
+
+    if (conn.hdr_got == sizeof(conn.hdr)) {
+      /* Same bound as the threaded readers */
+      if (conn.hdr.len > this->max_payload) {
+	this->fail(conn, "Frame of " + std::to_string(conn.hdr.len)
+		   + " bytes");
+	return;
+      }
+
+      if (conn.hdr.len == 0) {
+	frame_done = true;
+      } else if (conn.hdr.len <= BUF_SZ && !this->free_bufs.empty()) {
+	conn.buf = this->free_bufs.back();
+	this->free_bufs.pop_back();
+      } else {
+	conn.payload.resize(conn.hdr.len);
+      }
+    }
+  } else {
+    conn.pay_got += res;
+    frame_done = conn.pay_got == conn.hdr.len;
+  }
+
+  if (frame_done) {
+    msg_t msg {};
+    msg.hdr = conn.hdr;
+
+    if (conn.buf >= 0) {
+      msg.payload.assign(this->bufs + conn.buf * BUF_SZ, conn.hdr.len);
+      this->free_bufs.push_back(conn.buf);
+      conn.buf = -1;
+    } else {
+      msg.payload = std::move(conn.payload);
+    }
+
+    conn.hdr_got = 0;
+    conn.pay_got = 0;
+    conn.payload.clear();
+
+    conn.on_frame(std::move(msg));
+  }
+
+  if (!conn.closing)
+    this->arm_rx(conn);
+}
+
+void UringReactor::on_tx(uconn_t &conn, int res) {
+  if (conn.closing)
+    return;
+
+  if (res == -EINTR || res == -EAGAIN) {
+    this->arm_tx(conn);
+    return;
+  }
+
+  if (res < 0) {
+    this->fail(conn, strerror(-res));
+    return;
+  }
+
+  /* Skip over whatever made it out on a partial send */
+  size_t sent = res;
+  while (sent > 0 && conn.tx_iov_off < conn.tx_iov.size()) {
+    auto &iov = conn.tx_iov[conn.tx_iov_off];
+    if (sent >= iov.iov_len) {
+      sent -= iov.iov_len;
+      conn.tx_iov_off++;
+    } else {
+      iov.iov_base = reinterpret_cast<char*>(iov.iov_base) + sent;
+      iov.iov_len -= sent;
+      sent = 0;
+    }
+  }
+
+  if (conn.tx_iov_off < conn.tx_iov.size()) {
+    this->arm_tx(conn);
+    return;
+  }
+
+  conn.tx_busy = false;
+  conn.tx_batch.clear();
+  this->kick_tx(conn);
+}
+
+void UringReactor::fail(uconn_t &conn, string reason) {
+  if (conn.closing)
+    return;
+
+  DBGH << "Closing connection " << conn.id << ": " << reason << std::endl;
+
+  conn.closing = true;
+  conn.close_reason = reason;
+  conn.txq.clear();
+
+  /* Makes the receive that is always armed complete */
+  shutdown(conn.fd, SHUT_RDWR);
+}
+
+void UringReactor::maybe_finalize(uint64_t id) {
+  auto it = this->conns.find(id);
+  if (it == this->conns.end())
+    return;
+
+  auto &conn = *it->second;
+  if (!conn.closing || conn.inflight > 0)
+    return;
+
+  close(conn.fd);
+
+  if (conn.buf >= 0)
+    this->free_bufs.push_back(conn.buf);
+
+  auto on_close = std::move(conn.on_close);
+  auto reason = conn.close_reason;
+
+  this->conns.erase(it);
+
+  on_close(reason);
+}
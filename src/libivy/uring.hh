@@ -0,0 +1,190 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   uring.hh
+ * @date   Oct 16, 2026
+ * @brief  io_uring based event loop serving every connection of a node
+ */
+
+#ifndef IVY_HEADER_LIBIVY_URING_H__
+#define IVY_HEADER_LIBIVY_URING_H__
+
+#include "common.hh"
+#include "wire.hh"
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+namespace libivy {
+  using std::string;
+  using std::vector;
+
+  /**
+   * @brief Single threaded reactor driving sockets through io_uring.
+   *
+   * Connections are handed over with \ref add_conn and from then on
+   * the reactor owns the fd: it keeps a receive armed on every
+   * connection, reassembles frames and hands them to the connection's
+   * callback, and coalesces queued outgoing frames into one sendmsg
+   * per connection. All submissions made during one loop iteration go
+   * to the kernel in a single io_uring_enter(). Page sized payloads are
+   * received into buffers registered with the ring.
+   *
+   * Every callback runs on the reactor thread and must not block.
+   */
+  class UringReactor {
+  public:
+    using frame_f  = std::function<void(msg_t)>;
+    using close_f  = std::function<void(string)>;
+    using accept_f = std::function<void(int)>;
+
+    /** @param max_payload Longest payload a frame may announce */
+    UringReactor(uint32_t max_payload) : max_payload(max_payload) {}
+    ~UringReactor();
+
+    /** @brief Set up the ring and start the reactor thread */
+    mres_t start(unsigned entries = 1024);
+
+    /**
+     * @brief Stop the reactor thread, no callback runs once it returns.
+     * The sockets stay open until the reactor is destroyed.
+     */
+    void stop();
+
+    /** @brief Hand a connected socket to the reactor, returns its id */
+    uint64_t add_conn(int fd, frame_f on_frame, close_f on_close);
+
+    /** @brief Accept connections on a listening socket */
+    void add_listener(int fd, accept_f on_accept);
+
+    /** @brief Queue a frame on a connection, dropped if it is closed */
+    void send(uint64_t conn, msg_t msg);
+
+    /** @brief Shut a connection down, its close callback still runs */
+    void close_conn(uint64_t conn);
+
+  private:
+    /* Registered receive buffers */
+    static constexpr size_t BUF_CNT = 64;
+    static constexpr size_t BUF_SZ = 16384;
+
+    /* Most frames coalesced into one sendmsg */
+    static constexpr size_t TX_BATCH = 64;
+
+    enum op_t : uint64_t {
+      OP_RX     = 1,
+      OP_TX     = 2,
+      OP_ACCEPT = 3,
+      OP_WAKE   = 4,
+    };
+
+    struct ring_t {
+      int fd = -1;
+      unsigned sq_entries = 0;
+      unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+      unsigned *cq_head, *cq_tail, *cq_mask;
+      struct io_uring_sqe *sqes = nullptr;
+      struct io_uring_cqe *cqes = nullptr;
+      void *sq_ptr = nullptr, *cq_ptr = nullptr;
+      size_t sq_sz = 0, cq_sz = 0, sqes_sz = 0;
+      unsigned sq_local_tail = 0;
+      unsigned to_submit = 0;
+    };
+
+    struct uconn_t {
+      uint64_t id;
+      int fd;
+      frame_f on_frame;
+      close_f on_close;
+
+      /* Receive side, header first and then the payload */
+      msg_hdr_t hdr;
+      size_t hdr_got = 0;
+      string payload;
+      size_t pay_got = 0;
+      int buf = -1;            /* Registered buffer holding payload */
+
+      /* Transmit side */
+      std::deque<msg_t> txq;
+      vector<msg_t> tx_batch;
+      vector<msg_hdr_t> tx_hdrs;
+      vector<struct iovec> tx_iov;
+      size_t tx_iov_off = 0;
+      struct msghdr tx_mh;
+      bool tx_busy = false;
+
+      int inflight = 0;        /* SQEs the kernel still owns */
+      bool closing = false;
+      string close_reason;
+    };
+
+    struct listener_t {
+      int fd;
+      accept_f on_accept;
+    };
+
+    struct cmd_t {
+      enum { ADD, LISTEN, SEND, CLOSE } kind;
+      uint64_t id;
+      int fd;
+      msg_t msg;
+      frame_f on_frame;
+      close_f on_close;
+      accept_f on_accept;
+    };
+
+    uint32_t max_payload;
+
+    ring_t ring;
+    int wake_fd = -1;
+    uint64_t wake_buf;
+    std::atomic<bool> wake_pending = false;
+    std::atomic<bool> running = false;
+    std::thread loop_thread;
+
+    std::mutex cmd_lock;
+    vector<cmd_t> cmds;
+    std::atomic<uint64_t> next_id = 1;
+
+    std::map<uint64_t, std::unique_ptr<uconn_t>> conns;
+    std::map<uint64_t, listener_t> listeners;
+
+    char *bufs = nullptr;
+    vector<int> free_bufs;
+
+    mres_t setup_ring(unsigned entries);
+    void register_bufs();
+
+    struct io_uring_sqe *get_sqe();
+    int submit(unsigned wait_nr);
+
+    void post(cmd_t cmd);
+    void wake();
+    void loop();
+    void run_cmds();
+    void complete(uint64_t user_data, int res);
+
+    void arm_wake();
+    void arm_rx(uconn_t &conn);
+    void arm_tx(uconn_t &conn);
+    void arm_accept(uint64_t id, listener_t &lst);
+
+    void on_rx(uconn_t &conn, int res);
+    void on_tx(uconn_t &conn, int res);
+    void kick_tx(uconn_t &conn);
+    void fail(uconn_t &conn, string reason);
+    void maybe_finalize(uint64_t id);
+  };
+} // namespace libivy
+
+#endif // IVY_HEADER_LIBIVY_URING_H__
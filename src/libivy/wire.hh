@@ -0,0 +1,98 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   wire.hh
+ * @date   Oct 16, 2026
+ * @brief  Binary message format used for moving pages between nodes
+ */
+
+#ifndef IVY_HEADER_LIBIVY_WIRE_H__
+#define IVY_HEADER_LIBIVY_WIRE_H__
+
+#include "common.hh"
+
+#include <cstdint>
+#include <string>
+
+namespace libivy {
+  using std::string;
+
+  /** @brief Operations carried in the header of every message */
+  enum IvyOpcode : uint16_t {
+    OP_GET_RD_PG   = 1, /* Ask the manager for a read copy */
+    OP_GET_WR_PG   = 2, /* Ask the manager for write ownership */
+    OP_FETCH_PG    = 3, /* Manager asks the owner for the page */
+    OP_INVALIDATE  = 4, /* Manager invalidates a copy */
+    OP_CALL        = 5, /* Named string RPC, payload is "name\0args" */
+    OP_PUSH_PG     = 6, /* Owner sends a page straight to the faulting node */
+    OP_RC_FETCH    = 7, /* Read the home copy, release consistency only */
+    OP_RC_DIFF     = 8, /* Merge a writer's diff into the home copy */
+    OP_LOCK_ACQ    = 9, /* Take a lock, pg_addr is the lock id */
+    OP_LOCK_REL    = 10, /* Free a lock, payload lists the pages written */
+    OP_WU_UPDATE   = 11, /* Writer sends the bytes a store changed */
+    OP_WU_APPLY    = 12, /* Manager passes them on to a copy */
+    OP_DIR_ACK     = 13, /* Requester installed the page it was granted */
+  };
+
+  /* Message flags */
+  constexpr uint16_t MSG_F_ERR  = 1 << 0; /* Request failed, caller retries */
+  constexpr uint16_t MSG_F_RESP = 1 << 1; /* Frame answers request `tag' */
+  constexpr uint16_t MSG_F_DIFF = 1 << 2; /* Page as a diff, see pagediff.hh */
+  constexpr uint16_t MSG_F_LZ   = 1 << 3; /* Compressed, see compress.hh */
+  constexpr uint16_t MSG_F_PUSH = 1 << 4; /* Page goes to node with OP_PUSH_PG */
+
+  /**
+   * @brief Fixed header sent in front of every binary message, the
+   * payload (raw page bytes, if any) follows immediately.
+   */
+  struct __attribute__((packed)) msg_hdr_t {
+    uint16_t opcode;
+    uint16_t flags;
+    uint32_t node;     /* Sender, the faulting node of a forwarded request
+			  or pushed fetch and the new owner of an
+			  invalidation */
+    uint64_t tag;      /* Request id, echoed back in the response */
+    uint64_t pg_addr;  /* Page aligned address */
+    uint32_t access;   /* IvyAccessType requested */
+    uint32_t len;      /* Bytes of payload after the header */
+    uint64_t version;  /* Page version held (request) or sent (response) */
+    uint64_t written;  /* Sub-blocks the owner wrote, in fetch replies */
+  };
+
+  static_assert(sizeof(msg_hdr_t) == 48, "msg_hdr_t must be packed");
+
+  /**
+   * @brief Longest payload a frame may carry unless the transport is
+   * set up for more (rpc_cfg_t::max_payload), a page or the string of
+   * a named call fit with room to spare. A longer one comes from a
+   * corrupt or hostile peer, its connection is dropped.
+   */
+  constexpr uint32_t MAX_PAYLOAD = 1 << 16;
+
+  struct msg_t {
+    msg_hdr_t hdr;
+    string payload;
+  };
+
+  static inline msg_t make_msg(IvyOpcode opcode, size_t node,
+			       uint64_t pg_addr,
+			       IvyAccessType access = IvyAccessType::NONE,
+			       string payload = "") {
+    msg_t msg{};
+
+    msg.hdr.opcode  = opcode;
+    msg.hdr.flags   = 0;
+    msg.hdr.node    = static_cast<uint32_t>(node);
+    msg.hdr.tag     = 0;
+    msg.hdr.pg_addr = pg_addr;
+    msg.hdr.access  = access;
+    msg.hdr.len     = static_cast<uint32_t>(payload.size());
+    msg.hdr.version = 0;
+    msg.hdr.written = 0;
+    msg.payload     = std::move(payload);
+
+    return msg;
+  }
+} // namespace libivy
+
+#endif // IVY_HEADER_LIBIVY_WIRE_H__
@@ -0,0 +1,217 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   workerpool.hh
+ * @date   Oct 16, 2026
+ * @brief  Growable pool of threads for running RPC handlers
+ */
+
+#ifndef IVY_HEADER_LIBIVY_WORKERPOOL_H__
+#define IVY_HEADER_LIBIVY_WORKERPOOL_H__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+namespace libivy {
+  /**
+   * @brief Runs submitted jobs on background threads. A new thread is
+   * started whenever every existing one is busy, so a handler that
+   * blocks on another RPC can never starve the jobs queued behind it.
+   * Threads beyond \ref MIN_IDLE exit after sitting idle for a while
+   * and are joined by the next submit(). stop() runs what is queued
+   * and joins every thread.
+   */
+  class WorkerPool {
+  private:
+    using job_t = std::function<void()>;
+
+    static constexpr size_t MIN_IDLE = 4;
+    static constexpr auto IDLE_TIMEOUT = std::chrono::seconds(10);
+
+    std::mutex lock;
+    std::condition_variable cv;
+    std::deque<job_t> jobs;
+    size_t idle = 0;
+    bool stopping = false;
+    std::map<std::thread::id, std::thread> threads;
+    std::vector<std::thread::id> retired;   /* Exited, not joined yet */
+
+    void worker() {
+      std::unique_lock<std::mutex> guard(this->lock);
+
+      while (true) {
+	this->idle++;
+	bool timed_out
+	  = !this->cv.wait_for(guard, IDLE_TIMEOUT, [&] {
+	    return this->stopping || !this->jobs.empty();
+	  });
+	this->idle--;
+
+	if (this->jobs.empty()) {
+	  if (this->stopping)
+	    return;
+
+	  if (timed_out && this->idle >= MIN_IDLE) {
+	    this->retired.push_back(std::this_thread::get_id());
+	    return;
+	  }
+	  continue;
+	}
+
+	auto job = std::move(this->jobs.front());
+	this->jobs.pop_front();
+
+	guard.unlock();
+	job();
+	guard.lock();
+      }
+    }
+
+    /** @brief Join the threads that left on their own, lock held */
+    void reap() {
+      for (auto id : this->retired) {
+	auto it = this->threads.find(id);
+	it->second.join();
+	this->threads.erase(it);
+      }
+
+      this->retired.clear();
+    }
+
+  public:
+    WorkerPool() = default;
+    WorkerPool(const WorkerPool&) = delete;
+    ~WorkerPool() { this->stop(); }
+
+    void submit(job_t job) {
+      {
+	std::lock_guard<std::mutex> guard(this->lock);
+	this->reap();
+	this->jobs.push_back(std::move(job));
+
+	if (this->jobs.size() > this->idle) {
+	  std::thread thread([this] { this->worker(); });
+	  auto id = thread.get_id();
+	  this->threads.emplace(id, std::move(thread));
+	}
+      }
+
+      this->cv.notify_one();
+    }
+
+    /**
+     * @brief Run the queued jobs and join every thread. Jobs submitted
+     * meanwhile, say by a running job, still run before it returns.
+     */
+    void stop() {
+      while (true) {
+	std::map<std::thread::id, std::thread> threads;
+	{
+	  std::lock_guard<std::mutex> guard(this->lock);
+	  this->stopping = true;
+	  this->retired.clear();
+	  std::swap(threads, this->threads);
+	}
+
+	if (threads.empty())
+	  return;
+
+	this->cv.notify_all();
+	for (auto &[id, thread] : threads)
+	  thread.join();
+      }
+    }
+  };
+
+  /**
+   * @brief A single thread pinned to one core, running the jobs
+   * submitted to it one after another in submission order.
+   */
+  class PinnedWorker {
+  private:
+    using job_t = std::function<void()>;
+
+    std::mutex lock;
+    std::condition_variable cv;
+    std::deque<job_t> jobs;
+    bool stopping = false;
+    bool done = false;   /* The thread ran out of jobs after stop() */
+    std::thread thread;
+
+    void run() {
+      std::unique_lock<std::mutex> guard(this->lock);
+
+      while (true) {
+	this->cv.wait(guard, [&] {
+	  return this->stopping || !this->jobs.empty();
+	});
+
+	if (this->jobs.empty()) {
+	  this->done = true;
+	  return;
+	}
+
+	auto job = std::move(this->jobs.front());
+	this->jobs.pop_front();
+
+	guard.unlock();
+	job();
+	guard.lock();
+      }
+    }
+
+  public:
+    PinnedWorker(size_t cpu) {
+      this->thread = std::thread([this] { this->run(); });
+
+      /* Only a hint, the worker still runs if pinning fails */
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu % CPU_SETSIZE, &set);
+      pthread_setaffinity_np(this->thread.native_handle(), sizeof(set),
+			     &set);
+    }
+
+    ~PinnedWorker() { this->stop(); }
+
+    /**
+     * @brief Run the queued jobs and join the thread. Jobs submitted
+     * afterwards run right away on the submitting thread.
+     */
+    void stop() {
+      {
+	std::lock_guard<std::mutex> guard(this->lock);
+	this->stopping = true;
+      }
+
+      this->cv.notify_one();
+      if (this->thread.joinable())
+	this->thread.join();
+    }
+
+    void submit(job_t job) {
+      {
+	std::lock_guard<std::mutex> guard(this->lock);
+	if (!this->done) {
+	  this->jobs.push_back(std::move(job));
+	  job = nullptr;
+	}
+      }
+
+      if (job)
+	job();
+      else
+	this->cv.notify_one();
+    }
+  };
+} // namespace libivy
+
+#endif // IVY_HEADER_LIBIVY_WORKERPOOL_H__
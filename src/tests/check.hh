@@ -0,0 +1,37 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   check.hh
+ * @date   Oct 16, 2026
+ * @brief  Minimal assertions for the libivy unit tests
+ */
+
+#ifndef IVY_HEADER_TESTS_CHECK_H__
+#define IVY_HEADER_TESTS_CHECK_H__
+
+#include <cstdlib>
+#include <iostream>
+
+namespace ivytest {
+  inline int failures = 0;
+}
+
+/** @brief Report a failed condition and keep going */
+#define CHECK(cond)							\
+  do {									\
+    if (!(cond)) {							\
+      std::cerr << __FILE__ << ":" << __LINE__				\
+		<< ": check failed: " #cond << std::endl;		\
+      ivytest::failures++;						\
+    }									\
+  } while (0)
+
+/** @brief Exit status of a test binary, prints a one line summary */
+#define CHECK_DONE()							\
+  ([]() {								\
+    std::cout << __FILE__ << ": "					\
+	      << (ivytest::failures ? "FAILED" : "ok") << std::endl;	\
+    return ivytest::failures ? EXIT_FAILURE : EXIT_SUCCESS;		\
+  }())
+
+#endif // IVY_HEADER_TESTS_CHECK_H__
@@ -0,0 +1,149 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   test_compress.cc
+ * @date   Oct 16, 2026
+ * @brief  Round trips through the LZ codec and its message wrapper
+ */
+
+#include "check.hh"
+#include "compress.hh"
+
+#include <cstring>
+#include <random>
+#include <string>
+
+using namespace libivy;
+
+static constexpr size_t PG_SZ = 4096;
+
+static std::string random_bytes(size_t len, uint32_t seed) {
+  std::mt19937 gen(seed);
+  std::string out(len, '\0');
+
+  for (auto &c : out)
+    c = static_cast<char>(gen());
+
+  return out;
+}
+
+static void round_trip(const std::string &raw) {
+  auto packed = lz_compress(raw.data(), raw.size());
+  CHECK(!packed.empty());
+  CHECK(packed.size() < raw.size());
+
+  auto [out, err] = lz_decompress(packed, raw.size());
+  CHECK(!err.has_value());
+  CHECK(out == raw);
+}
+
+static void test_zero_page() {
+  round_trip(std::string(PG_SZ, '\0'));
+}
+
+static void test_mixed_page() {
+  /* Repeated records with a changing field, long literal runs and
+     matches longer than the 15 a token holds */
+  std::string raw;
+  for (int i = 0; raw.size() < PG_SZ; i++)
+    raw += "record " + std::to_string(i) + ": "
+      + std::string(i % 40, 'x') + "\n";
+  raw.resize(PG_SZ);
+  raw.replace(1000, 300, random_bytes(300, 1));
+
+  round_trip(raw);
+}
+
+static void test_incompressible() {
+  auto raw = random_bytes(PG_SZ, 2);
+
+  /* Not smaller than the input, the caller sends it as is */
+  CHECK(lz_compress(raw.data(), raw.size()).empty());
+
+  /* Too short to hold a match */
+  CHECK(lz_compress("abc", 3).empty());
+}
+
+static void test_malformed() {
+  auto raw = std::string(PG_SZ, 'a');
+  auto packed = lz_compress(raw.data(), raw.size());
+
+  CHECK(lz_decompress(packed, PG_SZ - 1).second.has_value());
+  CHECK(lz_decompress(packed, PG_SZ + 1).second.has_value());
+  CHECK(lz_decompress(packed.substr(0, packed.size() / 2), PG_SZ)
+	.second.has_value());
+
+  /* A match reaching back before the start of the output */
+  std::string bad_offset = {0x10, 'a', 0x05, 0x00};
+  CHECK(lz_decompress(bad_offset, 5).second.has_value());
+}
+
+static void test_pack() {
+  IvyStats stats;
+  LzPolicy policy;
+  auto raw = std::string(PG_SZ, 'q');
+
+  /* Off by default */
+  auto msg = make_msg(OP_FETCH_PG, 0, 0x1000, IvyAccessType::RD, raw);
+  lz_pack(msg, policy, stats);
+  CHECK(!(msg.hdr.flags & MSG_F_LZ));
+  CHECK(msg.payload == raw);
+
+  policy.set_mode(LZ_ON);
+  lz_pack(msg, policy, stats);
+  CHECK(msg.hdr.flags & MSG_F_LZ);
+  CHECK(msg.payload.size() < raw.size());
+  CHECK(stats.lz_sent == 1);
+
+  CHECK(!lz_unpack(msg, stats).has_value());
+  CHECK(!(msg.hdr.flags & MSG_F_LZ));
+  CHECK(msg.payload == raw);
+
+  /* Random bytes go out as they are */
+  auto noise = random_bytes(PG_SZ, 3);
+  msg = make_msg(OP_FETCH_PG, 0, 0x1000, IvyAccessType::RD, noise);
+  lz_pack(msg, policy, stats);
+  CHECK(!(msg.hdr.flags & MSG_F_LZ));
+  CHECK(msg.payload == noise);
+  CHECK(stats.lz_skipped == 1);
+
+  /* A size larger than any frame is refused before allocating */
+  uint32_t huge = UINT32_MAX;
+  msg.payload.assign(reinterpret_cast<char*>(&huge), sizeof(huge));
+  msg.hdr.flags |= MSG_F_LZ;
+  CHECK(lz_unpack(msg, stats).has_value());
+}
+
+static void test_adaptive() {
+  LzPolicy policy;
+  policy.set_mode(LZ_ADAPTIVE);
+
+  CHECK(policy.should_try());
+
+  /* Each miss doubles the number of payloads skipped */
+  policy.record(PG_SZ, 0);
+  CHECK(!policy.should_try());
+  CHECK(policy.should_try());
+
+  policy.record(PG_SZ, 0);
+  CHECK(!policy.should_try());
+  CHECK(!policy.should_try());
+  CHECK(policy.should_try());
+
+  /* A hit resets the backoff */
+  policy.record(PG_SZ, PG_SZ / 4);
+  policy.record(PG_SZ, 0);
+  CHECK(!policy.should_try());
+  CHECK(policy.should_try());
+}
+
+int main() {
+  test_zero_page();
+  test_mixed_page();
+  test_incompressible();
+  test_malformed();
+  test_pack();
+  test_adaptive();
+
+  return CHECK_DONE();
+}
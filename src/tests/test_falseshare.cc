@@ -0,0 +1,75 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   test_falseshare.cc
+ * @date   Oct 16, 2026
+ * @brief  Sub-block masks and false sharing detection
+ */
+
+#include "check.hh"
+#include "falseshare.hh"
+
+#include <string>
+
+using namespace libivy;
+
+static constexpr size_t BLK_SZ = 16384;
+static constexpr size_t SUB_SZ = 256;
+
+static void test_take_mask() {
+  SubBlockTracker subblks(BLK_SZ, SUB_SZ);
+  std::string blk(BLK_SZ, '\0');
+
+  /* Nothing twinned, nothing to compare with */
+  CHECK(subblks.take_mask(0x10000, blk.data()) == 0);
+
+  subblks.twin(0x10000, blk.data());
+  blk[0] = 1;
+  blk[SUB_SZ - 1] = 1;
+  blk[3 * SUB_SZ] = 1;
+  blk[BLK_SZ - 1] = 1;
+
+  uint64_t want = (1ull << 0) | (1ull << 3) | (1ull << 63);
+  CHECK(subblks.take_mask(0x10000, blk.data()) == want);
+
+  /* The twin is gone after */
+  CHECK(subblks.take_mask(0x10000, blk.data()) == 0);
+
+  /* An unchanged block has an empty mask */
+  subblks.twin(0x10000, blk.data());
+  CHECK(subblks.take_mask(0x10000, blk.data()) == 0);
+}
+
+static void test_record() {
+  SubBlockTracker subblks(BLK_SZ, SUB_SZ);
+
+  /* The first writer has nobody to compare with */
+  CHECK(!subblks.record(0x10000, 1, 0x0f));
+
+  /* Same node again isn't a hand-off */
+  CHECK(!subblks.record(0x10000, 1, 0xf0));
+
+  /* Another node writing other sub-blocks is false sharing */
+  CHECK(subblks.record(0x10000, 2, 0x0f));
+
+  /* Overlapping writes are true sharing */
+  CHECK(!subblks.record(0x10000, 1, 0x01));
+
+  /* A read only hand-off changes nothing */
+  CHECK(!subblks.record(0x10000, 2, 0));
+  CHECK(!subblks.record(0x10000, 2, 0x01));
+
+  /* Another block never changed hands between disjoint writers */
+  CHECK(!subblks.record(0x20000, 1, 0x01));
+  CHECK(!subblks.record(0x20000, 2, 0x01));
+
+  auto report = subblks.report();
+  CHECK(report == "fs_block 0x10000 1 3\n");
+}
+
+int main() {
+  test_take_mask();
+  test_record();
+
+  return CHECK_DONE();
+}
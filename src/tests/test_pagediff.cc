@@ -0,0 +1,126 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   test_pagediff.cc
+ * @date   Oct 16, 2026
+ * @brief  Round trips through the page diff encoding
+ */
+
+#include "check.hh"
+#include "pagediff.hh"
+
+#include <cstring>
+#include <string>
+
+using namespace libivy;
+
+static constexpr size_t PG_SZ = 4096;
+
+static std::string page_of(char fill) {
+  return std::string(PG_SZ, fill);
+}
+
+/** @brief Diff base→cur, apply it to a copy of base, expect cur */
+static void round_trip(const std::string &base, const std::string &cur) {
+  auto diff = encode_diff(base.data(), cur.data(), PG_SZ);
+  CHECK(!diff.empty());
+  CHECK(diff.size() < PG_SZ);
+
+  auto page = base;
+  CHECK(!apply_diff(page.data(), diff, PG_SZ).has_value());
+  CHECK(page == cur);
+}
+
+static void test_unchanged() {
+  auto base = page_of('a');
+
+  /* An empty diff is still a single run so it isn't mistaken for
+     "not worth diffing" */
+  auto diff = encode_diff(base.data(), base.data(), PG_SZ);
+  CHECK(diff.size() == 4);
+
+  auto page = base;
+  CHECK(!apply_diff(page.data(), diff, PG_SZ).has_value());
+  CHECK(page == base);
+}
+
+static void test_sparse_changes() {
+  auto base = page_of('a');
+  auto cur = base;
+
+  cur[0] = 'b';
+  cur[17] = 'c';
+  cur[18] = 'd';
+  cur[2048] = 'e';
+  cur[PG_SZ - 1] = 'f';
+
+  round_trip(base, cur);
+}
+
+static void test_short_gaps() {
+  auto base = page_of('a');
+  auto cur = base;
+
+  /* Changes a byte or two apart end up in one run */
+  for (size_t i = 100; i < 200; i += 3)
+    cur[i] = 'z';
+
+  round_trip(base, cur);
+}
+
+static void test_fully_changed() {
+  auto base = page_of('a');
+  auto cur = page_of('b');
+
+  /* Not smaller than the page, the caller sends it whole */
+  CHECK(encode_diff(base.data(), cur.data(), PG_SZ).empty());
+}
+
+static void test_malformed() {
+  auto page = page_of('a');
+
+  CHECK(apply_diff(page.data(), std::string(3, '\0'), PG_SZ).has_value());
+
+  /* Skip the whole page, then one changed byte past its end */
+  std::string past_end = {0x00, 0x10, 0x01, 0x00, 'x'};
+  CHECK(apply_diff(page.data(), past_end, PG_SZ).has_value());
+}
+
+static void test_cache() {
+  PageDiffCache cache(PG_SZ);
+  auto v1 = page_of('a');
+  auto v2 = v1;
+  v2[42] = 'b';
+
+  cache.set_live(0x1000, 1);
+  CHECK(cache.live_version(0x1000) == 1);
+  CHECK(!cache.saved_version(0x1000).has_value());
+
+  cache.save_live(0x1000, v1.data());
+  CHECK(cache.saved_version(0x1000) == 1);
+
+  /* Only a diff against the version held is any use */
+  CHECK(!cache.diff_from(0x1000, 2, v2.data()).has_value());
+
+  auto diff = cache.diff_from(0x1000, 1, v2.data());
+  CHECK(diff.has_value());
+
+  auto [page, err] = cache.patch(0x1000, 1, *diff);
+  CHECK(!err.has_value());
+  CHECK(page == v2);
+
+  /* The saved copy is consumed by the patch */
+  CHECK(!cache.saved_version(0x1000).has_value());
+  CHECK(cache.patch(0x1000, 1, *diff).second.has_value());
+}
+
+int main() {
+  test_unchanged();
+  test_sparse_changes();
+  test_short_gaps();
+  test_fully_changed();
+  test_malformed();
+  test_cache();
+
+  return CHECK_DONE();
+}
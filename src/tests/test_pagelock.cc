@@ -0,0 +1,204 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   test_pagelock.cc
+ * @date   Oct 16, 2026
+ * @brief  Recursion, exclusion, hand-over order and lending of page
+ *         locks
+ */
+
+#include "check.hh"
+#include "pagelock.hh"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace libivy;
+using namespace std::chrono_literals;
+
+static void test_recursive() {
+  PageLock lock;
+
+  lock.lock();
+  CHECK(lock.try_lock());
+  lock.lock();
+  lock.unlock();
+  lock.unlock();
+
+  /* Still held once, another thread can't take it */
+  bool taken = true;
+  std::thread([&] { taken = lock.try_lock(); }).join();
+  CHECK(!taken);
+
+  lock.unlock();
+  std::thread([&] {
+    taken = lock.try_lock();
+    if (taken) lock.unlock();
+  }).join();
+  CHECK(taken);
+}
+
+static void test_exclusion() {
+  PageLock lock;
+  uint64_t counter = 0;
+  std::vector<std::thread> threads;
+
+  for (int t = 0; t < 4; t++)
+    threads.emplace_back([&] {
+      for (int i = 0; i < 20000; i++) {
+	std::lock_guard<PageLock> guard(lock);
+	counter++;
+      }
+    });
+
+  for (auto &t : threads)
+    t.join();
+
+  CHECK(counter == 4 * 20000);
+}
+
+static void test_fifo() {
+  PageLock lock;
+  std::mutex order_lock;
+  std::vector<int> order;
+  std::vector<std::thread> threads;
+
+  lock.lock();
+
+  /* Queue up one at a time, they get the lock in that order */
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&, t] {
+      std::lock_guard<PageLock> guard(lock);
+      std::lock_guard<std::mutex> o(order_lock);
+      order.push_back(t);
+    });
+    std::this_thread::sleep_for(20ms);
+  }
+
+  lock.unlock();
+
+  for (auto &t : threads)
+    t.join();
+
+  CHECK((order == std::vector<int>{0, 1, 2, 3}));
+}
+
+static void test_borrow_unlocked() {
+  PageLock lock;
+  bool borrowed = true;
+
+  /* Nobody holds it, borrowing just takes it */
+  std::thread([&] {
+    borrowed = lock.borrow();
+    if (!borrowed) lock.unlock();
+  }).join();
+  CHECK(!borrowed);
+
+  /* Held and not lent, the borrower waits for the unlock */
+  std::atomic<bool> done{false};
+  lock.lock();
+  std::thread waiter([&] {
+    borrowed = lock.borrow();
+    done = true;
+    if (!borrowed) lock.unlock();
+  });
+
+  std::this_thread::sleep_for(20ms);
+  CHECK(!done);
+
+  lock.unlock();
+  waiter.join();
+  CHECK(done && !borrowed);
+}
+
+static void test_lend() {
+  PageLock lock;
+  std::atomic<int> step{0};
+
+  lock.lock();
+
+  /* Waits until the holder lends the lock */
+  std::thread borrower([&] {
+    CHECK(lock.borrow());
+    step = 1;
+    std::this_thread::sleep_for(20ms);
+    step = 2;
+    lock.give_back();
+  });
+
+  std::this_thread::sleep_for(20ms);
+  CHECK(step == 0);
+
+  lock.lend();
+  while (step == 0)
+    std::this_thread::yield();
+
+  /* Reclaiming waits for the borrower to give it back */
+  lock.reclaim();
+  CHECK(step == 2);
+  borrower.join();
+
+  /* Lending again lets the next borrower in */
+  lock.lend();
+  bool borrowed = false;
+  std::thread([&] {
+    borrowed = lock.borrow();
+    if (borrowed) lock.give_back();
+  }).join();
+  CHECK(borrowed);
+  lock.reclaim();
+
+  /* Not lent anymore, another thread can't take it */
+  bool taken = true;
+  std::thread([&] { taken = lock.try_lock(); }).join();
+  CHECK(!taken);
+
+  lock.unlock();
+}
+
+static void test_one_borrower() {
+  PageLock lock;
+  std::atomic<int> inside{0};
+  std::atomic<int> most{0};
+  std::vector<std::thread> threads;
+
+  lock.lock();
+  lock.lend();
+
+  for (int t = 0; t < 4; t++)
+    threads.emplace_back([&] {
+      for (int i = 0; i < 200; i++) {
+	bool borrowed = lock.borrow();
+	int now = ++inside;
+	if (now > most) most = now;
+	inside--;
+
+	if (borrowed)
+	  lock.give_back();
+	else
+	  lock.unlock();
+      }
+    });
+
+  for (auto &t : threads)
+    t.join();
+
+  lock.reclaim();
+  lock.unlock();
+
+  CHECK(most == 1);
+}
+
+int main() {
+  test_recursive();
+  test_exclusion();
+  test_fifo();
+  test_borrow_unlocked();
+  test_lend();
+  test_one_borrower();
+
+  return CHECK_DONE();
+}
@@ -0,0 +1,96 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   test_pinwindow.cc
+ * @date   Oct 16, 2026
+ * @brief  Growth and decay of the pin window
+ */
+
+#include "check.hh"
+#include "pinwindow.hh"
+
+using namespace libivy;
+
+static constexpr uint64_t MIN_NS = 1000;
+static constexpr uint64_t MAX_NS = 8000;
+
+static void test_disabled() {
+  PinPolicy policy;
+  uint64_t window = 0;
+
+  CHECK(!policy.enabled());
+  CHECK(policy.delay_ns(window, 1, 2) == 0);
+  CHECK(window == 0);
+}
+
+static void test_not_written() {
+  PinPolicy policy;
+  policy.configure(MIN_NS, MAX_NS);
+  uint64_t window = 0;
+
+  /* Nobody holds the page writable, nothing to wait for */
+  CHECK(policy.delay_ns(window, 0, 100) == 0);
+  CHECK(window == 0);
+}
+
+static void test_doubling() {
+  PinPolicy policy;
+  policy.configure(MIN_NS, MAX_NS);
+  uint64_t window = 0;
+
+  /* Requests inside the window wait out the rest of it and double it */
+  CHECK(policy.delay_ns(window, 100, 400) == MIN_NS - 300);
+  CHECK(window == 2 * MIN_NS);
+
+  CHECK(policy.delay_ns(window, 100, 100) == 2 * MIN_NS);
+  CHECK(window == 4 * MIN_NS);
+
+  CHECK(policy.delay_ns(window, 100, 100) == 4 * MIN_NS);
+  CHECK(window == MAX_NS);
+
+  /* Capped at the maximum */
+  CHECK(policy.delay_ns(window, 100, 100) == MAX_NS);
+  CHECK(window == MAX_NS);
+}
+
+static void test_halving() {
+  PinPolicy policy;
+  policy.configure(MIN_NS, MAX_NS);
+  uint64_t window = MAX_NS;
+
+  /* Past the window but not by much, left as it is */
+  CHECK(policy.delay_ns(window, 100, 100 + 2 * MAX_NS) == 0);
+  CHECK(window == MAX_NS);
+
+  /* Long past it, halved down to the minimum */
+  uint64_t late = 100 + 100 * MAX_NS;
+  CHECK(policy.delay_ns(window, 100, late) == 0);
+  CHECK(window == MAX_NS / 2);
+
+  CHECK(policy.delay_ns(window, 100, late) == 0);
+  CHECK(policy.delay_ns(window, 100, late) == 0);
+  CHECK(window == MIN_NS);
+
+  CHECK(policy.delay_ns(window, 100, late) == 0);
+  CHECK(window == MIN_NS);
+}
+
+static void test_bad_range() {
+  PinPolicy policy;
+  uint64_t window = 0;
+
+  /* A maximum below the minimum is raised to it */
+  policy.configure(MIN_NS, MIN_NS / 2);
+  CHECK(policy.delay_ns(window, 100, 100) == MIN_NS);
+  CHECK(window == MIN_NS);
+}
+
+int main() {
+  test_disabled();
+  test_not_written();
+  test_doubling();
+  test_halving();
+  test_bad_range();
+
+  return CHECK_DONE();
+}
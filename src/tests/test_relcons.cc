@@ -0,0 +1,89 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   test_relcons.cc
+ * @date   Oct 16, 2026
+ * @brief  Address lists and lock hand-over of the release modes
+ */
+
+#include "check.hh"
+#include "relcons.hh"
+
+#include <vector>
+
+using namespace libivy;
+
+static void test_pack_addrs() {
+  vector<uint64_t> addrs = {0x1000, 0x7fff0000d000, 0, UINT64_MAX};
+
+  auto packed = pack_addrs(addrs);
+  CHECK(packed.size() == addrs.size() * sizeof(uint64_t));
+  CHECK(unpack_addrs(packed) == addrs);
+
+  CHECK(pack_addrs({}).empty());
+  CHECK(unpack_addrs("").empty());
+
+  /* A trailing partial address is ignored */
+  CHECK(unpack_addrs(packed + "abc") == addrs);
+}
+
+struct grant_t {
+  bool done = false;
+  vector<uint64_t> notices;
+  uint64_t seq = 0;
+};
+
+static LockTable::grant_f record(grant_t &g) {
+  return [&g](vector<uint64_t> notices, uint64_t seq) {
+    g.done = true;
+    g.notices = std::move(notices);
+    g.seq = seq;
+  };
+}
+
+static void test_lock_handover() {
+  LockTable locks;
+  grant_t a, b, c;
+
+  /* Free, granted right away */
+  locks.acquire(7, 0, record(a));
+  CHECK(a.done);
+  CHECK(a.notices.empty());
+  CHECK(a.seq == 0);
+
+  /* Held, both wait in order */
+  locks.acquire(7, 0, record(b));
+  locks.acquire(7, 0, record(c));
+  CHECK(!b.done);
+  CHECK(!c.done);
+
+  /* Another lock isn't affected */
+  grant_t other;
+  locks.acquire(8, 0, record(other));
+  CHECK(other.done);
+
+  locks.release(7, {0x1000, 0x2000});
+  CHECK(b.done);
+  CHECK(!c.done);
+  CHECK(b.seq == 1);
+  CHECK((b.notices == vector<uint64_t>{0x1000, 0x2000}));
+
+  locks.release(7, {0x2000});
+  CHECK(c.done);
+  CHECK(c.seq == 2);
+
+  /* An acquirer that saw seq 1 only gets the newer notice */
+  locks.release(7, {});
+  grant_t d;
+  locks.acquire(7, 1, record(d));
+  CHECK(d.done);
+  CHECK(d.seq == 3);
+  CHECK((d.notices == vector<uint64_t>{0x2000}));
+}
+
+int main() {
+  test_pack_addrs();
+  test_lock_handover();
+
+  return CHECK_DONE();
+}